@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "accesslog.hpp"
+
+static std::atomic<uint64_t> nextLogId = 1;
+
+AccessLog::AccessLog(const Options &_options) : options(_options), id(nextLogId++)
+{
+    options.sampleEvery = std::max(1u, options.sampleEvery);
+    size_t size = 1;
+    while (size < options.ringSize)
+        size <<= 1;
+    options.ringSize = size;
+    opened = openFile();
+    if (!opened)
+        return;
+    writer = std::thread(&AccessLog::run, this);
+}
+
+AccessLog::~AccessLog()
+{
+    {
+        std::lock_guard<std::mutex> guard(wakeLock);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable())
+        writer.join();
+    if (fd != -1)
+        close(fd);
+}
+
+bool AccessLog::openFile()
+{
+    fd = open(options.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        std::cerr << "Access log open error: " << options.path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    struct stat st;
+    fileBytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+    return true;
+}
+
+// The same as Metrics::local(): the lock is only taken the first time a
+// thread logs anything.
+AccessLog::Ring &AccessLog::local()
+{
+    thread_local uint64_t cachedId = 0;
+    thread_local Ring *cached = nullptr;
+    if (cachedId == id)
+    {
+        return *cached;
+    }
+    std::lock_guard<std::mutex> guard(ringsLock);
+    auto self = std::this_thread::get_id();
+    Ring *ring = nullptr;
+    for (auto &r : rings)
+    {
+        if (r->owner == self)
+            ring = r.get();
+    }
+    if (ring == nullptr)
+    {
+        rings.push_back(std::make_unique<Ring>());
+        ring = rings.back().get();
+        ring->owner = self;
+        ring->records.reset(new Record[options.ringSize]);
+        ring->mask = options.ringSize - 1;
+    }
+    cachedId = id;
+    cached = ring;
+    return *ring;
+}
+
+void AccessLog::log(std::string_view method, std::string_view resource, int status, uint64_t bytes,
+                    std::chrono::steady_clock::duration took, const struct sockaddr_in &peer)
+{
+    if (!opened)
+        return;
+    Ring &ring = local();
+    if (ring.seen++ % options.sampleEvery != 0)
+        return;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) > ring.mask)
+    {
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    Record &r = ring.records[head & ring.mask];
+    r.time = std::chrono::duration_cast<std::chrono::microseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+    r.bytes = bytes;
+    r.micros = (uint32_t)std::min<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(took).count(),
+                                           UINT32_MAX);
+    r.address = peer.sin_addr.s_addr;
+    r.port = peer.sin_port;
+    r.status = status;
+    r.methodLength = std::min(method.size(), sizeof(r.method));
+    memcpy(r.method, method.data(), r.methodLength);
+    r.resourceLength = std::min(resource.size(), maxResource);
+    memcpy(r.resource, resource.data(), r.resourceLength);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t AccessLog::dropped() const
+{
+    std::lock_guard<std::mutex> guard(ringsLock);
+    uint64_t sum = 0;
+    for (auto &r : rings)
+    {
+        sum += r->dropped.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void AccessLog::flush()
+{
+    if (opened)
+        drain();
+}
+
+void AccessLog::run()
+{
+    std::unique_lock<std::mutex> lock(wakeLock);
+    while (!stopping)
+    {
+        wake.wait_for(lock, options.flushInterval);
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+    lock.unlock();
+    drain();
+}
+
+// JSON strings can't have raw quotes, backslashes or control characters.
+static void appendEscaped(std::string &out, const char *s, size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+}
+
+void AccessLog::drain()
+{
+    std::lock_guard<std::mutex> draining(drainLock);
+    std::vector<Ring *> snapshot;
+    {
+        std::lock_guard<std::mutex> guard(ringsLock);
+        for (auto &r : rings)
+            snapshot.push_back(r.get());
+    }
+    std::string batch;
+    batch.reserve(64 << 10);
+    uint64_t lines = 0;
+    for (Ring *ring : snapshot)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail)
+        {
+            const Record &r = ring->records[tail & ring->mask];
+            time_t seconds = r.time / 1000000;
+            struct tm when;
+            gmtime_r(&seconds, &when);
+            char stamp[64];
+            size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &when);
+            snprintf(stamp + n, sizeof(stamp) - n, ".%06dZ", (int)(r.time % 1000000));
+            char address[INET_ADDRSTRLEN] = "";
+            inet_ntop(AF_INET, &r.address, address, sizeof(address));
+
+            char line[128];
+            batch += "{\"time\":\"";
+            batch += stamp;
+            snprintf(line, sizeof(line), "\",\"peer\":\"%s:%u\",\"method\":\"", address, ntohs(r.port));
+            batch += line;
+            appendEscaped(batch, r.method, r.methodLength);
+            batch += "\",\"resource\":\"";
+            appendEscaped(batch, r.resource, r.resourceLength);
+            snprintf(line, sizeof(line), "\",\"status\":%u,\"bytes\":%llu,\"latency_us\":%u}\n", r.status,
+                     (unsigned long long)r.bytes, r.micros);
+            batch += line;
+            ++lines;
+            if (batch.size() >= (64 << 10))
+            {
+                // Hand the slots back before the (slow) write.
+                ring->tail.store(tail + 1, std::memory_order_release);
+                writeOut(batch);
+            }
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    writeOut(batch);
+    linesWritten.fetch_add(lines, std::memory_order_relaxed);
+}
+
+void AccessLog::writeOut(std::string &batch)
+{
+    if (batch.empty())
+        return;
+    if (options.rotateBytes > 0 && fileBytes > 0 && fileBytes + batch.size() > options.rotateBytes)
+    {
+        rotate();
+    }
+    size_t done = 0;
+    while (done < batch.size() && fd != -1)
+    {
+        auto result = write(fd, batch.data() + done, batch.size() - done);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Access log write error: " << strerror(errno) << "\n";
+            break;
+        }
+        done += result;
+    }
+    fileBytes += done;
+    batch.clear();
+}
+
+// path.(keep-1) becomes path.keep, and so on down to path becoming path.1.
+void AccessLog::rotate()
+{
+    close(fd);
+    fd = -1;
+    for (unsigned int i = options.keep; i > 0; --i)
+    {
+        std::string from = i == 1 ? options.path : options.path + "." + std::to_string(i - 1);
+        std::string to = options.path + "." + std::to_string(i);
+        rename(from.c_str(), to.c_str());
+    }
+    if (options.keep == 0)
+        unlink(options.path.c_str());
+    openFile();
+}
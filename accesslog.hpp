@@ -0,0 +1,119 @@
+#ifndef _ACCESS_LOG_H
+#define _ACCESS_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+
+// The access log: one line of JSON per request, with the time, the
+// client's address, the method, the resource, the status, the bytes in
+// the response and how long the handler took.
+//
+// Logging never blocks the thread serving the request.  Each thread
+// writes fixed-size records into its own ring buffer, which a background
+// thread empties every flushInterval, formatting the records and writing
+// them out in large batches.  If a ring fills up faster than that the
+// record is dropped (and counted), rather than anybody waiting.  The file
+// is rotated, to "path.1", "path.2" and so on, once it reaches rotateBytes.
+class AccessLog
+{
+public:
+    struct Options
+    {
+        std::string path;
+        // Only log one request in every sampleEvery.
+        unsigned int sampleEvery = 1;
+        // 0 means never rotate.
+        uint64_t rotateBytes = 64 << 20;
+        // How many rotated files to keep.
+        unsigned int keep = 5;
+        // Records each thread can have waiting, rounded up to a power of two.
+        size_t ringSize = 4096;
+        std::chrono::milliseconds flushInterval{100};
+    };
+
+    AccessLog(const Options &_options);
+    // Writes out anything still waiting.
+    ~AccessLog();
+
+    // Whether the file could be opened.
+    bool ok() const { return opened; }
+
+    void log(std::string_view method, std::string_view resource, int status, uint64_t bytes,
+             std::chrono::steady_clock::duration took, const struct sockaddr_in &peer);
+
+    // Records lost to full rings, and records written, across all threads.
+    uint64_t dropped() const;
+    uint64_t written() const { return linesWritten.load(std::memory_order_relaxed); }
+
+    // Writes out everything logged so far before returning.
+    void flush();
+
+private:
+    // Resources longer than fit here are cut short.
+    static constexpr size_t maxResource = 200;
+
+    struct Record
+    {
+        int64_t time; // Microseconds since the epoch.
+        uint64_t bytes;
+        uint32_t micros;
+        uint32_t address; // In network order, like the port.
+        uint16_t port;
+        uint16_t status;
+        uint8_t methodLength;
+        uint8_t resourceLength;
+        char method[8];
+        char resource[maxResource];
+    };
+
+    // A single producer, single consumer ring.  The owning thread only
+    // moves head and the writer thread only moves tail, each on its own
+    // cache line.
+    struct Ring
+    {
+        std::thread::id owner;
+        std::unique_ptr<Record[]> records;
+        size_t mask;
+        alignas(64) std::atomic<uint64_t> head = 0;
+        uint64_t seen = 0;
+        std::atomic<uint64_t> dropped = 0;
+        alignas(64) std::atomic<uint64_t> tail = 0;
+    };
+
+    Ring &local();
+    void run();
+    // Empties every ring into the file.
+    void drain();
+    void writeOut(std::string &batch);
+    void rotate();
+    bool openFile();
+
+    Options options;
+    const uint64_t id;
+    // The file is only touched by whoever is draining.
+    int fd = -1;
+    uint64_t fileBytes = 0;
+    bool opened = false;
+    std::atomic<uint64_t> linesWritten = 0;
+
+    mutable std::mutex ringsLock;
+    std::vector<std::unique_ptr<Ring>> rings;
+
+    // The writer thread and flush() take turns draining.
+    std::mutex drainLock;
+    std::mutex wakeLock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread writer;
+};
+
+#endif
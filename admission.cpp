@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cmath>
+
+#include "admission.hpp"
+
+Admission::Admission(const Options &_options) : options(_options), started(std::chrono::steady_clock::now())
+{
+    size_t size = maxProbes;
+    while (size < options.tableSize)
+        size <<= 1;
+    slots.reset(new Slot[size]);
+    mask = size - 1;
+    // The tokens have to fit in the top half of the bucket, in thousandths.
+    double burst = options.burst > 0 ? options.burst : std::ceil(options.requestsPerSecond);
+    capacity = (uint64_t)std::clamp(burst, 1.0, 4000000.0) * 1000;
+}
+
+uint32_t Admission::now() const
+{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    uint32_t stamp = (uint32_t)ms.count() + 1;
+    return stamp == 0 ? 1 : stamp;
+}
+
+uint64_t Admission::tokens(uint64_t bucket, uint32_t at) const
+{
+    if (bucket == 0)
+        return capacity;
+    // This wraps after 49 days, which only matters to an address that has
+    // been quiet that long, and then only makes it wait a little.
+    uint32_t elapsed = at - (uint32_t)bucket;
+    // One a second is one thousandth a millisecond.
+    uint64_t refill = (uint64_t)(elapsed * options.requestsPerSecond);
+    return std::min(capacity, (bucket >> 32) + refill);
+}
+
+// Addresses are looked for from their own slot on.  Slots are never
+// emptied, only handed over, so an empty one means the address isn't
+// there.
+Admission::Slot *Admission::find(uint32_t address, bool claim)
+{
+    if (address == 0)
+        return nullptr;
+    uint64_t hash = address * 0x9E3779B97F4A7C15ull;
+    size_t home = (hash ^ (hash >> 32)) & mask;
+    uint32_t at = now();
+    Slot *idle = nullptr;
+    uint64_t idleOwner = 0;
+    for (size_t i = 0; i < maxProbes; ++i)
+    {
+        Slot &slot = slots[(home + i) & mask];
+        uint64_t owner = slot.owner.load(std::memory_order_acquire);
+        if ((owner >> 32) == address)
+            return &slot;
+        if (owner == 0)
+        {
+            if (!claim)
+                return nullptr;
+            if (slot.owner.compare_exchange_strong(owner, (uint64_t)address << 32))
+            {
+                slot.bucket.store(0, std::memory_order_relaxed);
+                return &slot;
+            }
+            // Somebody beat us to it, maybe for the same address.
+            if ((owner >> 32) == address)
+                return &slot;
+            continue;
+        }
+        if (claim && idle == nullptr && (uint32_t)owner == 0 &&
+            tokens(slot.bucket.load(std::memory_order_relaxed), at) >= capacity)
+        {
+            idle = &slot;
+            idleOwner = owner;
+        }
+    }
+    // Nothing free, so we take over a slot whose address no longer needs it.
+    if (idle != nullptr && idle->owner.compare_exchange_strong(idleOwner, (uint64_t)address << 32))
+    {
+        idle->bucket.store(0, std::memory_order_relaxed);
+        return idle;
+    }
+    return nullptr;
+}
+
+Admission::Verdict Admission::connect(uint32_t address)
+{
+    if (open.fetch_add(1, std::memory_order_relaxed) >= options.maxConnections && options.maxConnections > 0)
+    {
+        open.fetch_sub(1, std::memory_order_relaxed);
+        return FULL;
+    }
+    if (options.maxConnectionsPerPeer == 0)
+        return ADMIT;
+    Slot *slot = find(address, true);
+    if (slot == nullptr)
+        return ADMIT;
+    uint64_t owner = slot->owner.load(std::memory_order_relaxed);
+    // The count can only go up while the slot is still this address's.
+    while ((owner >> 32) == address)
+    {
+        if ((uint32_t)owner >= options.maxConnectionsPerPeer)
+        {
+            open.fetch_sub(1, std::memory_order_relaxed);
+            return PEER_FULL;
+        }
+        if (slot->owner.compare_exchange_weak(owner, owner + 1))
+            break;
+    }
+    return ADMIT;
+}
+
+void Admission::disconnect(uint32_t address)
+{
+    open.fetch_sub(1, std::memory_order_relaxed);
+    if (options.maxConnectionsPerPeer == 0)
+        return;
+    Slot *slot = find(address, false);
+    if (slot == nullptr)
+        return;
+    uint64_t owner = slot->owner.load(std::memory_order_relaxed);
+    while ((owner >> 32) == address && (uint32_t)owner > 0)
+    {
+        if (slot->owner.compare_exchange_weak(owner, owner - 1))
+            break;
+    }
+}
+
+bool Admission::request(uint32_t address)
+{
+    if (options.requestsPerSecond <= 0)
+        return true;
+    Slot *slot = find(address, true);
+    if (slot == nullptr)
+        return true;
+    uint64_t bucket = slot->bucket.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint32_t at = now();
+        uint64_t left = tokens(bucket, at);
+        if (left < 1000)
+            return false;
+        if (slot->bucket.compare_exchange_weak(bucket, ((left - 1000) << 32) | at))
+            return true;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Decides whether a new connection or request is taken on at all, so that
+// the server can turn away more than it can handle before doing any real
+// work for it.  There is a cap on connections overall and on connections
+// from any one address, and each address gets a token bucket of requests.
+//
+// The per-address state is in a fixed-size open-addressed table shared by
+// every worker, with no locks: each slot is claimed for an address with a
+// compare-and-swap, and the address and its connection count share one
+// word, so a slot can only be handed to another address once nobody is
+// connected from it and its bucket is full again (at which point it has
+// nothing worth remembering).  If every slot near an address's own is
+// busy it just isn't tracked, and is let in.
+class Admission
+{
+public:
+    struct Options
+    {
+        // 0 means no limit.
+        unsigned int maxConnections = 0;
+        unsigned int maxConnectionsPerPeer = 0;
+        // Requests a second from each address, on average, and how many
+        // can come at once after a quiet spell.  A rate of 0 means no
+        // limit, and a burst of 0 a burst of one second's worth.
+        double requestsPerSecond = 0;
+        unsigned int burst = 0;
+        // Addresses tracked at once, rounded up to a power of two.
+        size_t tableSize = 4096;
+    };
+
+    enum Verdict
+    {
+        ADMIT,
+        PEER_FULL, // Too many connections from this address.
+        FULL       // Too many connections altogether.
+    };
+
+    Admission(const Options &_options);
+
+    // Whether to take on a connection from "address" (in network order,
+    // as in a sockaddr_in).  Only one that was admitted should be
+    // disconnected.
+    Verdict connect(uint32_t address);
+    void disconnect(uint32_t address);
+
+    // Takes a token for a request from "address", returning false if it
+    // has none left.
+    bool request(uint32_t address);
+
+    unsigned int connections() const { return open.load(std::memory_order_relaxed); }
+
+private:
+    // How far from its own slot an address is looked for.
+    static const size_t maxProbes = 16;
+
+    // "owner" is the address in the top half and its connections in the
+    // bottom.  "bucket" is the tokens, in thousandths, in the top half and
+    // when they were last counted, in milliseconds, in the bottom, with 0
+    // for a bucket that was full when last looked at.
+    struct alignas(16) Slot
+    {
+        std::atomic<uint64_t> owner = 0;
+        std::atomic<uint64_t> bucket = 0;
+    };
+
+    Slot *find(uint32_t address, bool claim);
+    // Milliseconds since we started, never 0.
+    uint32_t now() const;
+    // The tokens in a bucket as of "at".
+    uint64_t tokens(uint64_t bucket, uint32_t at) const;
+
+    Options options;
+    uint64_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    std::atomic<unsigned int> open = 0;
+    std::chrono::steady_clock::time_point started;
+};
+
+#endif
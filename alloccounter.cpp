@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "alloccounter.hpp"
+
+static thread_local uint64_t allocations = 0;
+
+uint64_t allocationCount()
+{
+    return allocations;
+}
+
+// The array, nothrow and sized forms all end up in these, and the
+// aligned ones in their aligned versions below.
+void *operator new(std::size_t size)
+{
+    allocations++;
+    if (size == 0)
+        size = 1;
+    while (true)
+    {
+        void *p = std::malloc(size);
+        if (p != nullptr)
+            return p;
+        auto handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// The arena takes anything that doesn't fit in its block from these, so
+// a request that outgrows it is counted too.
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    allocations++;
+    size_t align = std::max(static_cast<size_t>(alignment), sizeof(void *));
+    // aligned_alloc() wants a whole number of alignments.
+    size = (std::max<std::size_t>(size, 1) + align - 1) / align * align;
+    while (true)
+    {
+        void *p = std::aligned_alloc(align, size);
+        if (p != nullptr)
+            return p;
+        auto handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
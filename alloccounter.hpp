@@ -0,0 +1,13 @@
+#ifndef _ALLOC_COUNTER_H
+#define _ALLOC_COUNTER_H
+
+#include <cstdint>
+
+// The global operator new is replaced (in alloccounter.cpp) by one that
+// counts every call before handing on to malloc, so we can check that
+// the server has stopped allocating once it has warmed up.  The count is
+// kept per thread, so this costs one increment and no locking, and it only
+// counts what the calling thread has allocated.
+uint64_t allocationCount();
+
+#endif
@@ -0,0 +1,68 @@
+#include <new>
+#include <algorithm>
+
+#include "arena.hpp"
+
+Arena::Arena(size_t initialBytes, size_t _maxBytes)
+    : block(new char[initialBytes]), size(initialBytes), maxBytes(std::max(_maxBytes, initialBytes))
+{
+}
+
+Arena::~Arena()
+{
+    releaseOverflow();
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment)
+{
+    void *start = block.get() + offset;
+    size_t space = size - offset;
+    if (std::align(alignment, bytes, start, space) != nullptr)
+    {
+        offset = size - space + bytes;
+        return start;
+    }
+
+    // It doesn't fit, so it gets its own piece of the heap, with the list
+    // link in front of it.
+    alignment = std::max(alignment, alignof(Overflow));
+    size_t header = (sizeof(Overflow) + alignment - 1) / alignment * alignment;
+    char *memory = static_cast<char *>(::operator new(header + bytes, std::align_val_t(alignment)));
+    auto link = reinterpret_cast<Overflow *>(memory + header - sizeof(Overflow));
+    link->next = overflow;
+    link->alignment = alignment;
+    overflow = link;
+    overflowBytes += header + bytes;
+    return memory + header;
+}
+
+void Arena::releaseOverflow()
+{
+    while (overflow != nullptr)
+    {
+        Overflow *next = overflow->next;
+        size_t alignment = overflow->alignment;
+        size_t header = (sizeof(Overflow) + alignment - 1) / alignment * alignment;
+        char *memory = reinterpret_cast<char *>(overflow) + sizeof(Overflow) - header;
+        ::operator delete(memory, std::align_val_t(alignment));
+        overflow = next;
+    }
+}
+
+void Arena::reset()
+{
+    if (overflow != nullptr)
+    {
+        // Make the block big enough for the whole of that request, with
+        // some room to spare, so the next one like it fits (up to a point).
+        size_t wanted = std::min(std::max(size * 2, offset + overflowBytes), maxBytes);
+        releaseOverflow();
+        overflowBytes = 0;
+        if (wanted > size)
+        {
+            block.reset(new char[wanted]);
+            size = wanted;
+        }
+    }
+    offset = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <memory>
+#include <memory_resource>
+#include <cstddef>
+
+// A memory pool for everything that only lives as long as one request:
+// the response headers, the request's header map and the HTTPHeader
+// objects in it.  Allocating is just moving a pointer along one block, and
+// freeing does nothing at all.  Instead reset() takes back the whole block
+// at once when the request is finished.
+//
+// If a request needs more than the block holds, the rest comes from the
+// heap for now, and the next reset() grows the block to fit.  So after
+// the first few requests a worker stops calling malloc altogether.  The
+// block never grows past maxBytes, though, so one unusually big request
+// (a long stream, say) doesn't leave the worker holding that much memory
+// for good; anything that big just carries on going to the heap.
+//
+// It hands out memory through std::pmr, so standard containers can use
+// it, for example a std::pmr::map constructed with the arena.
+class Arena : public std::pmr::memory_resource
+{
+public:
+    Arena(size_t initialBytes = 16 * 1024, size_t _maxBytes = 256 * 1024);
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Everything allocated so far must be gone (or never used again).
+    void reset();
+
+    // How many bytes the current request has taken so far, and how big
+    // the block is now.
+    size_t used() const { return offset + overflowBytes; }
+    size_t capacity() const { return size; }
+
+private:
+    // Overflow allocations are kept in a list threaded through
+    // themselves, so tracking them doesn't allocate.
+    struct Overflow
+    {
+        Overflow *next;
+        size_t alignment;
+    };
+
+    std::unique_ptr<char[]> block;
+    size_t size;
+    const size_t maxBytes;
+    size_t offset = 0;
+    Overflow *overflow = nullptr;
+    size_t overflowBytes = 0;
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+    void releaseOverflow();
+};
+
+#endif
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.hpp"
+#include "filecache.hpp"
+#include "webserver.hpp"
+
+// The layout of the file.  The header is followed by the bucket seeds,
+// then the entries in slot order, then all the text and bodies the
+// entries' spans point at.
+struct AssetBundle::Header
+{
+    char magic[8];
+    uint32_t count;
+    uint32_t buckets;
+    uint64_t seeds;   // Where the uint32_t seeds start.
+    uint64_t entries; // Where the entries start.
+    uint64_t length;  // Of the whole file, to catch one cut short.
+};
+
+struct AssetBundle::Span
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct AssetBundle::Entry
+{
+    Span path;
+    Span mimetype;
+    Span lastModified;
+    int64_t modified;
+    struct
+    {
+        Span body;
+        Span etag;
+        Span headers;
+        // How far into "headers" the validators start.
+        uint64_t validators;
+    } versions[2];
+};
+
+static const char bundleMagic[8] = {'W', 'S', 'B', 'U', 'N', 'D', 'L', '1'};
+
+// FNV-1a with the seed mixed into its starting point, then a finaliser
+// so the low bits (which pick the bucket and slot) depend on every byte.
+static uint64_t hashPath(std::string_view path, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (unsigned char c : path)
+    {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+std::shared_ptr<AssetBundle> AssetBundle::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        std::cerr << "Bundle open error: " << path << ": " << strerror(errno) << "\n";
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header))
+    {
+        std::cerr << "Bundle too short: " << path << "\n";
+        close(fd);
+        return nullptr;
+    }
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Bundle mmap error: " << path << ": " << strerror(errno) << "\n";
+        return nullptr;
+    }
+    std::shared_ptr<AssetBundle> bundle(new AssetBundle((const char *)mapped, st.st_size));
+    if (!bundle->valid())
+    {
+        std::cerr << "Not a usable bundle: " << path << "\n";
+        return nullptr;
+    }
+    return bundle;
+}
+
+AssetBundle::~AssetBundle()
+{
+    munmap((void *)base, length);
+}
+
+const AssetBundle::Header &AssetBundle::header() const
+{
+    return *(const Header *)base;
+}
+
+size_t AssetBundle::size() const
+{
+    return header().count;
+}
+
+std::string_view AssetBundle::text(const Span &span) const
+{
+    return std::string_view(base + span.offset, span.length);
+}
+
+// Checks everything find() relies on once, up front, so a damaged bundle
+// is refused rather than read past the end of.
+bool AssetBundle::valid() const
+{
+    const Header &h = header();
+    if (memcmp(h.magic, bundleMagic, sizeof(bundleMagic)) != 0 || h.length != length)
+        return false;
+    if (h.buckets == 0 || h.seeds > length || (length - h.seeds) / sizeof(uint32_t) < h.buckets)
+        return false;
+    if (h.entries % alignof(Entry) != 0 || h.entries > length || (length - h.entries) / sizeof(Entry) < h.count)
+        return false;
+    auto inside = [this](const Span &s) { return s.offset <= length && s.length <= length - s.offset; };
+    const Entry *entries = (const Entry *)(base + h.entries);
+    for (uint32_t i = 0; i < h.count; ++i)
+    {
+        const Entry &e = entries[i];
+        if (!inside(e.path) || !inside(e.mimetype) || !inside(e.lastModified))
+            return false;
+        for (auto &v : e.versions)
+        {
+            if (!inside(v.body) || !inside(v.etag) || !inside(v.headers) || v.validators > v.headers.length)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool AssetBundle::find(std::string_view path, Asset &asset) const
+{
+    const Header &h = header();
+    if (h.count == 0)
+        return false;
+    const uint32_t *seeds = (const uint32_t *)(base + h.seeds);
+    uint32_t seed = seeds[hashPath(path, 0) % h.buckets];
+    const Entry &e = ((const Entry *)(base + h.entries))[hashPath(path, seed) % h.count];
+    if (text(e.path) != path)
+        return false;
+    asset.mimetype = text(e.mimetype);
+    asset.lastModified = text(e.lastModified);
+    asset.modified = e.modified;
+    Version *versions[] = {&asset.identity, &asset.gzip};
+    for (int i = 0; i < 2; ++i)
+    {
+        auto &v = e.versions[i];
+        versions[i]->body = text(v.body);
+        versions[i]->etag = text(v.etag);
+        versions[i]->headers = text(v.headers);
+        versions[i]->validators = versions[i]->headers.substr(v.validators);
+    }
+    return true;
+}
+
+// What the packer knows about one file before it is laid out.
+struct PackedFile
+{
+    std::string path;
+    std::string mimetype;
+    std::string lastModified;
+    int64_t modified;
+    struct
+    {
+        std::string body;
+        std::string etag;
+        std::string headers;
+        size_t validators = 0;
+    } versions[2];
+};
+
+static bool readWhole(const std::filesystem::path &path, std::string &contents)
+{
+    std::ifstream in(path, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+// Hashes every path into a bucket, then, biggest buckets first, searches
+// for a seed that puts all of a bucket's paths into slots still free.
+// Returns the seeds and fills in "slots", each file's slot.
+static bool buildIndex(const std::vector<PackedFile> &files, std::vector<uint32_t> &seeds,
+                       std::vector<size_t> &slots)
+{
+    size_t count = files.size();
+    size_t buckets = count / 2 + 1;
+    seeds.assign(buckets, 0);
+    slots.assign(count, 0);
+    std::vector<std::vector<size_t>> members(buckets);
+    for (size_t i = 0; i < count; ++i)
+    {
+        members[hashPath(files[i].path, 0) % buckets].push_back(i);
+    }
+    std::vector<size_t> order(buckets);
+    for (size_t b = 0; b < buckets; ++b)
+        order[b] = b;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return members[a].size() > members[b].size(); });
+
+    std::vector<bool> taken(count, false);
+    std::vector<size_t> trial;
+    for (size_t b : order)
+    {
+        if (members[b].empty())
+            break;
+        bool placed = false;
+        for (uint32_t seed = 1; seed < (1u << 24) && !placed; ++seed)
+        {
+            trial.clear();
+            placed = true;
+            for (size_t i : members[b])
+            {
+                size_t slot = hashPath(files[i].path, seed) % count;
+                if (taken[slot] || std::find(trial.begin(), trial.end(), slot) != trial.end())
+                {
+                    placed = false;
+                    break;
+                }
+                trial.push_back(slot);
+            }
+            if (placed)
+            {
+                seeds[b] = seed;
+                for (size_t k = 0; k < trial.size(); ++k)
+                {
+                    taken[trial[k]] = true;
+                    slots[members[b][k]] = trial[k];
+                }
+            }
+        }
+        if (!placed)
+            return false;
+    }
+    return true;
+}
+
+bool AssetBundle::pack(const std::string &dir, const std::string &out)
+{
+    namespace fs = std::filesystem;
+    std::error_code error;
+    std::vector<PackedFile> files;
+    for (auto it = fs::recursive_directory_iterator(dir, error); !error && it != fs::recursive_directory_iterator();
+         it.increment(error))
+    {
+        if (!it->is_regular_file())
+            continue;
+        const fs::path &file = it->path();
+        std::string name = "/" + fs::relative(file, dir).generic_string();
+        // These go in with the file they are the compressed version of.
+        if (file.extension() == ".gz" && fs::is_regular_file(fs::path(file).replace_extension()))
+            continue;
+
+        struct stat st;
+        PackedFile packed;
+        if (stat(file.c_str(), &st) != 0 || !readWhole(file, packed.versions[0].body))
+        {
+            std::cerr << "Can't read " << file << "\n";
+            return false;
+        }
+        packed.path = name;
+        packed.mimetype = mimetype(name);
+        packed.modified = st.st_mtim.tv_sec;
+        packed.lastModified = httpDate(st.st_mtim.tv_sec);
+        packed.versions[0].etag = entityTag(packed.versions[0].body.size(), st.st_mtim);
+
+        fs::path sibling = file.string() + ".gz";
+        struct stat gzst;
+        if (stat(sibling.c_str(), &gzst) == 0 && S_ISREG(gzst.st_mode))
+        {
+            if (!readWhole(sibling, packed.versions[1].body))
+            {
+                std::cerr << "Can't read " << sibling << "\n";
+                return false;
+            }
+            packed.versions[1].etag = entityTag(packed.versions[1].body.size(), gzst.st_mtim, "gzip");
+        }
+        else if (compressible(packed.mimetype) && packed.versions[0].body.size() >= 256)
+        {
+            packed.versions[1].body = deflateBytes(packed.versions[0].body, true);
+            packed.versions[1].etag = entityTag(packed.versions[0].body.size(), st.st_mtim, "gzip");
+        }
+        if (packed.versions[1].body.empty())
+            packed.versions[1].etag.clear();
+
+        // The same lines the file cache would send, minus the Content-Length.
+        bool vary = !packed.versions[1].body.empty();
+        for (int i = 0; i < 2; ++i)
+        {
+            auto &v = packed.versions[i];
+            if (i == 1 && !vary)
+                break;
+            v.headers = "Accept-Ranges: bytes\r\n";
+            if (i == 1)
+                v.headers += "Content-Encoding: gzip\r\n";
+            v.validators = v.headers.size();
+            v.headers += "ETag: " + v.etag + "\r\nLast-Modified: " + packed.lastModified + "\r\n";
+            if (vary)
+                v.headers += "Vary: Accept-Encoding\r\n";
+        }
+        files.push_back(std::move(packed));
+    }
+    if (error)
+    {
+        std::cerr << "Can't read " << dir << ": " << error.message() << "\n";
+        return false;
+    }
+
+    std::vector<uint32_t> seeds;
+    std::vector<size_t> slots;
+    if (!buildIndex(files, seeds, slots))
+    {
+        std::cerr << "Couldn't build a perfect hash for " << files.size() << " files\n";
+        return false;
+    }
+
+    Header h = {};
+    memcpy(h.magic, bundleMagic, sizeof(bundleMagic));
+    h.count = files.size();
+    h.buckets = seeds.size();
+    h.seeds = sizeof(Header);
+    h.entries = h.seeds + seeds.size() * sizeof(uint32_t);
+    h.entries = (h.entries + alignof(Entry) - 1) / alignof(Entry) * alignof(Entry);
+
+    // Lay the data out after the entries, filling the entries in as we go.
+    std::vector<Entry> entries(files.size());
+    std::string data;
+    uint64_t start = h.entries + entries.size() * sizeof(Entry);
+    auto place = [&](const std::string &s)
+    {
+        Span span = {start + data.size(), s.size()};
+        data += s;
+        return span;
+    };
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        PackedFile &f = files[i];
+        Entry &e = entries[slots[i]];
+        e.path = place(f.path);
+        e.mimetype = place(f.mimetype);
+        e.lastModified = place(f.lastModified);
+        e.modified = f.modified;
+        for (int v = 0; v < 2; ++v)
+        {
+            e.versions[v].body = place(f.versions[v].body);
+            e.versions[v].etag = place(f.versions[v].etag);
+            e.versions[v].headers = place(f.versions[v].headers);
+            e.versions[v].validators = f.versions[v].validators;
+        }
+    }
+    h.length = start + data.size();
+
+    // Written alongside and renamed into place, so a server never maps a
+    // half written bundle.
+    std::string temporary = out + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write((const char *)&h, sizeof(h));
+        file.write((const char *)seeds.data(), seeds.size() * sizeof(uint32_t));
+        std::string padding(h.entries - h.seeds - seeds.size() * sizeof(uint32_t), '\0');
+        file.write(padding.data(), padding.size());
+        file.write((const char *)entries.data(), entries.size() * sizeof(Entry));
+        file.write(data.data(), data.size());
+        if (!file)
+        {
+            std::cerr << "Can't write " << temporary << "\n";
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), out.c_str()) != 0)
+    {
+        std::cerr << "Can't rename " << temporary << " to " << out << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef _BUNDLE_H
+#define _BUNDLE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <time.h>
+
+// A whole directory of static files packed into one file, which is
+// mapped into memory and served straight from the mapping.  Everything
+// about each file that doesn't change from request to request (its
+// mimetype, validators, header lines and a gzip version) is worked out
+// when the bundle is packed, so serving one is a hash lookup and a send.
+//
+// Paths are found with a minimal perfect hash built by the packer: the
+// path's hash picks a bucket, the bucket's seed hashes it again to pick
+// its slot, and the packer chose the seeds so that every path lands in a
+// slot of its own, with no slots left over.  A path that isn't in the
+// bundle lands on somebody else's slot, so the path there is compared
+// too.
+//
+// Bundles are made offline by bundle_pack, and aren't portable between
+// machines of different byte order.
+class AssetBundle
+{
+public:
+    // One version of a file, as it is or gzipped.
+    struct Version
+    {
+        std::string_view body;
+        std::string_view etag;
+        // The header lines to send with it, other than the Content-Length,
+        // and the part at the end of those that a 304 repeats.
+        std::string_view headers;
+        std::string_view validators;
+    };
+
+    struct Asset
+    {
+        std::string_view mimetype;
+        std::string_view lastModified;
+        time_t modified;
+        Version identity;
+        // The body is empty if there isn't a gzip version.
+        Version gzip;
+    };
+
+    // Maps the bundle at "path", returning nullptr if it can't be read or
+    // isn't a bundle.
+    static std::shared_ptr<AssetBundle> open(const std::string &path);
+
+    // Packs every regular file under "dir" into a bundle at "out", each
+    // named by its path from "dir" with a / on the front.  A ".gz" file
+    // next to another file is that file's gzip version; otherwise types
+    // worth compressing are gzipped here.  Returns false (having said
+    // why) if that couldn't be done.
+    static bool pack(const std::string &dir, const std::string &out);
+
+    ~AssetBundle();
+
+    // Looks up "path", filling in "asset" if it is there.
+    bool find(std::string_view path, Asset &asset) const;
+
+    size_t size() const;
+
+private:
+    struct Header;
+    struct Span;
+    struct Entry;
+
+    AssetBundle(const char *_base, size_t _length) : base(_base), length(_length) {}
+
+    bool valid() const;
+    std::string_view text(const Span &span) const;
+    const Header &header() const;
+
+    const char *base;
+    size_t length;
+};
+
+#endif
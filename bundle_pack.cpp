@@ -0,0 +1,28 @@
+#include <iostream>
+
+#include "bundle.hpp"
+
+// Packs a directory of static files into an asset bundle:
+//
+//   bundle_pack ../webcontent webcontent.bundle
+//
+// which the server can then serve with generateBundleResponder().
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <content directory> <bundle>\n";
+        return 2;
+    }
+    if (!AssetBundle::pack(argv[1], argv[2]))
+    {
+        return 1;
+    }
+    auto bundle = AssetBundle::open(argv[2]);
+    if (!bundle)
+    {
+        return 1;
+    }
+    std::cout << "Packed " << bundle->size() << " files into " << argv[2] << "\n";
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <sys/epoll.h>
+
+#include "coroutine.hpp"
+#include "webserver.hpp"
+
+void HandlerTask::runBlocking()
+{
+    while (!handle.done())
+    {
+        handle.resume();
+    }
+    if (handle.promise().error)
+    {
+        std::rethrow_exception(handle.promise().error);
+    }
+}
+
+// Each of these returns false from await_suspend() to carry straight on,
+// which is what happens without an event loop, once they have blocked
+// for whatever they were waiting for.
+
+bool WaitForFd::await_suspend(HandlerTask::Handle h)
+{
+    auto &promise = h.promise();
+    if (promise.worker != nullptr && promise.worker->wakeOnFd(fd, events, &seen, promise.job))
+    {
+        return true;
+    }
+    // poll() and epoll use the same bits for these.
+    struct pollfd p = {fd, (short)events, 0};
+    while (poll(&p, 1, -1) == -1 && errno == EINTR)
+        ;
+    seen = p.revents;
+    return false;
+}
+
+WaitForFd readable(int fd)
+{
+    return WaitForFd{fd, EPOLLIN};
+}
+
+WaitForFd writable(int fd)
+{
+    return WaitForFd{fd, EPOLLOUT};
+}
+
+bool SleepUntil::await_suspend(HandlerTask::Handle h)
+{
+    auto &promise = h.promise();
+    if (promise.worker != nullptr)
+    {
+        promise.worker->wakeAt(deadline, promise.job);
+        return true;
+    }
+    std::this_thread::sleep_until(deadline);
+    return false;
+}
+
+SleepUntil sleepFor(std::chrono::milliseconds duration)
+{
+    return SleepUntil{std::chrono::steady_clock::now() + duration};
+}
+
+bool ReadFile::await_suspend(HandlerTask::Handle h)
+{
+    auto &promise = h.promise();
+    if (promise.worker != nullptr && promise.worker->runOffLoop(read, &result, promise.job))
+    {
+        return true;
+    }
+    result = read();
+    return false;
+}
+
+ReadFile readFile(int fd, off_t offset, size_t length)
+{
+    return ReadFile{[fd, offset, length]()
+                    {
+                        std::string data(length, '\0');
+                        size_t got = 0;
+                        while (got < length)
+                        {
+                            auto count = pread(fd, data.data() + got, length - got, offset + got);
+                            if (count == -1 && errno == EINTR)
+                                continue;
+                            if (count <= 0)
+                                break;
+                            got += count;
+                        }
+                        data.resize(got);
+                        return data;
+                    },
+                    ""};
+}
+
+ReadFile readFile(std::string path)
+{
+    return ReadFile{[path]()
+                    {
+                        std::string data;
+                        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                        if (fd == -1)
+                            return data;
+                        char buffer[16384];
+                        while (true)
+                        {
+                            auto count = read(fd, buffer, sizeof(buffer));
+                            if (count == -1 && errno == EINTR)
+                                continue;
+                            if (count <= 0)
+                                break;
+                            data.append(buffer, count);
+                        }
+                        close(fd);
+                        return data;
+                    },
+                    ""};
+}
@@ -0,0 +1,132 @@
+#ifndef _COROUTINE_H
+#define _COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+
+class ServerWorker;
+struct CoroutineJob;
+
+// This is what a coroutine handler returns.  Rather than blocking, such a
+// handler co_awaits one of the operations below, and the worker's event
+// loop carries on with its other connections until whatever it is waiting
+// for has happened.  For example:
+//
+//   HandlerTask slowHello(HTTPRequest &r, HTTPResponder &resp)
+//   {
+//       co_await sleepFor(std::chrono::milliseconds(100));
+//       std::string payload = "hello";
+//       resp.sendResponse(payload);
+//   }
+//
+//   server.RegisterHandler("/hello", slowHello);
+//
+// The request and responder stay alive until the handler finishes, but
+// anything else the handler holds by reference has to as well.
+//
+// Outside an event loop (called through DispatchResponse() in a test, say)
+// the same handler still works, every co_await just blocks instead.
+class HandlerTask
+{
+public:
+    struct promise_type
+    {
+        // Filled in by the worker that runs it, nullptr when running
+        // without an event loop.
+        ServerWorker *worker = nullptr;
+        CoroutineJob *job = nullptr;
+        std::exception_ptr error;
+
+        HandlerTask get_return_object()
+        {
+            return HandlerTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        // It doesn't start until the worker has set it up.
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // And the worker destroys it once it has seen it finish.
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    HandlerTask(HandlerTask &&other) : handle(other.handle) { other.handle = nullptr; }
+    HandlerTask(const HandlerTask &) = delete;
+    ~HandlerTask()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Hands the coroutine over to the caller, who must destroy it.
+    Handle release()
+    {
+        Handle h = handle;
+        handle = nullptr;
+        return h;
+    }
+
+    // Runs it to the end right here, rethrowing anything it threw.
+    void runBlocking();
+
+private:
+    explicit HandlerTask(Handle h) : handle(h) {}
+    Handle handle;
+};
+
+// Waits until a file descriptor is readable or writable and returns the
+// epoll events seen (EPOLLIN, EPOLLOUT, EPOLLHUP, ...).  It is for other
+// descriptors the handler has opened, such as a pipe or a socket to
+// another server, not the client's own connection, which the worker
+// is already watching.
+struct WaitForFd
+{
+    int fd;
+    uint32_t events;
+    uint32_t seen = 0;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(HandlerTask::Handle h);
+    uint32_t await_resume() const noexcept { return seen; }
+};
+
+WaitForFd readable(int fd);
+WaitForFd writable(int fd);
+
+// Resumes the handler once the deadline has passed.
+struct SleepUntil
+{
+    std::chrono::steady_clock::time_point deadline;
+
+    bool await_ready() const noexcept { return std::chrono::steady_clock::now() >= deadline; }
+    bool await_suspend(HandlerTask::Handle h);
+    void await_resume() const noexcept {}
+};
+
+SleepUntil sleepFor(std::chrono::milliseconds duration);
+
+// Reads from a file on the handler pool, since regular files are always
+// "ready" as far as epoll is concerned and a read can still block on the
+// disk.  Returns what was read, which is empty if the file couldn't be
+// read at all.
+struct ReadFile
+{
+    std::function<std::string()> read;
+    std::string result;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(HandlerTask::Handle h);
+    std::string await_resume() { return std::move(result); }
+};
+
+// Up to "length" bytes starting at "offset".
+ReadFile readFile(int fd, off_t offset, size_t length);
+// The whole file.
+ReadFile readFile(std::string path);
+
+#endif
@@ -0,0 +1,440 @@
+#include <iostream>
+#include <cstdio>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+
+#include "filecache.hpp"
+#include "webserver.hpp"
+
+OpenFile::~OpenFile()
+{
+    close(fd);
+}
+
+bool CachedFile::matches(const struct stat &st) const
+{
+    return st.st_dev == device && st.st_ino == inode && (size_t)st.st_size == size &&
+           st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec;
+}
+
+size_t CachedFile::memory() const
+{
+    size_t total = bytes ? size : 0;
+    if (gzip)
+        total += gzip->memory();
+    if (deflate)
+        total += deflate->memory();
+    return total;
+}
+
+FileCache::FileCache(size_t _byteBudget, size_t _maxEntryBytes, size_t _maxEntries)
+    : byteBudget(_byteBudget), maxEntryBytes(_maxEntryBytes), maxEntries(_maxEntries)
+{
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (inotifyFd == -1 || stopFd == -1)
+    {
+        std::cerr << "Inotify unavailable, checking cached files on every hit: " << strerror(errno) << "\n";
+        if (inotifyFd != -1)
+            close(inotifyFd);
+        inotifyFd = -1;
+        return;
+    }
+    watcher = std::thread([this]()
+                          { watchLoop(); });
+}
+
+FileCache::~FileCache()
+{
+    if (inotifyFd == -1)
+    {
+        if (stopFd != -1)
+            close(stopFd);
+        return;
+    }
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) == -1)
+    {
+        std::cerr << "Stop signal error: " << strerror(errno) << "\n";
+    }
+    watcher.join();
+    close(inotifyFd);
+    close(stopFd);
+}
+
+std::shared_ptr<const CachedFile> FileCache::get(const std::string &path)
+{
+    if (inotifyFd == -1)
+    {
+        // Without inotify the only way to know the entry is still good
+        // is to look at the file.
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+        {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = entries.find(path);
+        if (found != entries.end() && found->second.file->matches(st))
+        {
+            order.splice(order.begin(), order, found->second.position);
+            hits++;
+            return found->second.file;
+        }
+    }
+    else
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = entries.find(path);
+        if (found != entries.end())
+        {
+            order.splice(order.begin(), order, found->second.position);
+            hits++;
+            return found->second.file;
+        }
+    }
+    misses++;
+
+    uint64_t started = generation;
+    bool cacheable;
+    auto file = load(path, cacheable);
+    if (!file)
+    {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (cacheable && generation == started)
+    {
+        insert(path, file);
+    }
+    return file;
+}
+
+FileCache::Stats FileCache::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return Stats{hits, misses, evictions, invalidations, entries.size(), bytes};
+}
+
+// Text compresses well, and so does SVG, which is text too.  Everything
+// else we serve (images, mostly) already is compressed.
+bool compressible(const std::string &type)
+{
+    return type.compare(0, 5, "text/") == 0 || type == "image/svg+xml" || type == "application/javascript" ||
+           type == "application/json" || type == "application/xml";
+}
+
+// Reads in (or opens) the file and works out everything about it that
+// doesn't change from request to request.  "cacheable" is cleared if we
+// couldn't watch it, since then we'd never hear that it had changed.
+std::shared_ptr<CachedFile> FileCache::load(const std::string &path, bool &cacheable)
+{
+    cacheable = true;
+    if (inotifyFd != -1)
+    {
+        auto slash = path.find_last_of('/');
+        auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+        bool watched;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            watched = watchedDirs.contains(dir);
+        }
+        // The watch has to go on before we read, otherwise a change between
+        // reading and watching would go unnoticed.  But a directory is only
+        // watched once a file in it has turned up, so that a request for a
+        // made up path costs no more than the open that fails, and the
+        // first file from each directory is read again once it is watched.
+        if (!watched)
+        {
+            if (!loadFile(path, ""))
+                return nullptr;
+            cacheable = watch(dir);
+        }
+    }
+    auto file = loadFile(path, mimetype(path));
+    if (file && compressible(file->mimetype))
+    {
+        compress(*file, path);
+    }
+    return file;
+}
+
+std::string entityTag(size_t size, const struct timespec &mtime, const char *encoding)
+{
+    char tag[96];
+    snprintf(tag, sizeof(tag), "\"%zx-%llx%08lx%s%s\"", size, (unsigned long long)mtime.tv_sec,
+             (unsigned long)mtime.tv_nsec, *encoding ? "-" : "", encoding);
+    return tag;
+}
+
+std::string httpDate(time_t when)
+{
+    struct tm broken;
+    gmtime_r(&when, &broken);
+    char date[64];
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &broken);
+    return date;
+}
+
+// Sets the validators for a file of "size" bytes last changed at "mtime",
+// with "encoding" (if any) telling apart its compressed versions, and the
+// header lines to go with them.
+static void setValidators(CachedFile &file, size_t size, const struct timespec &mtime, const char *encoding,
+                          const std::string &extra)
+{
+    file.etag = entityTag(size, mtime, encoding);
+    file.lastModified = httpDate(mtime.tv_sec);
+    file.validators = "ETag: " + file.etag + "\r\nLast-Modified: " + file.lastModified + "\r\n" + extra;
+    file.headers = "Content-Length: " + std::to_string(file.size) + "\r\nAccept-Ranges: bytes\r\n";
+    if (*encoding)
+        file.headers += std::string("Content-Encoding: ") + encoding + "\r\n";
+    file.headers += file.validators;
+}
+
+std::shared_ptr<CachedFile> FileCache::loadFile(const std::string &path, const std::string &type)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return nullptr;
+    }
+    auto file = std::make_shared<CachedFile>();
+    file->size = st.st_size;
+    file->mimetype = type;
+    file->device = st.st_dev;
+    file->inode = st.st_ino;
+    file->mtime = st.st_mtim;
+    setValidators(*file, file->size, file->mtime, "", "");
+
+    if (file->size > maxEntryBytes)
+    {
+        file->file = std::make_shared<OpenFile>(fd, file->size);
+        return file;
+    }
+    auto contents = std::make_shared<std::string>(file->size, '\0');
+    size_t got = 0;
+    while (got < file->size)
+    {
+        auto count = pread(fd, contents->data() + got, file->size - got, got);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        got += count;
+    }
+    close(fd);
+    if (got != file->size)
+    {
+        // It shrank while we were reading it, so what we have is no good.
+        return nullptr;
+    }
+    file->bytes = contents;
+    return file;
+}
+
+std::string deflateBytes(const std::string &data, bool gzip)
+{
+    z_stream z = {};
+    // 16 on top of the window bits asks for the gzip wrapper.
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, gzip ? 15 + 16 : 15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return "";
+    }
+    std::string out(deflateBound(&z, data.size()), '\0');
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    z.next_out = (Bytef *)out.data();
+    z.avail_out = out.size();
+    bool done = deflate(&z, Z_FINISH) == Z_STREAM_END;
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    return done && out.size() < data.size() ? out : "";
+}
+
+// Adds the compressed versions of "file" (see CachedFile), and the Vary
+// header if there are any.  The compressed versions made here share the
+// file's validators, so they change together; a ".gz" sibling has its
+// own.
+void FileCache::compress(CachedFile &file, const std::string &path)
+{
+    // Compressing anything much smaller than this just costs time.
+    const size_t minimumSize = 256;
+    const std::string vary = "Vary: Accept-Encoding\r\n";
+
+    auto made = [&](std::string compressed, const char *encoding)
+    {
+        auto variant = std::make_shared<CachedFile>();
+        variant->size = compressed.size();
+        variant->mimetype = file.mimetype;
+        setValidators(*variant, file.size, file.mtime, encoding, vary);
+        variant->bytes = std::make_shared<const std::string>(std::move(compressed));
+        variant->device = file.device;
+        variant->inode = file.inode;
+        variant->mtime = file.mtime;
+        return variant;
+    };
+
+    auto precompressed = loadFile(path + ".gz", file.mimetype);
+    if (precompressed)
+    {
+        setValidators(*precompressed, precompressed->size, precompressed->mtime, "gzip", vary);
+        file.gzip = precompressed;
+    }
+    else if (file.bytes && file.size >= minimumSize)
+    {
+        auto gzipped = deflateBytes(*file.bytes, true);
+        if (!gzipped.empty())
+            file.gzip = made(std::move(gzipped), "gzip");
+    }
+    if (file.bytes && file.size >= minimumSize)
+    {
+        auto deflated = deflateBytes(*file.bytes, false);
+        if (!deflated.empty())
+            file.deflate = made(std::move(deflated), "deflate");
+    }
+    if (file.gzip || file.deflate)
+    {
+        file.headers += vary;
+        file.validators += vary;
+    }
+}
+
+// Returns false if the directory can't be watched, which is left for the
+// caller to deal with rather than logged, as it would happen on every request.
+bool FileCache::watch(const std::string &dir)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (watchedDirs.contains(dir))
+        return true;
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(),
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd == -1)
+        return false;
+    watchedDirs.insert(dir);
+    // The same directory can be reached under different names, in which
+    // case inotify hands back the same descriptor each time.
+    watches[wd].push_back(dir);
+    return true;
+}
+
+void FileCache::watchLoop()
+{
+    alignas(struct inotify_event) char buffer[4096];
+    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+    while (true)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Inotify poll error: " << strerror(errno) << "\n";
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        auto count = read(inotifyFd, buffer, sizeof(buffer));
+        if (count <= 0)
+            continue;
+
+        generation++;
+        std::lock_guard<std::mutex> guard(lock);
+        for (char *p = buffer; p < buffer + count;)
+        {
+            auto *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // We lost track of what changed, so everything goes.
+                while (!order.empty())
+                {
+                    remove(order.front());
+                    invalidations++;
+                }
+                continue;
+            }
+            auto found = watches.find(event->wd);
+            if (found == watches.end())
+                continue;
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+            {
+                // The directory itself went away, so drop it and
+                // everything cached from it.
+                for (auto &dir : found->second)
+                {
+                    std::vector<std::string> gone;
+                    for (auto &[path, entry] : entries)
+                    {
+                        if (path.compare(0, dir.size() + 1, dir + "/") == 0)
+                            gone.push_back(path);
+                    }
+                    for (auto &path : gone)
+                    {
+                        remove(path);
+                        invalidations++;
+                    }
+                    watchedDirs.erase(dir);
+                }
+                if (event->mask & IN_IGNORED)
+                    watches.erase(found);
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+            for (auto &dir : found->second)
+            {
+                std::string path = dir + "/" + event->name;
+                // A change to a ".gz" file is a change to the file it
+                // is the compressed version of, too.
+                std::string original;
+                if (path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0)
+                    original = path.substr(0, path.size() - 3);
+                for (auto &changed : {path, original})
+                {
+                    if (!changed.empty() && entries.contains(changed))
+                    {
+                        remove(changed);
+                        invalidations++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void FileCache::remove(const std::string &path)
+{
+    auto found = entries.find(path);
+    if (found == entries.end())
+        return;
+    bytes -= found->second.file->memory();
+    order.erase(found->second.position);
+    entries.erase(found);
+}
+
+void FileCache::insert(const std::string &path, std::shared_ptr<const CachedFile> file)
+{
+    remove(path);
+    order.push_front(path);
+    entries[path] = Entry{file, order.begin()};
+    bytes += file->memory();
+    while (entries.size() > 1 && (bytes > byteBudget || entries.size() > maxEntries))
+    {
+        std::string victim = order.back();
+        remove(victim);
+        evictions++;
+    }
+}
@@ -0,0 +1,172 @@
+#ifndef _FILE_CACHE_H
+#define _FILE_CACHE_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// An open, read-only file descriptor shared between everybody who is
+// sending the file.  It is only closed when the last user (cache entry
+// or queued response) lets go of it.
+struct OpenFile
+{
+    int fd;
+    size_t size;
+
+    OpenFile(int _fd, size_t _size) : fd(_fd), size(_size) {}
+    ~OpenFile();
+};
+
+// Everything the file responder needs to answer a request for one file.
+// Small files are kept in memory in "bytes", big ones are kept open in
+// "file" and sent with sendfile().  Either way the mimetype and the
+// file's own header lines are worked out once, when it is loaded.
+struct CachedFile
+{
+    size_t size;
+    std::string mimetype;
+
+    // Preformatted header lines (each ending in \r\n) that depend only on
+    // the file, starting with the Content-Length.
+    std::string headers;
+
+    // "headers" without the Content-Length, for a response that only
+    // sends part of the file.
+    std::string_view headersAfterLength() const
+    {
+        return std::string_view(headers).substr(headers.find("\r\n") + 2);
+    }
+
+    // The validators.  The ETag is a strong one, quoted, made from the
+    // size and mtime, with the encoding on the end for a compressed
+    // version; Last-Modified is the mtime as an HTTP date.  "validators"
+    // is the header lines for a 304: both of those, plus the Vary if the
+    // file has compressed versions.  They are also in "headers".
+    std::string etag;
+    std::string lastModified;
+    std::string validators;
+
+    std::shared_ptr<const std::string> bytes;
+    std::shared_ptr<OpenFile> file;
+
+    // Compressed versions, for a type worth compressing.  The gzip one is
+    // the ".gz" file next to this one if there is one; otherwise both are
+    // compressed from "bytes" when the file is loaded, so only files
+    // small enough to be held in memory get them.  Each has its own header
+    // lines, with the Content-Encoding, and all of them say that the
+    // response varies on Accept-Encoding.
+    std::shared_ptr<const CachedFile> gzip;
+    std::shared_ptr<const CachedFile> deflate;
+
+    // What the file looked like when we loaded it.
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+
+    // Does this still describe the file "st" was taken from?
+    bool matches(const struct stat &st) const;
+
+    // The bytes held in memory for this file and its compressed versions.
+    size_t memory() const;
+};
+
+// A strong ETag, quoted, for a file of "size" bytes last changed at
+// "mtime", with "encoding" on the end for a compressed version.
+std::string entityTag(size_t size, const struct timespec &mtime, const char *encoding = "");
+
+// "when" in the IMF-fixdate form HTTP uses for Last-Modified.
+std::string httpDate(time_t when);
+
+// Whether files of mimetype "type" are worth compressing.
+bool compressible(const std::string &type);
+
+// Compresses "data" as a gzip stream, or (for "deflate") a zlib one,
+// returning "" if it doesn't come out any smaller.
+std::string deflateBytes(const std::string &data, bool gzip);
+
+// A byte-budgeted LRU cache of static files, keyed by path, shared by all
+// of the worker threads.  A hit costs no system calls at all: instead of
+// checking the file on every request, a background thread watches the
+// directories of cached files with inotify and throws out entries as soon
+// as their files are written, replaced or removed (or their ".gz"
+// siblings are).  If inotify isn't available we fall back to a stat() per
+// hit, which only looks at the file itself.
+class FileCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t invalidations;
+        size_t entries;
+        size_t bytes;
+    };
+
+    // "byteBudget" bounds the memory used by file contents.  Files bigger
+    // than "maxEntryBytes" are never held in memory, only kept open,
+    // and at most "maxEntries" files are cached either way.
+    FileCache(size_t _byteBudget = 64 << 20, size_t _maxEntryBytes = 256 << 10, size_t _maxEntries = 1024);
+    ~FileCache();
+
+    // Returns the file, or nullptr if the path doesn't name a regular
+    // file we can read.
+    std::shared_ptr<const CachedFile> get(const std::string &path);
+
+    Stats stats();
+
+private:
+    const size_t byteBudget;
+    const size_t maxEntryBytes;
+    const size_t maxEntries;
+
+    std::mutex lock;
+    // Most recently used at the front.
+    std::list<std::string> order;
+    struct Entry
+    {
+        std::shared_ptr<const CachedFile> file;
+        std::list<std::string>::iterator position;
+    };
+    std::unordered_map<std::string, Entry> entries;
+    size_t bytes = 0;
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> evictions = 0;
+    std::atomic<uint64_t> invalidations = 0;
+
+    // Bumped on every inotify event.  A load that raced with one is
+    // served but not cached, since it may have read the old contents.
+    std::atomic<uint64_t> generation = 0;
+
+    int inotifyFd = -1;
+    int stopFd = -1;
+    std::thread watcher;
+    // Watch descriptors to the directory names they were added under,
+    // protected by "lock".
+    std::unordered_map<int, std::vector<std::string>> watches;
+    std::unordered_set<std::string> watchedDirs;
+
+    std::shared_ptr<CachedFile> load(const std::string &path, bool &cacheable);
+    std::shared_ptr<CachedFile> loadFile(const std::string &path, const std::string &type);
+    void compress(CachedFile &file, const std::string &path);
+    bool watch(const std::string &dir);
+    void watchLoop();
+
+    // These expect "lock" to be held.
+    void remove(const std::string &path);
+    void insert(const std::string &path, std::shared_ptr<const CachedFile> file);
+};
+
+#endif
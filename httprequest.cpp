@@ -7,6 +7,7 @@
 #include <ranges>
 
 #include "httprequest.hpp"
+#include "simdscan.hpp"
 
 // This is the heart of the HTTP parsing.
 
@@ -152,4 +153,407 @@ HTTPHeader::HTTPHeader(std::string s){
       throw MalformedRequestException("No whitespace in header name!");
       }
   }
-}
\ No newline at end of file
+}
+
+HTTPHeader::HTTPHeader(std::string_view _name, std::string_view _value, std::pmr::polymorphic_allocator<char> memory)
+  : name(_name, memory), value(_value, memory){
+  for(char &c : name){
+    c = tolower(c);
+  }
+}
+
+HTTPRequest::HTTPRequest(const HTTPRequestView &v, std::pmr::memory_resource *_memory) : view(&v),
+  memory(_memory), command(v.get_command(), _memory), resource(v.get_resource(), _memory),
+  payload(v.get_payload(), _memory){
+}
+
+std::map<std::string, std::shared_ptr<HTTPHeader>> & HTTPRequest::get_headers(){
+  if(view != nullptr){
+    // The view already checked for duplicates and bad names.  The
+    // headers, and their shared_ptr control blocks, come from the same
+    // place as the rest of the request.
+    std::pmr::polymorphic_allocator<HTTPHeader> allocator(memory);
+    for(auto &h : *view){
+      auto header = std::allocate_shared<HTTPHeader>(allocator, h.name, h.value, allocator);
+      headers[header->get_name()] = header;
+    }
+    view = nullptr;
+  }
+  return headers;
+}
+
+std::string_view HTTPRequest::get_header(std::string_view name){
+  if(view != nullptr){
+    auto h = view->find_header(name);
+    return h == nullptr ? std::string_view() : h->value;
+  }
+  auto found = headers.find(std::string(name));
+  return found == headers.end() ? std::string_view() : found->second->get_value_view();
+}
+
+const std::string &HTTPRequest::get_payload(){
+  if(!payloadCopy){
+    payloadCopy.emplace(payload);
+  }
+  return *payloadCopy;
+}
+
+// The rest of this is HTTPRequestView, which follows the same rules
+// as everything above but never copies anything out of the request.
+// Its delimiter searches all go through the SIMD kernels in simdscan.
+
+static bool is_space(char c){
+  return isspace((unsigned char) c);
+}
+
+static std::string_view trim_view(std::string_view s){
+  while(!s.empty() && is_space(s.front())) s.remove_prefix(1);
+  while(!s.empty() && is_space(s.back())) s.remove_suffix(1);
+  return s;
+}
+
+// Header names are plain ASCII, so this doesn't need the locale-aware
+// tolower(), which is far slower when called for every byte.
+static char ascii_lower(char c){
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool equals_ignore_case(std::string_view a, std::string_view b){
+  if(a.size() != b.size()) return false;
+  for(size_t i = 0; i < a.size(); ++i){
+    if(ascii_lower(a[i]) != ascii_lower(b[i])) return false;
+  }
+  return true;
+}
+
+HTTPRequestView::HTTPRequestView(std::string_view request){
+  // HTTPRequest only complains about the missing terminator if it
+  // found at least one complete line first.
+  auto first = find_crlf(request, 0);
+  if(first == 0 || first == std::string_view::npos){
+    throw MalformedRequestException("No headers!");
+  }
+  auto end = find_crlfcrlf(request, 0);
+  if(end == std::string_view::npos){
+    throw MalformedRequestException("No terminating \\r\\n\\r\\n");
+  }
+  payload = request.substr(end + 4);
+
+  parse_command(request.substr(0, first));
+
+  size_t start = first + 2;
+  while(start < end + 2){
+    auto next = find_crlf(request, start);
+    parse_header(request.substr(start, next - start));
+    start = next + 2;
+  }
+}
+
+void HTTPRequestView::parse_command(std::string_view command_string){
+  auto space = find_char(command_string, 0, ' ');
+  auto space2 = find_char(command_string, space + 1, ' ');
+  auto space3 = find_char(command_string, space2 + 1, ' ');
+  if (space == std::string_view::npos || space2 == std::string_view::npos || space3 != std::string_view::npos) {
+    throw MalformedRequestException("Command is not correct!");
+  }
+  command = command_string.substr(0,space);
+  resource = command_string.substr(space+1, space2-space-1);
+  bool valid_command = false;
+  for (auto cmd : valid_commands){
+    if(cmd == command) {
+      valid_command = true;
+    }
+  }
+  if (!valid_command) {throw MalformedRequestException("Invalid command!");}
+  if (command_string.substr(space2+1) != "HTTP/1.1") {throw MalformedRequestException("Unknown Protocol!");}
+}
+
+void HTTPRequestView::parse_header(std::string_view line){
+  auto colon = find_char(line, 0, ':');
+  if(colon == std::string_view::npos) {
+    throw MalformedRequestException("Bad Header!");
+  }
+  Header h{trim_view(line.substr(0, colon)), trim_view(line.substr(colon+1))};
+  for (auto c: h.name){
+    if(is_space(c)) {
+      throw MalformedRequestException("No whitespace in header name!");
+    }
+  }
+  if (find_header(h.name) != nullptr) {
+    throw MalformedRequestException("Duplicate headers!");
+  }
+  if (headerCount == maxHeaders) {
+    throw TooManyHeadersException();
+  }
+  headers[headerCount++] = h;
+}
+
+const HTTPRequestView::Header *HTTPRequestView::find_header(std::string_view name) const{
+  for(auto &h : *this){
+    if(equals_ignore_case(h.name, name)) return &h;
+  }
+  return nullptr;
+}
+
+bool BodyReader::start(const HTTPRequestView &request){
+  auto encoding = request.find_header("transfer-encoding");
+  auto length = request.find_header("content-length");
+  if(encoding != nullptr){
+    if(length != nullptr){
+      fail("Both Content-Length and Transfer-Encoding!");
+      return false;
+    }
+    if(!equals_ignore_case(trim_view(encoding->value), "chunked")){
+      fail("Unsupported Transfer-Encoding!");
+      return false;
+    }
+    isChunked = true;
+    state = CHUNK_SIZE;
+    return true;
+  }
+  if(length != nullptr){
+    if(length->value.empty()){
+      fail("Bad Content-Length!");
+      return false;
+    }
+    for(auto c : length->value){
+      if(!isdigit((unsigned char) c)){
+        fail("Bad Content-Length!");
+        return false;
+      }
+      // Anything too long to count is certainly too long to take.
+      declared = declared > (SIZE_MAX - 9) / 10 ? SIZE_MAX : declared * 10 + (c - '0');
+    }
+  }
+  lengthLeft = declared;
+  state = LENGTH;
+  return true;
+}
+
+BodyReader::Status BodyReader::fail(std::string why){
+  state = FAILED;
+  message = why;
+  return MALFORMED;
+}
+
+// Looks for the next \r\n at or after "position".  Lines in the chunk
+// framing are short, so one that isn't is an error rather than a reason
+// to keep waiting.
+bool BodyReader::line(std::string_view buffer, size_t position, size_t &end){
+  end = find_crlf(buffer, position);
+  if(end == std::string_view::npos && buffer.size() - position > 1024){
+    fail("Chunk framing line too long!");
+  }
+  return end != std::string_view::npos;
+}
+
+BodyReader::Status BodyReader::read(std::string_view buffer, size_t &position, std::string_view &piece){
+  while(true){
+    switch(state){
+    case LENGTH:{
+      if(declared > maxBytes){
+        state = OVERSIZED;
+        return TOO_LARGE;
+      }
+      if(lengthLeft == 0){
+        state = DONE;
+        break;
+      }
+      size_t available = std::min(lengthLeft, buffer.size() - position);
+      if(available == 0){
+        return NEED_MORE;
+      }
+      piece = buffer.substr(position, available);
+      position += available;
+      lengthLeft -= available;
+      total += available;
+      return PIECE;
+    }
+    case CHUNK_SIZE:{
+      size_t end;
+      if(!line(buffer, position, end)){
+        return state == FAILED ? MALFORMED : NEED_MORE;
+      }
+      // The size is in hex, and may be followed by ;extensions we ignore.
+      auto size = buffer.substr(position, end - position);
+      size = size.substr(0, size.find(';'));
+      size = trim_view(size);
+      if(size.empty()){
+        return fail("Bad chunk size!");
+      }
+      chunkLeft = 0;
+      for(auto c : size){
+        if(!isxdigit((unsigned char) c)){
+          return fail("Bad chunk size!");
+        }
+        if(chunkLeft > (SIZE_MAX >> 4)){
+          state = OVERSIZED;
+          return TOO_LARGE;
+        }
+        chunkLeft = chunkLeft * 16 + (isdigit((unsigned char) c) ? c - '0' : (tolower(c) - 'a' + 10));
+        if(chunkLeft > maxBytes - total){
+          state = OVERSIZED;
+          return TOO_LARGE;
+        }
+      }
+      position = end + 2;
+      state = chunkLeft == 0 ? TRAILER : CHUNK_DATA;
+      break;
+    }
+    case CHUNK_DATA:{
+      size_t available = std::min(chunkLeft, buffer.size() - position);
+      if(available == 0){
+        return NEED_MORE;
+      }
+      piece = buffer.substr(position, available);
+      position += available;
+      chunkLeft -= available;
+      total += available;
+      if(chunkLeft == 0){
+        state = CHUNK_END;
+      }
+      return PIECE;
+    }
+    case CHUNK_END:
+      if(buffer.size() < position + 2){
+        return NEED_MORE;
+      }
+      if(buffer.substr(position, 2) != "\r\n"){
+        return fail("Chunk not followed by \\r\\n!");
+      }
+      position += 2;
+      state = CHUNK_SIZE;
+      break;
+    case TRAILER:{
+      // Trailer fields are allowed but we have no use for them, so we
+      // just skip lines until the blank one.
+      size_t end;
+      if(!line(buffer, position, end)){
+        return state == FAILED ? MALFORMED : NEED_MORE;
+      }
+      bool blank = end == position;
+      position = end + 2;
+      if(blank){
+        state = DONE;
+      }
+      break;
+    }
+    case DONE:
+      return COMPLETE;
+    case FAILED:
+      return MALFORMED;
+    case OVERSIZED:
+      return TOO_LARGE;
+    }
+  }
+}
+
+void RequestParser::reset(){
+  state = HEADERS;
+  position = 0;
+  headerLength = 0;
+  decoded.clear();
+  message.clear();
+  view.reset();
+}
+
+RequestParser::Status RequestParser::fail(std::string why){
+  state = FAILED;
+  message = why;
+  return MALFORMED;
+}
+
+RequestParser::Status RequestParser::parse(std::string_view buffer){
+  viewCurrent = false;
+  while(true){
+    switch(state){
+    case HEADERS:{
+      // HTTPRequest treats a leading blank line as a request with no headers.
+      if(buffer.starts_with("\r\n")){
+        return fail("No headers!");
+      }
+      // The terminator might straddle what we saw last time and what is new.
+      size_t from = position < 3 ? 0 : position - 3;
+      auto end = find_crlfcrlf(buffer, from);
+      if(end == std::string_view::npos){
+        position = buffer.size();
+        if(position > maxHeaderBytes){
+          return fail("Request too large!");
+        }
+        return NEED_MORE;
+      }
+      headerLength = end + 4;
+      position = headerLength;
+      if(headerLength > maxHeaderBytes){
+        return fail("Request too large!");
+      }
+      try{
+        view.emplace(buffer.substr(0, headerLength));
+        viewCurrent = true;
+      }
+      catch(TooManyHeadersException &e){
+        fail(e.view());
+        return TOO_MANY_HEADERS;
+      }
+      catch(MalformedRequestException &e){
+        return fail(e.view());
+      }
+      body = BodyReader(maxBodyBytes);
+      if(!body.start(*view)){
+        return fail(body.error());
+      }
+      state = BODY;
+      if(pauseAfterHeaders){
+        return HEADERS_DONE;
+      }
+      break;
+    }
+    case BODY:{
+      std::string_view piece;
+      switch(body.read(buffer, position, piece)){
+      case BodyReader::PIECE:
+        // A Content-Length body is already in one piece in the buffer.
+        if(body.chunked()){
+          decoded.append(piece);
+        }
+        break;
+      case BodyReader::COMPLETE:
+        state = DONE;
+        break;
+      case BodyReader::NEED_MORE:
+        return NEED_MORE;
+      case BodyReader::MALFORMED:
+        return fail(body.error());
+      case BodyReader::TOO_LARGE:
+        state = OVERSIZED;
+        message = "Body too large!";
+        // The caller will want to know what it was that was too large.
+        if(!viewCurrent){
+          view.emplace(buffer.substr(0, headerLength));
+          viewCurrent = true;
+        }
+        return TOO_LARGE;
+      }
+      break;
+    }
+    case DONE:
+      if(!viewCurrent){
+        // The buffer has changed since we parsed the headers, so the old
+        // view is pointing at the wrong place.
+        view.emplace(buffer.substr(0, headerLength));
+        viewCurrent = true;
+      }
+      if(body.chunked()){
+        view->set_payload(decoded);
+      }
+      else{
+        view->set_payload(buffer.substr(headerLength, body.length()));
+      }
+      return COMPLETE;
+    case FAILED:
+      return MALFORMED;
+    case OVERSIZED:
+      return TOO_LARGE;
+    }
+  }
+}
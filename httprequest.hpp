@@ -1,8 +1,14 @@
 #ifndef _HTTP_REQUEST_H
 #define _HTTP_REQUEST_H
 
+#include <cstdint>
 #include <map>
+#include <memory_resource>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <array>
+#include <optional>
 
 // This exception is raised for any time things
 // fail to parse correctly.  You don't have to 
@@ -35,6 +41,13 @@ private:
     std::string message;
 };
 
+// Thrown by HTTPRequestView for a request with more than maxHeaders
+// headers, so that it can be told apart from one that is just broken.
+class TooManyHeadersException: public MalformedRequestException {
+public:
+    TooManyHeadersException() : MalformedRequestException("Too many headers!") {}
+};
+
 // This is the class for an HTTP header, as a single entry.
 // A header has two fields, the name and the value.  For both
 // these should be read-only fields.  Unfortunately this means that
@@ -44,12 +57,211 @@ class HTTPHeader {
     public:
     HTTPHeader(std::string s);
 
-    const std::string get_name(){return name;}
-    const std::string get_value(){return value;}
+    // For a header that has already been split and trimmed, such as one
+    // from an HTTPRequestView.  The name is still lower-cased here.  The
+    // strings are kept in "memory", such as the server's per-request Arena.
+    HTTPHeader(std::string_view _name, std::string_view _value,
+               std::pmr::polymorphic_allocator<char> memory = {});
+
+    const std::string get_name(){return std::string(name);}
+    const std::string get_value(){return std::string(value);}
+    // Without the copy, for as long as the header is around.
+    std::string_view get_name_view() const {return name;}
+    std::string_view get_value_view() const {return value;}
+
+    private:
+    std::pmr::string name;
+    std::pmr::string value;
+};
+
+// This is a second parser for the same requests, for the hot path in the
+// server.  Rather than copying the request into lines and the lines into
+// headers, it works over the caller's buffer in place: everything it hands
+// back is a string_view into that buffer, and the headers go into a small
+// fixed-size table instead of a map.  So a typical request is parsed without
+// allocating any memory at all, but the buffer has to outlive the view.
+//
+// It accepts and rejects what HTTPRequest does, with the same
+// MalformedRequestException messages, with two differences.  Header names
+// are kept as sent, and looked up without regard to case.  And there can
+// be at most maxHeaders headers, where HTTPRequest takes any number: past
+// that it throws TooManyHeadersException, which the server answers with a
+// 431.  That is on purpose, as the headers live in a fixed array and each
+// new one is checked against all the others for duplicates.
+class HTTPRequestView {
+    public:
+    struct Header {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    // More headers than this and TooManyHeadersException is thrown.
+    static const size_t maxHeaders = 64;
+
+    HTTPRequestView(std::string_view request);
+
+    std::string_view get_command() const {return command;}
+    std::string_view get_resource() const {return resource;}
+    std::string_view get_payload() const {return payload;}
+
+    // Returns nullptr if there is no such header.  "name" can be in any case.
+    const Header *find_header(std::string_view name) const;
+
+    const Header *begin() const {return headers.data();}
+    const Header *end() const {return headers.data() + headerCount;}
+    size_t size() const {return headerCount;}
+
+    // For callers that frame the body themselves (say from the
+    // Content-Length) and so only handed us the header block.
+    void set_payload(std::string_view p) {payload = p;}
+
+    private:
+    std::string_view command;
+    std::string_view resource;
+    std::string_view payload;
+    std::array<Header, maxHeaders> headers;
+    size_t headerCount = 0;
+
+    void parse_command(std::string_view command_string);
+    void parse_header(std::string_view line);
+};
+
+// This decodes a request body as it arrives, framed by Content-Length or
+// "Transfer-Encoding: chunked", handing it back a piece at a time as
+// views into whatever buffer it is given, so nothing is copied and the
+// body never has to be in memory all at once.
+//
+// Each call to read() looks at the buffer from "position" on, and moves
+// "position" past whatever it used.  The bytes it didn't use have to be
+// there again, unchanged, at the start of the next call, but anything
+// before "position" can be thrown away, so a caller can read into one
+// small buffer over and over however long the body is.
+class BodyReader {
+    public:
+    enum Status {
+        NEED_MORE, // Call again once more bytes have arrived.
+        PIECE,     // "piece" is the next part of the body.
+        COMPLETE,  // The body (and any trailer) has all been read.
+        MALFORMED, // error() says why.
+        TOO_LARGE  // The body is longer than maxBytes.
+    };
+
+    BodyReader(size_t _maxBytes = SIZE_MAX) : maxBytes(_maxBytes) {}
+
+    // Works out how the body is framed from the request's headers.  Both
+    // Content-Length and chunked on one request is the classic request
+    // smuggling trick, so that is rejected (returning false) rather than
+    // guessed at, as is any other Transfer-Encoding.
+    bool start(const HTTPRequestView &request);
+
+    Status read(std::string_view buffer, size_t &position, std::string_view &piece);
+
+    // The longest body that is accepted.  A Content-Length over this is
+    // TOO_LARGE straight away, a chunked body once it gets that long.
+    size_t maxBytes;
+
+    bool chunked() const {return isChunked;}
+    // The Content-Length, which is 0 for a chunked body.
+    size_t length() const {return declared;}
+    // How much of the body has been read so far.
+    size_t received() const {return total;}
+
+    const std::string &error() const {return message;}
+
+    private:
+    enum State {LENGTH, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, DONE, FAILED, OVERSIZED};
+
+    State state = LENGTH;
+    bool isChunked = false;
+    size_t declared = 0;
+    size_t lengthLeft = 0;
+    size_t chunkLeft = 0;
+    size_t total = 0;
+    std::string message;
+
+    Status fail(std::string why);
+    bool line(std::string_view buffer, size_t position, size_t &end);
+};
+
+// This finds where a request ends in a stream of bytes that arrives a
+// piece at a time.  Each call to parse() is handed the buffer so far
+// (always starting at the first byte of the request), picks up where the
+// last call stopped, and only looks at the new bytes, so a client that
+// trickles a request in one byte at a time costs O(n) rather than O(n^2).
+//
+// Once the headers are in it works out how the body is framed (see
+// BodyReader) and keeps going until the body is complete too.  A chunked
+// body is decoded as it arrives.
+class RequestParser {
+    public:
+    enum Status {
+        NEED_MORE,    // Call again once more bytes have arrived.
+        COMPLETE,     // request() and length() are ready.
+        MALFORMED,    // error() says why.  The connection can't be recovered.
+        TOO_LARGE,    // The body is over maxBodyBytes, which deserves a 413
+                      // (request() has the headers), but the connection
+                      // can't be recovered either.
+        HEADERS_DONE, // Only with pauseAfterHeaders, see there.
+        TOO_MANY_HEADERS // More than HTTPRequestView::maxHeaders, which
+                         // deserves a 431, but again the connection can't
+                         // be recovered.  error() says why.
+    };
+
+    RequestParser(size_t _maxHeaderBytes = 65536, size_t _maxBodyBytes = 65536)
+        : maxHeaderBytes(_maxHeaderBytes), maxBodyBytes(_maxBodyBytes) {}
+
+    // The buffer can move or grow between calls, but the bytes already
+    // seen must not change.
+    Status parse(std::string_view buffer);
+
+    // The parsed request, with the body as its payload.  This points into
+    // the buffer from the last call to parse(), and into the parser itself
+    // for a chunked body.
+    const HTTPRequestView &request() const {return *view;}
+
+    // How many bytes of the buffer the request took up.
+    size_t length() const {return position;}
+
+    const std::string &error() const {return message;}
+
+    // Gets ready for the next request on the connection.
+    void reset();
+
+    // Only takes effect from the next request.
+    void setMaxBodyBytes(size_t bytes) {maxBodyBytes = bytes;}
+
+    // With this set, parse() stops once the headers are in and returns
+    // HEADERS_DONE, with request() (which has no payload yet) and length()
+    // covering just the headers.  The caller can then read the body
+    // itself, starting from a copy of bodyReader(), or call parse() again
+    // to carry on as usual.
+    bool pauseAfterHeaders = false;
+
+    const BodyReader &bodyReader() const {return body;}
+
+    // Whether the headers are in and it is waiting for the body.
+    bool readingBody() const {return state == BODY;}
 
     private:
-    std::string name;
-    std::string value;
+    enum State {HEADERS, BODY, DONE, FAILED, OVERSIZED};
+
+    const size_t maxHeaderBytes;
+    size_t maxBodyBytes;
+
+    State state = HEADERS;
+    // How far into the buffer we have got.
+    size_t position = 0;
+    size_t headerLength = 0;
+    BodyReader body;
+    std::string decoded;
+    std::string message;
+
+    // The view is only good as long as the buffer it was made from, so we
+    // note whether this call to parse() made it.
+    std::optional<HTTPRequestView> view;
+    bool viewCurrent = false;
+
+    Status fail(std::string why);
 };
 
 // And this is the class for an HTTP request itself.
@@ -61,6 +273,16 @@ class HTTPRequest {
     public:
     HTTPRequest(std::string s);
 
+    // Takes over an already parsed view.  Only the command, resource and
+    // payload are copied up front, into "memory", which the server points
+    // at its per-request Arena, so even a long URI costs no malloc.  The
+    // header map is built the first time get_headers() is called, so
+    // "view" (and the buffer it points into) must stay alive as long as
+    // this request is in use.  Until then get_header() and the _view()
+    // getters don't copy anything.
+    HTTPRequest(const HTTPRequestView &view,
+                std::pmr::memory_resource *memory = std::pmr::get_default_resource());
+
     // This has to be a reference because we don't want to copy the entire
     // map.  It should not be modified by whoever calls this.
     
@@ -68,13 +290,24 @@ class HTTPRequest {
     // [] operator to work and the [] operator doesn't work on const-declared
     // maps because the compiler can't distinguish between [] for setting and 
     // [] for getting.
-    std::map<std::string, std::shared_ptr<HTTPHeader>> & get_headers() {return headers;}
+    std::map<std::string, std::shared_ptr<HTTPHeader>> & get_headers();
+
+    // One header's value, or "" if there is no such header.  "name" must
+    // be lower case.  Until get_headers() has been called this looks in
+    // the view, so it doesn't build the map.
+    std::string_view get_header(std::string_view name);
 
-    const std::string get_command(){return command;}
-    const std::string get_resource(){return resource;}
+    const std::string get_command(){return std::string(command);}
+    const std::string get_resource(){return std::string(resource);}
 
     // Likewise, the same for payload here, because the payload can be big.
-    const std::string &get_payload(){return payload;}
+    // The copy is only made the first time.
+    const std::string &get_payload();
+
+    // Without the copies, for as long as the request is around.
+    std::string_view get_command_view() const {return command;}
+    std::string_view get_resource_view() const {return resource;}
+    std::string_view get_payload_view() const {return payload;}
 
     // For both this is safe in practice but not in theory:  In theory this
     // means that external data (the map and payload) can escape the control of
@@ -86,9 +319,12 @@ class HTTPRequest {
 
     private:
     std::map<std::string, std::shared_ptr<HTTPHeader>> headers;
-    std::string command;
-    std::string resource;
-    std::string payload;
+    const HTTPRequestView *view = nullptr;
+    std::pmr::memory_resource *memory = std::pmr::get_default_resource();
+    std::pmr::string command;
+    std::pmr::string resource;
+    std::pmr::string payload;
+    std::optional<std::string> payloadCopy;
 
     void parse_command(std::string &command_string);
 };
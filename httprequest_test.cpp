@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 
 #include "httprequest.hpp"
+#include "simdscan.hpp"
+#include <vector>
 
 // Well, this test actually isn't that simple...
 // It tests that the header parsing is correct:
@@ -37,4 +39,291 @@ TEST(HTTPRequestTest, TestExceptions){
     << "Only one space separating!";
   EXPECT_THROW(HTTPRequest("GET / HTTP/1.1\r\nHost: aoeaoeu\r\nhost: aoeu\r\n\r\n"), MalformedRequestException) 
     << "No duplicate headers!";
-}
\ No newline at end of file
+}
+
+// The view should see exactly what HTTPRequest sees, just without copying.
+TEST(HTTPRequestViewTest, TestSimple) {
+  std::string buffer = "GET / HTTP/1.1\r\nHoST  : www.fubar.com\t\tUgh\t\r\n\r\n";
+  HTTPRequestView request(buffer);
+  EXPECT_EQ(request.get_command(), "GET");
+  EXPECT_EQ(request.get_resource(), "/");
+  ASSERT_NE(request.find_header("host"), nullptr);
+  EXPECT_EQ(request.find_header("host")->value, "www.fubar.com\t\tUgh");
+  EXPECT_EQ(request.find_header("HOST"), request.find_header("host"));
+  EXPECT_EQ(request.find_header("hos"), nullptr);
+  EXPECT_EQ(request.size(), 1);
+  // And it really is pointing into the buffer rather than a copy.
+  EXPECT_EQ(request.get_resource().data(), buffer.data() + 4);
+
+  // Handing it on to an HTTPRequest gives the usual lower-cased map.
+  HTTPRequest full(request);
+  EXPECT_EQ(full.get_command(), "GET");
+  EXPECT_EQ(full.get_headers()["host"]->get_value(), "www.fubar.com\t\tUgh");
+  EXPECT_FALSE(full.get_headers().contains("HoST"));
+}
+
+TEST(HTTPRequestViewTest, TestPayload) {
+  HTTPRequestView r("POST /fubar HTTP/1.1\r\nHost: aoeaoeu\r\n\r\nPayload!");
+  EXPECT_EQ(r.get_command(), "POST");
+  EXPECT_EQ(r.get_resource(), "/fubar");
+  EXPECT_EQ(r.get_payload(), "Payload!");
+  HTTPRequestView s("POST /fubar HTTP/1.1\r\nHost: aoeaoeu\r\n\r\nPayload!  \r\n\r\n\r\nhey!");
+  EXPECT_EQ(s.get_payload(), "Payload!  \r\n\r\n\r\nhey!");
+}
+
+// Every one of these has to be accepted or rejected the same way, with the
+// same message, by both parsers.
+TEST(HTTPRequestViewTest, TestMatchesHTTPRequest) {
+  std::vector<std::string> requests = {
+    "",
+    "\r\n\r\n",
+    "GET / HTTP/1.1",
+    "GET / HTTP/1.1\r\n",
+    "GET / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/1.1\r\nA:\r\n\r\n",
+    "GET / HTTP/1.1\r\n:\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\r\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\nc\r\n\r\nbody",
+    "GET / HTTP/1.1\r\nA b: c\r\n\r\n",
+    "GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+    "GET / HTTP/1.1\r\n  Spaced  :  out  \r\n\r\n",
+    "POST / HTTP/1.1\r\nHost: aoeaoeu\r\n\r",
+    "GET / HTTp/1.1\r\nHost: aoeaoeu\r\n\r\n",
+    "GeT / HTTP/1.1\r\nHost: aoeaoeu\r\n\r\n",
+    "GET  / HTTP/1.1\r\nHost: aoeaoeu\r\n\r\n",
+    "GET /  HTTP/1.1\r\nHost: aoeaoeu\r\n\r\n",
+    "GET / HTTP/1.1 \r\nHost: aoeaoeu\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: aoeaoeu\r\nhost: aoeu\r\n\r\n",
+    "HEAD /a/b/c?d=e HTTP/1.1\r\nHost: x\r\nAccept: */*\r\nConnection: close\r\n\r\n",
+  };
+  for (auto &text : requests) {
+    std::string expected = "ok";
+    std::string got = "ok";
+    try { HTTPRequest r(text); } catch (MalformedRequestException &e) { expected = e.view(); }
+    try { HTTPRequestView r(text); } catch (MalformedRequestException &e) { got = e.view(); }
+    EXPECT_EQ(got, expected) << "For request: " << text;
+    if (expected != "ok") continue;
+
+    HTTPRequest r(text);
+    HTTPRequestView v(text);
+    EXPECT_EQ(v.get_command(), r.get_command());
+    EXPECT_EQ(v.get_resource(), r.get_resource());
+    EXPECT_EQ(v.get_payload(), r.get_payload());
+    EXPECT_EQ(v.size(), r.get_headers().size());
+    for (auto &[name, header] : r.get_headers()) {
+      ASSERT_NE(v.find_header(name), nullptr);
+      EXPECT_EQ(v.find_header(name)->value, header->get_value());
+    }
+  }
+}
+
+// get_header() finds the same thing whether or not the map has been built.
+TEST(HTTPRequestTest, TestGetHeader) {
+  std::string text = "GET / HTTP/1.1\r\nAccept-Encoding: gzip, deflate\r\nHost: x\r\n\r\n";
+  HTTPRequestView v(text);
+  HTTPRequest fromView(v);
+  EXPECT_EQ(fromView.get_header("accept-encoding"), "gzip, deflate");
+  EXPECT_EQ(fromView.get_header("cookie"), "");
+  fromView.get_headers();
+  EXPECT_EQ(fromView.get_header("accept-encoding"), "gzip, deflate");
+  HTTPRequest fromString(text);
+  EXPECT_EQ(fromString.get_header("host"), "x");
+  EXPECT_EQ(fromString.get_header("cookie"), "");
+}
+
+// Handlers see plain std::strings and a std::map, however the request
+// is stored underneath.
+TEST(HTTPRequestTest, TestHandlerTypes) {
+  std::string text = "POST /a/long/enough/path/for/the/heap HTTP/1.1\r\nHost: x\r\n\r\nbody";
+  HTTPRequestView v(text);
+  std::pmr::monotonic_buffer_resource memory;
+  HTTPRequest request(v, &memory);
+  std::string command = request.get_command();
+  std::string path = request.get_resource();
+  std::string body = request.get_payload();
+  std::map<std::string, std::shared_ptr<HTTPHeader>> &headers = request.get_headers();
+  EXPECT_EQ(command, "POST");
+  EXPECT_EQ(path, "/a/long/enough/path/for/the/heap");
+  EXPECT_EQ(body, "body");
+  EXPECT_EQ(headers["host"]->get_value(), "x");
+  EXPECT_EQ(request.get_resource_view(), path);
+}
+
+// Feeding a request in one byte at a time should give NEED_MORE right
+// up until the last byte of the body, and then the whole request.
+TEST(RequestParserTest, TestByteAtATime) {
+  std::string text = "POST /upload HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhello"
+                     "GET /next HTTP/1.1\r\n\r\n";
+  RequestParser parser;
+  std::string buffer;
+  size_t first = text.find("GET");
+  for (size_t i = 0; i < first - 1; ++i) {
+    buffer += text[i];
+    ASSERT_EQ(parser.parse(buffer), RequestParser::NEED_MORE) << "At byte " << i;
+  }
+  buffer = text;
+  ASSERT_EQ(parser.parse(buffer), RequestParser::COMPLETE);
+  EXPECT_EQ(parser.length(), first);
+  EXPECT_EQ(parser.request().get_resource(), "/upload");
+  EXPECT_EQ(parser.request().get_payload(), "hello");
+
+  // And the pipelined request after it.
+  parser.reset();
+  ASSERT_EQ(parser.parse(std::string_view(buffer).substr(first)), RequestParser::COMPLETE);
+  EXPECT_EQ(parser.request().get_resource(), "/next");
+  EXPECT_EQ(parser.request().get_payload(), "");
+}
+
+TEST(RequestParserTest, TestChunked) {
+  std::string text = "POST / HTTP/1.1\r\nTransfer-Encoding: Chunked\r\n\r\n"
+                     "5;name=value\r\nhello\r\n7\r\n, world\r\n0\r\nTrailer: yes\r\n\r\nextra";
+  RequestParser parser;
+  std::string buffer;
+  RequestParser::Status status = RequestParser::NEED_MORE;
+  for (size_t i = 0; i < text.size() && status == RequestParser::NEED_MORE; ++i) {
+    buffer += text[i];
+    status = parser.parse(buffer);
+  }
+  ASSERT_EQ(status, RequestParser::COMPLETE);
+  EXPECT_EQ(buffer.size(), text.size() - 5);
+  EXPECT_EQ(parser.request().get_payload(), "hello, world");
+  EXPECT_EQ(parser.length(), text.size() - 5);
+}
+
+TEST(RequestParserTest, TestMalformed) {
+  std::vector<std::string> requests = {
+    "\r\nGET / HTTP/1.1\r\n\r\n",
+    "GET / HTTp/1.1\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 1\r\nTransfer-Encoding: chunked\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nabc",
+    "GET / HTTP/1.1\r\nHost: " + std::string(70000, 'x'),
+  };
+  for (auto &text : requests) {
+    RequestParser parser;
+    EXPECT_EQ(parser.parse(text), RequestParser::MALFORMED) << "For request: " << text;
+    EXPECT_FALSE(parser.error().empty());
+  }
+}
+
+// A body over the limit isn't malformed, it is too large, whether the
+// Content-Length says so up front or the chunks add up to it.
+TEST(RequestParserTest, TestTooLarge) {
+  std::vector<std::string> requests = {
+    "POST / HTTP/1.1\r\nContent-Length: 70000\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n8000\r\n" + std::string(0x8000, 'a') +
+      "\r\n8001\r\n",
+  };
+  for (auto &text : requests) {
+    RequestParser parser;
+    EXPECT_EQ(parser.parse(text), RequestParser::TOO_LARGE) << "For request: " << text.substr(0, 60);
+    EXPECT_EQ(parser.parse(text), RequestParser::TOO_LARGE);
+  }
+  RequestParser parser;
+  parser.setMaxBodyBytes(100000);
+  EXPECT_EQ(parser.parse(requests[0]), RequestParser::NEED_MORE);
+}
+
+// HTTPRequestView keeps at most maxHeaders headers, and one more is its
+// own status so that the server can say why.
+TEST(RequestParserTest, TestTooManyHeaders) {
+  auto request = [](size_t headers) {
+    std::string text = "GET / HTTP/1.1\r\n";
+    for (size_t i = 0; i < headers; ++i) {
+      text += "X-Header-" + std::to_string(i) + ": " + std::to_string(i) + "\r\n";
+    }
+    return text + "\r\n";
+  };
+  auto most = request(HTTPRequestView::maxHeaders);
+  auto tooMany = request(HTTPRequestView::maxHeaders + 1);
+  ASSERT_NE(HTTPRequestView(most).find_header("X-Header-63"), nullptr);
+  EXPECT_THROW(HTTPRequestView view(tooMany), TooManyHeadersException);
+  EXPECT_NO_THROW(HTTPRequest request(tooMany));
+
+  RequestParser parser;
+  EXPECT_EQ(parser.parse(most), RequestParser::COMPLETE);
+  RequestParser other;
+  EXPECT_EQ(other.parse(tooMany), RequestParser::TOO_MANY_HEADERS);
+  EXPECT_EQ(other.error(), "Malformed HTTP Request: Too many headers!");
+}
+
+// With pauseAfterHeaders the parser stops for the caller to decide what
+// to do with the body, and carries on as usual if asked to.
+TEST(RequestParserTest, TestPauseAfterHeaders) {
+  std::string headers = "POST /upload HTTP/1.1\r\nContent-Length: 5\r\n\r\n";
+  std::string text = headers + "hello";
+  RequestParser parser;
+  parser.pauseAfterHeaders = true;
+  ASSERT_EQ(parser.parse(text), RequestParser::HEADERS_DONE);
+  EXPECT_EQ(parser.request().get_resource(), "/upload");
+  EXPECT_EQ(parser.length(), headers.size());
+  EXPECT_EQ(parser.bodyReader().length(), 5u);
+  ASSERT_EQ(parser.parse(text), RequestParser::COMPLETE);
+  EXPECT_EQ(parser.request().get_payload(), "hello");
+  EXPECT_EQ(parser.length(), text.size());
+}
+
+// Reading a chunked body a few bytes at a time, throwing away everything
+// that has been used each time as a streaming caller would.
+TEST(BodyReaderTest, TestIncremental) {
+  std::string headers = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+  std::string body = "5;x=y\r\nhello\r\n7\r\n, world\r\n0\r\nTrailer: yes\r\n\r\nGET";
+  HTTPRequestView view(headers);
+  BodyReader reader;
+  ASSERT_TRUE(reader.start(view));
+  EXPECT_TRUE(reader.chunked());
+  std::string buffer, decoded;
+  BodyReader::Status status = BodyReader::NEED_MORE;
+  size_t next = 0;
+  while (status != BodyReader::COMPLETE && next < body.size()) {
+    buffer += body.substr(next, 3);
+    next += 3;
+    size_t position = 0;
+    std::string_view piece;
+    while ((status = reader.read(buffer, position, piece)) == BodyReader::PIECE) {
+      decoded += piece;
+    }
+    ASSERT_NE(status, BodyReader::MALFORMED) << reader.error();
+    buffer.erase(0, position);
+  }
+  ASSERT_EQ(status, BodyReader::COMPLETE);
+  EXPECT_EQ(decoded, "hello, world");
+  EXPECT_EQ(reader.received(), 12u);
+  EXPECT_EQ(buffer + body.substr(next), "GET");
+
+  // And a limit that is only reached part way through.
+  BodyReader limited(10);
+  ASSERT_TRUE(limited.start(view));
+  size_t position = 0;
+  std::string_view piece;
+  EXPECT_EQ(limited.read(body, position, piece), BodyReader::PIECE);
+  EXPECT_EQ(piece, "hello");
+  EXPECT_EQ(limited.read(body, position, piece), BodyReader::TOO_LARGE);
+}
+
+// Every scan kernel this CPU can run has to agree with the scalar one,
+// wherever the match falls relative to the 16 and 32 byte blocks.
+TEST(SimdScanTest, TestKernelsAgree) {
+  auto original = scan_kernel();
+  std::string text;
+  for (int i = 0; i < 200; ++i) {
+    text += (i % 37 == 0) ? ':' : (i % 23 == 0) ? ' ' : (i % 51 == 0) ? '\r' : 'a' + i % 26;
+  }
+  text += "\r\nfoo\r\r\n\r\n";
+  for (auto kernel : {ScanKernel::SCALAR, ScanKernel::SSE2, ScanKernel::AVX2}) {
+    if (!use_scan_kernel(kernel)) continue;
+    for (size_t from = 0; from <= text.size(); ++from) {
+      for (size_t len = from; len <= text.size(); len += 7) {
+        std::string_view s(text.data(), len);
+        EXPECT_EQ(find_char(s, from, ':'), s.find(':', from)) << scan_kernel_name(kernel);
+        EXPECT_EQ(find_any(s, from, '\r', '\n', ':', ' '), s.find_first_of("\r\n: ", from)) << scan_kernel_name(kernel);
+        EXPECT_EQ(find_crlf(s, from), s.find("\r\n", from)) << scan_kernel_name(kernel);
+        EXPECT_EQ(find_crlfcrlf(s, from), s.find("\r\n\r\n", from)) << scan_kernel_name(kernel);
+      }
+    }
+  }
+  use_scan_kernel(original);
+}
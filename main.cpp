@@ -4,26 +4,50 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <thread>
 #include "webserver.hpp"
+#include "bundle.hpp"
 
 int main(int argc, char **argv)
 {
   // Technically we don't serve "forever", but this is close 
   // enough.  We use the first argument to override this so
   // we can quit early for things like leak checking through valgrind.
+  // The second argument sets the number of worker threads, which
+  // defaults to one per core.  A third argument of "io_uring" picks
+  // the io_uring worker where the kernel supports it ("epoll" keeps the
+  // default), and a fourth names an asset bundle, made by bundle_pack, to
+  // serve instead of ../webcontent.
 
   uint64_t servecount = 0xFFFFFFFFFFFFFFFF;
   if (argc > 1 ){
     servecount = (uint64_t) std::atol(argv[1]);
   }
   std::cout << "Starting up ECS 36B webserver\n";
+  unsigned int workers = std::thread::hardware_concurrency();
+  if (argc > 2) {
+    workers = (unsigned int) std::atol(argv[2]);
+  }
   if (argc > 1) {
     std::cout << "Limiting lifetime to " << servecount << " pages before quitting\n";
   }
-  WebServer server(8080);
-  server.RegisterHandler("/dummy", dummyHandler);
-  server.RegisterHandler("/dummypath/is/great/", dummyHandler);
-  server.RegisterHandler("/", generateFileResponder("../webcontent"));
+  std::cout << "Running " << workers << " workers\n";
+  WebServer server(8080, workers);
+  if (argc > 3 && std::string(argv[3]) == "io_uring") {
+    server.backend = WebServer::IO_URING;
+  }
+  // These are known now, so they are compiled straight into the dispatch.
+  server.RegisterStaticRoutes<StaticRouter<Route<"/dummy", dummyHandler>,
+                                           Route<"/dummypath/is/great/", dummyHandler>>>();
+  if (argc > 4) {
+    auto bundle = AssetBundle::open(argv[4]);
+    if (!bundle) {
+      return 1;
+    }
+    server.RegisterHandler("/", generateBundleResponder(bundle));
+  } else {
+    server.RegisterHandler("/", generateFileResponder("../webcontent"));
+  }
   server.serve(servecount);
   return 0;
 }
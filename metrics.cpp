@@ -0,0 +1,208 @@
+#include <cstdio>
+
+#include "metrics.hpp"
+
+static std::atomic<uint64_t> nextMetricsId = 1;
+
+Metrics::Metrics() : id(nextMetricsId++)
+{
+    routeNames = {"static", "none"};
+}
+
+size_t Metrics::addRoute(const std::string &name)
+{
+    if (routeNames.size() == maxRoutes - 1)
+    {
+        routeNames.push_back("other");
+    }
+    if (routeNames.size() == maxRoutes)
+    {
+        return maxRoutes - 1;
+    }
+    routeNames.push_back(name);
+    return routeNames.size() - 1;
+}
+
+// The calling thread's shard.  Finding it the first time takes the lock,
+// after that it comes straight from the thread_local cache, unless the
+// thread moves between servers.
+Metrics::Shard &Metrics::local()
+{
+    thread_local uint64_t cachedId = 0;
+    thread_local Shard *cached = nullptr;
+    if (cachedId == id)
+    {
+        return *cached;
+    }
+    std::lock_guard<std::mutex> guard(shardsLock);
+    auto self = std::this_thread::get_id();
+    Shard *shard = nullptr;
+    for (auto &s : shards)
+    {
+        if (s->owner == self)
+            shard = s.get();
+    }
+    if (shard == nullptr)
+    {
+        shards.push_back(std::make_unique<Shard>());
+        shard = shards.back().get();
+        shard->owner = self;
+    }
+    cachedId = id;
+    cached = shard;
+    return *shard;
+}
+
+void Metrics::responded(size_t route, int status, std::chrono::steady_clock::duration took)
+{
+    Shard &shard = local();
+    bump(shard.statuses[statusSlot(status)], 1);
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(took).count();
+    uint64_t micros = nanos / 1000;
+    size_t bucket = 0;
+    while (bucket < buckets - 1 && micros > bucketBounds[bucket])
+        ++bucket;
+    Histogram &h = shard.routes[route < maxRoutes ? route : maxRoutes - 1];
+    bump(h.counts[bucket], 1);
+    bump(h.sumNanos, nanos);
+}
+
+uint64_t Metrics::total(Counter counter) const
+{
+    std::lock_guard<std::mutex> guard(shardsLock);
+    uint64_t sum = 0;
+    for (auto &s : shards)
+    {
+        sum += s->counters[counter].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+uint64_t Metrics::responses(int status) const
+{
+    std::lock_guard<std::mutex> guard(shardsLock);
+    uint64_t sum = 0;
+    for (auto &s : shards)
+    {
+        sum += s->statuses[statusSlot(status)].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+// Label values are quoted, so quotes, backslashes and newlines in a
+// route have to be escaped.
+static void appendLabel(std::string &out, const std::string &value)
+{
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else
+        {
+            out += c;
+        }
+    }
+}
+
+std::string Metrics::prometheus() const
+{
+    // Add up the shards first, holding the lock only for that.
+    uint64_t counters[COUNTERS] = {};
+    std::vector<uint64_t> statuses(statusSlots);
+    std::vector<uint64_t> counts(maxRoutes * buckets);
+    std::vector<uint64_t> sums(maxRoutes);
+    {
+        std::lock_guard<std::mutex> guard(shardsLock);
+        for (auto &s : shards)
+        {
+            for (int c = 0; c < COUNTERS; ++c)
+                counters[c] += s->counters[c].load(std::memory_order_relaxed);
+            for (int i = 0; i < statusSlots; ++i)
+                statuses[i] += s->statuses[i].load(std::memory_order_relaxed);
+            for (size_t r = 0; r < maxRoutes; ++r)
+            {
+                for (size_t b = 0; b < buckets; ++b)
+                    counts[r * buckets + b] += s->routes[r].counts[b].load(std::memory_order_relaxed);
+                sums[r] += s->routes[r].sumNanos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string out;
+    out += "# HELP webserver_responses_total Responses sent, by status code.\n"
+           "# TYPE webserver_responses_total counter\n";
+    for (int i = 0; i < statusSlots; ++i)
+    {
+        if (statuses[i] == 0)
+            continue;
+        out += "webserver_responses_total{code=\"";
+        out += i == 0 ? "other" : std::to_string(i);
+        out += "\"} " + std::to_string(statuses[i]) + "\n";
+    }
+
+    struct
+    {
+        Counter counter;
+        const char *name;
+        const char *help;
+    } simple[] = {
+        {BYTES_IN, "webserver_received_bytes_total", "Bytes read from clients."},
+        {BYTES_OUT, "webserver_sent_bytes_total", "Bytes written to clients."},
+        {PARSE_ERRORS, "webserver_parse_errors_total", "Requests that could not be parsed."},
+        {ACCEPT_ERRORS, "webserver_accept_errors_total", "Failed accepts on the listening sockets."},
+        {SEND_ERRORS, "webserver_send_errors_total", "Connections dropped because a send failed."},
+        {SHED, "webserver_shed_total", "Connections and requests turned away by the admission limits."},
+        {TIMEOUTS, "webserver_timeouts_total", "Connections closed for sending a request too slowly."},
+    };
+    for (auto &s : simple)
+    {
+        out += std::string("# HELP ") + s.name + " " + s.help + "\n";
+        out += std::string("# TYPE ") + s.name + " counter\n";
+        out += std::string(s.name) + " " + std::to_string(counters[s.counter]) + "\n";
+    }
+
+    out += "# HELP webserver_request_duration_seconds Time spent producing a response, by route.\n"
+           "# TYPE webserver_request_duration_seconds histogram\n";
+    for (size_t r = 0; r < routeNames.size(); ++r)
+    {
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < buckets; ++b)
+        {
+            cumulative += counts[r * buckets + b];
+        }
+        if (cumulative == 0)
+            continue;
+        std::string label = "route=\"";
+        appendLabel(label, routeNames[r]);
+        label += "\"";
+        cumulative = 0;
+        for (size_t b = 0; b < buckets; ++b)
+        {
+            cumulative += counts[r * buckets + b];
+            out += "webserver_request_duration_seconds_bucket{" + label + ",le=\"";
+            if (b < buckets - 1)
+            {
+                char bound[32];
+                snprintf(bound, sizeof(bound), "%g", bucketBounds[b] / 1e6);
+                out += bound;
+            }
+            else
+            {
+                out += "+Inf";
+            }
+            out += "\"} " + std::to_string(cumulative) + "\n";
+        }
+        char sum[32];
+        snprintf(sum, sizeof(sum), "%.9f", sums[r] / 1e9);
+        out += "webserver_request_duration_seconds_sum{" + label + "} " + sum + "\n";
+        out += "webserver_request_duration_seconds_count{" + label + "} " + std::to_string(cumulative) + "\n";
+    }
+    return out;
+}
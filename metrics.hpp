@@ -0,0 +1,117 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The server's counters: responses by status, bytes in and out, errors,
+// and a latency histogram for each route.  Every thread that records
+// anything gets its own copy (a Shard), which only it ever writes, so
+// recording is a load and a store on a cache line no other thread
+// touches: no locks and no contended atomics.  Reading the totals adds
+// up all the shards, which is only done when somebody asks for them.
+class Metrics
+{
+public:
+    enum Counter
+    {
+        BYTES_IN,
+        BYTES_OUT,
+        PARSE_ERRORS,  // Malformed (or cut off) requests.
+        ACCEPT_ERRORS,
+        SEND_ERRORS,
+        SHED,     // Connections and requests turned away by Admission.
+        TIMEOUTS, // Connections closed for sending a request too slowly.
+        COUNTERS
+    };
+
+    // Routes are numbered, and these two are always there: compile-time
+    // routes all count as "static", and requests that don't reach a
+    // handler at all (a bad path, or nothing registered) as "none".
+    static const size_t STATIC_ROUTE = 0;
+    static const size_t NO_ROUTE = 1;
+    // Routes past this many share the last histogram.
+    static const size_t maxRoutes = 64;
+
+    // Upper bounds of the latency buckets, in microseconds.  There is
+    // one more bucket past the last for everything slower.
+    static constexpr uint64_t bucketBounds[] = {50,    100,    250,    500,    1000,   2500,   5000,
+                                                10000, 25000,  50000,  100000, 250000, 500000, 1000000};
+    static const size_t buckets = std::size(bucketBounds) + 1;
+
+    Metrics();
+
+    // Names a new route and returns its number.  Like registering a
+    // handler this must be done before serving starts.
+    size_t addRoute(const std::string &name);
+
+    void add(Counter counter, uint64_t amount = 1)
+    {
+        bump(local().counters[counter], amount);
+    }
+
+    // A response has been sent with "status", and "route" took "took" to
+    // produce it.
+    void responded(size_t route, int status, std::chrono::steady_clock::duration took);
+
+    // Just the status, for responses that didn't go through a route.
+    void responded(int status)
+    {
+        bump(local().statuses[statusSlot(status)], 1);
+    }
+
+    // The totals across every thread.
+    uint64_t total(Counter counter) const;
+    uint64_t responses(int status) const;
+
+    // Everything, in the Prometheus text exposition format.
+    std::string prometheus() const;
+
+private:
+    // Statuses outside 100-599 all land in slot 0.
+    static const int statusSlots = 600;
+    static size_t statusSlot(int status)
+    {
+        return status >= 100 && status < statusSlots ? status : 0;
+    }
+
+    struct Histogram
+    {
+        std::atomic<uint64_t> counts[buckets] = {};
+        std::atomic<uint64_t> sumNanos = 0;
+    };
+
+    struct alignas(64) Shard
+    {
+        std::thread::id owner;
+        std::atomic<uint64_t> counters[COUNTERS] = {};
+        std::atomic<uint64_t> statuses[statusSlots] = {};
+        Histogram routes[maxRoutes];
+    };
+
+    // Only the owning thread writes, so this doesn't need to be an
+    // atomic add; readers just need to never see a torn value.
+    static void bump(std::atomic<uint64_t> &value, uint64_t amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    Shard &local();
+
+    // Tells apart Metrics that happen to have lived at the same address,
+    // for the per-thread cache in local().
+    const uint64_t id;
+
+    mutable std::mutex shardsLock;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<std::string> routeNames;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "alloccounter.hpp"
+#include "arena.hpp"
+#include "httprequest.hpp"
+#include "outputqueue.hpp"
+#include "webserver.hpp"
+
+// Microbenchmarks for the functions every request goes through, to look
+// at them one at a time where webserver_bench only sees the total.
+// Besides the time, each reports "allocs", the number of calls to
+// operator new per iteration, from alloccounter.cpp.
+
+// Counts the allocations made between construction and destruction,
+// which should bracket the benchmark's loop.
+class CountAllocations
+{
+public:
+    CountAllocations(benchmark::State &_state) : state(_state), start(allocationCount()) {}
+    ~CountAllocations()
+    {
+        state.counters["allocs"] =
+            benchmark::Counter((double)(allocationCount() - start), benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t start;
+};
+
+static std::string smallRequest()
+{
+    return "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\nAccept: */*\r\n\r\n";
+}
+
+// The sort of thing a browser with a pile of cookies sends.
+static std::string heavyRequest()
+{
+    std::string r = "GET /static/js/app.bundle.js?version=20240101 HTTP/1.1\r\n"
+                    "Host: www.example.com\r\n"
+                    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+                    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                    "Accept-Language: en-US,en;q=0.9\r\n"
+                    "Accept-Encoding: gzip, deflate, br\r\n"
+                    "Connection: keep-alive\r\n"
+                    "Cookie: ";
+    for (int i = 0; i < 20; ++i)
+    {
+        r += "session_token_" + std::to_string(i) + "=0123456789abcdef0123456789abcdef; ";
+    }
+    r += "last=1\r\n";
+    for (int i = 0; i < 16; ++i)
+    {
+        r += "X-Custom-Header-" + std::to_string(i) + ": some moderately long value for header number " +
+             std::to_string(i) + "\r\n";
+    }
+    return r + "\r\n";
+}
+
+static std::string requestFor(int64_t kind)
+{
+    return kind == 0 ? smallRequest() : heavyRequest();
+}
+
+// The original parser, straight from a string, with the headers used.
+static void BM_HTTPRequest(benchmark::State &state)
+{
+    std::string text = requestFor(state.range(0));
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        HTTPRequest request(text);
+        benchmark::DoNotOptimize(request.get_headers().size());
+    }
+}
+BENCHMARK(BM_HTTPRequest)->ArgName("heavy")->Arg(0)->Arg(1);
+
+// The server's path: parse a view in place, then build the request from
+// it in an arena.  Headers are only materialised when asked for.
+static void BM_HTTPRequestView(benchmark::State &state)
+{
+    std::string text = requestFor(state.range(0));
+    bool headers = state.range(1);
+    Arena arena;
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        {
+            HTTPRequestView view(text);
+            HTTPRequest request(view, &arena);
+            if (headers)
+            {
+                benchmark::DoNotOptimize(request.get_headers().size());
+            }
+            benchmark::DoNotOptimize(request.get_resource());
+        }
+        arena.reset();
+    }
+}
+BENCHMARK(BM_HTTPRequestView)->ArgNames({"heavy", "headers"})->ArgsProduct({{0, 1}, {0, 1}});
+
+static void BM_HTTPHeader(benchmark::State &state)
+{
+    std::string line = "Accept-Language:   en-US,en;q=0.9  ";
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        HTTPHeader header(line);
+        benchmark::DoNotOptimize(header);
+    }
+}
+BENCHMARK(BM_HTTPHeader);
+
+// DispatchResponse is protected, which is fine for a subclass.
+class BenchWebServer : public WebServer
+{
+public:
+    using WebServer::DispatchResponse;
+};
+
+// Dispatches to a handler "depth" segments deep, with "handlers" other
+// handlers registered alongside it.
+static void BM_DispatchResponse(benchmark::State &state)
+{
+    int64_t depth = state.range(0);
+    int64_t handlers = state.range(1);
+    BenchWebServer server;
+    std::string path;
+    for (int64_t i = 0; i < depth; ++i)
+    {
+        path += "/segment" + std::to_string(i);
+    }
+    for (int64_t i = 0; i < handlers; ++i)
+    {
+        server.RegisterHandler(path.substr(0, path.rfind('/')) + "/other" + std::to_string(i), dummyHandler);
+    }
+    server.RegisterHandler(path, dummyHandler);
+    std::string text = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    Arena arena;
+    OutputQueue queue;
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        {
+            HTTPRequestView view(text);
+            HTTPRequest request(view, &arena);
+            HTTPResponder responder(-1, &queue, &arena);
+            server.DispatchResponse(request, responder);
+        }
+        queue.advance(queue.pending());
+        arena.reset();
+    }
+}
+BENCHMARK(BM_DispatchResponse)->ArgNames({"depth", "handlers"})->ArgsProduct({{1, 8}, {1, 100, 1000}});
+
+static void BM_Mimetype(benchmark::State &state)
+{
+    std::vector<std::string> names = {"index.html", "logo.svg", "photo.jpeg", "app.bundle.js", "README"};
+    size_t next = 0;
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(mimetype(names[next]));
+        next = next + 1 == names.size() ? 0 : next + 1;
+    }
+}
+BENCHMARK(BM_Mimetype);
+
+// Formatting the status line and headers plus copying in the body.
+static void BM_SendResponse(benchmark::State &state)
+{
+    std::string body(state.range(0), 'x');
+    Arena arena;
+    OutputQueue queue;
+    CountAllocations count(state);
+    for (auto _ : state)
+    {
+        {
+            HTTPResponder responder(-1, &queue, &arena);
+            responder.headers["Content-Type"] = "text/html";
+            responder.sendResponse(body);
+        }
+        benchmark::DoNotOptimize(queue.pending());
+        queue.advance(queue.pending());
+        arena.reset();
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_SendResponse)->ArgName("body")->Arg(0)->Arg(128)->Arg(4096)->Arg(65536);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "outputqueue.hpp"
+
+void OutputQueue::append(std::string_view data)
+{
+    if (data.empty())
+        return;
+    queued += data.size();
+    // Appending straight after the last inline piece just makes it longer,
+    // so a response built up a header at a time is still one piece.
+    if (chunks.size() > head && chunks.back().kind == Chunk::INLINE &&
+        chunks.back().offset + chunks.back().length == buffer.size())
+    {
+        chunks.back().length += data.size();
+    }
+    else
+    {
+        chunks.push_back(Chunk{Chunk::INLINE, buffer.size(), data.size(), nullptr, nullptr, nullptr});
+    }
+    buffer.append(data);
+}
+
+void OutputQueue::appendShared(std::shared_ptr<const std::string> data, size_t offset, size_t length)
+{
+    length = std::min(length, data->size() - std::min(offset, data->size()));
+    if (length == 0)
+        return;
+    queued += length;
+    const char *base = data->data();
+    chunks.push_back(Chunk{Chunk::SHARED, offset, length, std::move(data), base, nullptr});
+}
+
+void OutputQueue::appendMapped(std::shared_ptr<const void> owner, std::string_view data)
+{
+    if (data.empty())
+        return;
+    queued += data.size();
+    chunks.push_back(Chunk{Chunk::SHARED, 0, data.size(), std::move(owner), data.data(), nullptr});
+}
+
+void OutputQueue::appendFile(std::shared_ptr<OpenFile> file, off_t offset, size_t length)
+{
+    if (length == 0)
+        return;
+    queued += length;
+    chunks.push_back(Chunk{Chunk::FILE, (size_t)offset, length, nullptr, nullptr, file});
+}
+
+void OutputQueue::splice(OutputQueue &other)
+{
+    for (size_t i = other.head; i < other.chunks.size(); ++i)
+    {
+        Chunk &c = other.chunks[i];
+        if (c.kind == Chunk::INLINE)
+        {
+            append(std::string_view(other.buffer).substr(c.offset, c.length));
+        }
+        else
+        {
+            queued += c.length;
+            chunks.push_back(std::move(c));
+        }
+    }
+    other.chunks.clear();
+    other.buffer.clear();
+    other.head = 0;
+    other.queued = 0;
+}
+
+OutputQueue::Result OutputQueue::write(int socket)
+{
+    while (head < chunks.size())
+    {
+        Result result = chunks[head].kind == Chunk::FILE ? sendFile(socket, chunks[head]) : sendMemory(socket);
+        if (result != DONE)
+            return result;
+    }
+    return DONE;
+}
+
+OutputQueue::Result OutputQueue::flush(int socket)
+{
+    while (true)
+    {
+        Result result = write(socket);
+        if (result != AGAIN)
+            return result;
+        struct pollfd p = {socket, POLLOUT, 0};
+        if (poll(&p, 1, -1) == -1 && errno != EINTR)
+        {
+            std::cerr << "Poll error : " << strerror(errno) << "\n";
+            return ERROR;
+        }
+    }
+}
+
+// Sends one file range.  It counts as DONE when this call made some
+// progress, so the caller comes straight back round for the rest.
+OutputQueue::Result OutputQueue::sendFile(int socket, Chunk &c)
+{
+    off_t offset = c.offset;
+    auto sent = sendfile(socket, c.file->fd, &offset, c.length);
+    if (sent == -1)
+    {
+        if (errno == EINTR)
+            return DONE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AGAIN;
+        std::cerr << "Send error : " << strerror(errno) << "\n";
+        return ERROR;
+    }
+    if (sent == 0)
+    {
+        // The file got shorter after we promised a Content-Length, so
+        // there is no way to finish this response.
+        std::cerr << "File truncated while sending\n";
+        return ERROR;
+    }
+    advance(sent);
+    return DONE;
+}
+
+int OutputQueue::gather(struct iovec *vectors, int max) const
+{
+    int count = 0;
+    for (size_t i = head; i < chunks.size() && count < max && chunks[i].kind != Chunk::FILE; ++i)
+    {
+        const Chunk &c = chunks[i];
+        const char *base = c.kind == Chunk::INLINE ? buffer.data() : c.base;
+        vectors[count].iov_base = (void *)(base + c.offset);
+        vectors[count].iov_len = c.length;
+        count++;
+    }
+    return count;
+}
+
+bool OutputQueue::frontFile(int &fd, off_t &offset, size_t &length) const
+{
+    if (head >= chunks.size() || chunks[head].kind != Chunk::FILE)
+        return false;
+    fd = chunks[head].file->fd;
+    offset = chunks[head].offset;
+    length = chunks[head].length;
+    return true;
+}
+
+// Sends the run of in-memory pieces at the front of the queue with one
+// vectored call.  This is sendmsg() rather than writev() only because
+// writev() can't take MSG_NOSIGNAL, and we would rather see EPIPE than
+// get killed by SIGPIPE when a client goes away.
+OutputQueue::Result OutputQueue::sendMemory(int socket)
+{
+    const int maxVectors = 64;
+    struct iovec vectors[maxVectors];
+    struct msghdr message = {};
+    message.msg_iov = vectors;
+    message.msg_iovlen = gather(vectors, maxVectors);
+    auto sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+    if (sent == -1)
+    {
+        if (errno == EINTR)
+            return DONE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AGAIN;
+        std::cerr << "Send error : " << strerror(errno) << "\n";
+        return ERROR;
+    }
+    advance(sent);
+    return DONE;
+}
+
+// Moves past "sent" bytes, which may end partway through a piece.
+void OutputQueue::advance(size_t sent)
+{
+    queued -= sent;
+    while (sent > 0)
+    {
+        Chunk &c = chunks[head];
+        if (sent < c.length)
+        {
+            c.offset += sent;
+            c.length -= sent;
+            break;
+        }
+        sent -= c.length;
+        c.owner.reset();
+        c.file.reset();
+        head++;
+    }
+    if (head == chunks.size())
+    {
+        // Everything has been sent, so the next append() starts again at
+        // the front of the buffer, which keeps its memory.  Every way of
+        // sending comes through here, write() included.
+        chunks.clear();
+        buffer.clear();
+        head = 0;
+        return;
+    }
+    compact();
+}
+
+// A connection that never quite catches up never gets to the reset in
+// advance(), so once most of the buffer has been sent we shift the
+// rest down rather than let it grow forever.
+void OutputQueue::compact()
+{
+    const size_t threshold = 64 * 1024;
+    if (head < chunks.size() && buffer.size() > threshold)
+    {
+        size_t start = buffer.size();
+        for (size_t i = head; i < chunks.size(); ++i)
+        {
+            if (chunks[i].kind == Chunk::INLINE)
+            {
+                start = chunks[i].offset;
+                break;
+            }
+        }
+        if (start > buffer.size() / 2)
+        {
+            buffer.erase(0, start);
+            for (size_t i = head; i < chunks.size(); ++i)
+            {
+                if (chunks[i].kind == Chunk::INLINE)
+                    chunks[i].offset -= start;
+            }
+        }
+    }
+    if (head > 64 && head > chunks.size() / 2)
+    {
+        chunks.erase(chunks.begin(), chunks.begin() + head);
+        head = 0;
+    }
+}
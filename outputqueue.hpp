@@ -0,0 +1,97 @@
+#ifndef _OUTPUT_QUEUE_H
+#define _OUTPUT_QUEUE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "filecache.hpp"
+
+// This is the queue of everything waiting to be sent on a connection,
+// in order.  Each piece is either bytes copied into the queue's own buffer
+// (the headers, or a body a handler built in memory), a shared block of
+// bytes that is referenced rather than copied (a cached file, or part of
+// an asset bundle), or a range of an open file.
+//
+// Runs of in-memory pieces go out together in one vectored send, so the
+// headers and body of a response (or several pipelined responses) cost a
+// single system call.  File ranges are sent with sendfile(), straight from
+// the page cache to the socket.  The buffer and the list of pieces are kept
+// for reuse once everything has been sent, so a connection that stays open
+// stops allocating after its first few responses.
+class OutputQueue
+{
+public:
+    enum Result
+    {
+        DONE,  // Everything has been sent.
+        AGAIN, // The socket is full, try again when it is writable.
+        ERROR  // The connection is broken.
+    };
+
+    void append(std::string_view data);
+    // Just "length" bytes from "offset" of "data" if those are given.
+    void appendShared(std::shared_ptr<const std::string> data, size_t offset = 0,
+                      size_t length = std::string::npos);
+    // Bytes that stay put for as long as "owner" is held, such as part of
+    // a memory mapping.
+    void appendMapped(std::shared_ptr<const void> owner, std::string_view data);
+    void appendFile(std::shared_ptr<OpenFile> file, off_t offset, size_t length);
+
+    // Moves everything still waiting in "other" onto the end of this
+    // queue, leaving "other" empty.  Shared and file pieces are moved
+    // across without copying their bytes.
+    void splice(OutputQueue &other);
+
+    // How many bytes are still waiting to go out.
+    size_t pending() const { return queued; }
+    bool empty() const { return queued == 0; }
+
+    // Sends as much as the socket will take without blocking.
+    Result write(int socket);
+
+    // Sends everything, waiting for the socket to drain whenever it is
+    // full.  This is for sockets that aren't run by an event loop.
+    Result flush(int socket);
+
+    // These are for callers that do the sending themselves, such as the
+    // io_uring worker.  gather() fills in up to "max" vectors for the run
+    // of in-memory pieces at the front of the queue and returns how many
+    // it used, which is 0 if a file range is first instead.  frontFile()
+    // describes that file range.  Either way advance() then says how
+    // much was actually sent.
+    int gather(struct iovec *vectors, int max) const;
+    bool frontFile(int &fd, off_t &offset, size_t &length) const;
+    void advance(size_t sent);
+
+private:
+    struct Chunk
+    {
+        enum Kind
+        {
+            INLINE, // "offset" and "length" are a range of "buffer".
+            SHARED, // ...a range of "base", which "owner" keeps alive.
+            FILE    // ...a range of the file.
+        };
+        Kind kind;
+        size_t offset;
+        size_t length;
+        std::shared_ptr<const void> owner;
+        const char *base;
+        std::shared_ptr<OpenFile> file;
+    };
+    std::string buffer;
+    std::vector<Chunk> chunks;
+    // Chunks before "head" have been sent.
+    size_t head = 0;
+    size_t queued = 0;
+
+    Result sendFile(int socket, Chunk &c);
+    Result sendMemory(int socket);
+    void compact();
+};
+
+#endif
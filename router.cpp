@@ -0,0 +1,88 @@
+#include "router.hpp"
+
+RadixRouter::Node *RadixRouter::Node::child(char c) const
+{
+    for (auto &n : children)
+    {
+        if (n->label[0] == c)
+            return n.get();
+    }
+    return nullptr;
+}
+
+void RadixRouter::add(std::string_view path, const HandlerFunction *handler)
+{
+    Node *node = root.get();
+    while (!path.empty())
+    {
+        Node *next = node->child(path[0]);
+        if (next == nullptr)
+        {
+            // Nothing shares this first character, so the rest of the
+            // path becomes a single new edge.
+            auto leaf = std::make_unique<Node>();
+            leaf->label = path;
+            leaf->handler = handler;
+            node->children.push_back(std::move(leaf));
+            return;
+        }
+        size_t common = 0;
+        while (common < next->label.size() && common < path.size() && next->label[common] == path[common])
+        {
+            common++;
+        }
+        if (common < next->label.size())
+        {
+            // The path leaves this edge partway along, so split it in two
+            // with a new node where they part ways.
+            auto split = std::make_unique<Node>();
+            split->label = next->label.substr(0, common);
+            next->label = next->label.substr(common);
+            for (auto &n : node->children)
+            {
+                if (n.get() == next)
+                {
+                    split->children.push_back(std::move(n));
+                    n = std::move(split);
+                    next = n.get();
+                    break;
+                }
+            }
+        }
+        path.remove_prefix(common);
+        node = next;
+    }
+    node->handler = handler;
+}
+
+const HandlerFunction *RadixRouter::find(std::string_view path, RouteScore &score) const
+{
+    const Node *node = root.get();
+    const HandlerFunction *best = nullptr;
+    score = 0;
+    size_t position = 0;
+    while (true)
+    {
+        if (node->handler != nullptr)
+        {
+            if (position == path.size())
+            {
+                score = EXACT_MATCH;
+                return node->handler;
+            }
+            // A path responder is one whose path ends in "/".
+            if (position > 0 && path[position - 1] == '/')
+            {
+                best = node->handler;
+                score = position;
+            }
+        }
+        if (position == path.size())
+            break;
+        node = node->child(path[position]);
+        if (node == nullptr || path.compare(position, node->label.size(), node->label) != 0)
+            break;
+        position += node->label.size();
+    }
+    return best;
+}
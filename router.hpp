@@ -0,0 +1,122 @@
+#ifndef _ROUTER_H
+#define _ROUTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <limits>
+
+#include "httprequest.hpp"
+
+class HTTPResponder;
+
+typedef std::function<void(HTTPRequest &, HTTPResponder &)> HandlerFunction;
+
+// How well a registered path matches a request.  An exact match beats
+// everything, then the longest path responder (a path ending in "/")
+// that the request starts with.  Zero means no match at all.
+typedef size_t RouteScore;
+const RouteScore EXACT_MATCH = std::numeric_limits<RouteScore>::max();
+
+// This is the runtime router behind RegisterHandler().  It is a radix trie
+// (a trie where chains of single-child nodes are squashed into one edge
+// with a multi-character label) over the registered paths.  A lookup
+// walks the request path once from the front, remembering the last
+// path responder it passed, so it finds the best match without building
+// any substrings.
+class RadixRouter
+{
+public:
+    RadixRouter() : root(std::make_unique<Node>()) {}
+
+    // The router doesn't own the handlers, it just points at them, so
+    // they have to stay put for as long as the router is in use.
+    void add(std::string_view path, const HandlerFunction *handler);
+
+    // Returns nullptr if nothing matches.
+    const HandlerFunction *find(std::string_view path, RouteScore &score) const;
+
+private:
+    struct Node
+    {
+        std::string label;
+        std::vector<std::unique_ptr<Node>> children;
+        const HandlerFunction *handler = nullptr;
+
+        Node *child(char c) const;
+    };
+    std::unique_ptr<Node> root;
+};
+
+// And this is the compile-time counterpart for routes that are fixed when
+// the server is built, such as the ones in main.cpp.  The paths are
+// template arguments, so the matching is all against constants, and
+// the handler that wins is called directly rather than through a
+// std::function.  For example:
+//
+//   server.RegisterStaticRoutes<StaticRouter<Route<"/dummy", dummyHandler>,
+//                                            Route<"/dummypath/is/great/", dummyHandler>>>();
+//
+// Static routes follow exactly the same matching rules as registered
+// handlers, and the two sets are considered together.
+
+template <size_t N>
+struct RoutePath
+{
+    char text[N];
+    constexpr RoutePath(const char (&s)[N]) { std::copy_n(s, N, text); }
+    constexpr std::string_view view() const { return std::string_view(text, N - 1); }
+};
+
+template <RoutePath Path, void (*Function)(HTTPRequest &, HTTPResponder &)>
+struct Route
+{
+    static constexpr std::string_view path = Path.view();
+    static_assert(path.starts_with('/'), "Routes must start with /");
+
+    static constexpr RouteScore score(std::string_view request)
+    {
+        if (request == path)
+            return EXACT_MATCH;
+        if (path.ends_with('/') && request.starts_with(path))
+            return path.size();
+        return 0;
+    }
+
+    static void call(HTTPRequest &r, HTTPResponder &resp) { Function(r, resp); }
+};
+
+template <typename... Routes>
+struct StaticRouter
+{
+    // Calls the best matching route and returns true, unless none of them
+    // beats "toBeat" (the score of the best runtime handler).
+    static bool dispatch(std::string_view path, RouteScore toBeat, HTTPRequest &r, HTTPResponder &resp)
+    {
+        RouteScore best = toBeat;
+        int which = -1;
+        int i = 0;
+        ((Routes::score(path) > best ? (best = Routes::score(path), which = i) : 0, ++i), ...);
+        if (which < 0)
+            return false;
+        i = 0;
+        ((i++ == which ? (Routes::call(r, resp), true) : false) || ...);
+        return true;
+    }
+
+    // The score of the best matching route, without calling it.
+    static constexpr RouteScore score(std::string_view path)
+    {
+        RouteScore best = 0;
+        ((best = std::max(best, Routes::score(path))), ...);
+        return best;
+    }
+};
+
+typedef bool (*StaticDispatch)(std::string_view path, RouteScore toBeat, HTTPRequest &r, HTTPResponder &resp);
+typedef RouteScore (*StaticScore)(std::string_view path);
+
+#endif
@@ -0,0 +1,124 @@
+#include <atomic>
+
+#include "simdscan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SCAN_X86 1
+#endif
+
+static size_t find_any_scalar(const char *data, size_t size, size_t from, char a, char b, char c, char d){
+  for(size_t i = from; i < size; ++i){
+    char x = data[i];
+    if(x == a || x == b || x == c || x == d) return i;
+  }
+  return std::string_view::npos;
+}
+
+#ifdef SIMD_SCAN_X86
+// Every x86-64 CPU has SSE2, so this needs no special target.
+static size_t find_any_sse2(const char *data, size_t size, size_t from, char a, char b, char c, char d){
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+  const __m128i vd = _mm_set1_epi8(d);
+  size_t i = from;
+  for(; i + 16 <= size; i += 16){
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb)),
+                                _mm_or_si128(_mm_cmpeq_epi8(block, vc), _mm_cmpeq_epi8(block, vd)));
+    unsigned int mask = _mm_movemask_epi8(hits);
+    if(mask != 0) return i + __builtin_ctz(mask);
+  }
+  return find_any_scalar(data, size, i, a, b, c, d);
+}
+
+__attribute__((target("avx2")))
+static size_t find_any_avx2(const char *data, size_t size, size_t from, char a, char b, char c, char d){
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+  const __m256i vc = _mm256_set1_epi8(c);
+  const __m256i vd = _mm256_set1_epi8(d);
+  size_t i = from;
+  for(; i + 32 <= size; i += 32){
+    __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb)),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(block, vc), _mm256_cmpeq_epi8(block, vd)));
+    unsigned int mask = _mm256_movemask_epi8(hits);
+    if(mask != 0) return i + __builtin_ctz(mask);
+  }
+  // The last few bytes can still go 16 at a time.
+  return find_any_sse2(data, size, i, a, b, c, d);
+}
+#endif
+
+typedef size_t (*FindAny)(const char *, size_t, size_t, char, char, char, char);
+
+static bool supported(ScanKernel kernel){
+#ifdef SIMD_SCAN_X86
+  if(kernel == ScanKernel::AVX2) return __builtin_cpu_supports("avx2");
+  return true;
+#else
+  return kernel == ScanKernel::SCALAR;
+#endif
+}
+
+static FindAny kernel_function(ScanKernel kernel){
+#ifdef SIMD_SCAN_X86
+  if(kernel == ScanKernel::AVX2) return find_any_avx2;
+  if(kernel == ScanKernel::SSE2) return find_any_sse2;
+#endif
+  return find_any_scalar;
+}
+
+static ScanKernel best_kernel(){
+  if(supported(ScanKernel::AVX2)) return ScanKernel::AVX2;
+  if(supported(ScanKernel::SSE2)) return ScanKernel::SSE2;
+  return ScanKernel::SCALAR;
+}
+
+static std::atomic<ScanKernel> current_kernel = best_kernel();
+static std::atomic<FindAny> current_find = kernel_function(best_kernel());
+
+ScanKernel scan_kernel(){
+  return current_kernel;
+}
+
+bool use_scan_kernel(ScanKernel kernel){
+  if(!supported(kernel)) return false;
+  current_kernel = kernel;
+  current_find = kernel_function(kernel);
+  return true;
+}
+
+const char *scan_kernel_name(ScanKernel kernel){
+  switch(kernel){
+  case ScanKernel::AVX2: return "avx2";
+  case ScanKernel::SSE2: return "sse2";
+  default: return "scalar";
+  }
+}
+
+size_t find_any(std::string_view s, size_t from, char a, char b, char c, char d){
+  if(from >= s.size()) return std::string_view::npos;
+  return current_find.load(std::memory_order_relaxed)(s.data(), s.size(), from, a, b, c, d);
+}
+
+// For these we let the kernel find each \r, and then check what follows.
+size_t find_crlf(std::string_view s, size_t from){
+  while(true){
+    auto cr = find_char(s, from, '\r');
+    if(cr == std::string_view::npos || cr + 1 >= s.size()) return std::string_view::npos;
+    if(s[cr + 1] == '\n') return cr;
+    from = cr + 1;
+  }
+}
+
+size_t find_crlfcrlf(std::string_view s, size_t from){
+  while(true){
+    auto cr = find_char(s, from, '\r');
+    if(cr == std::string_view::npos || cr + 3 >= s.size()) return std::string_view::npos;
+    if(s[cr + 1] == '\n' && s[cr + 2] == '\r' && s[cr + 3] == '\n') return cr;
+    from = cr + 1;
+  }
+}
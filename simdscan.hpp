@@ -0,0 +1,40 @@
+#ifndef _SIMD_SCAN_H
+#define _SIMD_SCAN_H
+
+#include <string>
+#include <string_view>
+
+// These are the delimiter searches the request parsers spend most of their
+// time in: finding the CR, LF, colon and space bytes that break a request
+// into lines and fields.  Rather than looking at one byte at a time they
+// compare 16 (SSE2) or 32 (AVX2) bytes at once and pick the first match
+// out of the resulting bit mask.  Which version is used is decided once,
+// at startup, from what the CPU supports, with a plain scalar loop as the
+// fallback on other architectures.
+//
+// All of them return std::string_view::npos if there is no match.
+
+enum class ScanKernel {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+// The first byte at or after "from" that is any of a, b, c or d.
+size_t find_any(std::string_view s, size_t from, char a, char b, char c, char d);
+
+inline size_t find_char(std::string_view s, size_t from, char a){
+  return find_any(s, from, a, a, a, a);
+}
+
+// The first "\r\n", or "\r\n\r\n", that starts at or after "from".
+size_t find_crlf(std::string_view s, size_t from);
+size_t find_crlfcrlf(std::string_view s, size_t from);
+
+// The kernel in use, and a way to pick a different one for testing and
+// benchmarking.  Returns false if this CPU can't run the one asked for.
+ScanKernel scan_kernel();
+bool use_scan_kernel(ScanKernel kernel);
+const char *scan_kernel_name(ScanKernel kernel);
+
+#endif
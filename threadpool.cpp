@@ -0,0 +1,131 @@
+#include "threadpool.hpp"
+
+// Which pool (if any) the current thread belongs to, and its queue.
+static thread_local ThreadPool *currentPool = nullptr;
+static thread_local unsigned int currentQueue = 0;
+
+ThreadPool::ThreadPool(unsigned int threadCount, size_t _capacity) : capacity(_capacity == 0 ? 1 : _capacity)
+{
+    if (threadCount == 0)
+        threadCount = 1;
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([this, i]()
+                             { run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+bool ThreadPool::trySubmit(std::function<void()> task)
+{
+    // Claim a slot first, so that however many threads submit at once
+    // we never go over the capacity.
+    size_t queuedNow = count.load();
+    do
+    {
+        if (queuedNow >= capacity)
+            return false;
+    } while (!count.compare_exchange_weak(queuedNow, queuedNow + 1));
+
+    if (currentPool == this)
+    {
+        Queue &own = *queues[currentQueue];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.local.push_back(std::move(task));
+    }
+    else
+    {
+        Queue &next = *queues[nextQueue++ % queues.size()];
+        std::lock_guard<std::mutex> guard(next.lock);
+        next.injected.push_back(std::move(task));
+    }
+    {
+        // Taking the lock means a thread that has just seen no work
+        // can't miss this wake up on its way to sleep.
+        std::lock_guard<std::mutex> guard(sleepLock);
+    }
+    wake.notify_one();
+    return true;
+}
+
+// Our own work from the back, then what came from outside from the
+// front, then everybody else's, oldest first.
+bool ThreadPool::take(unsigned int index, std::function<void()> &task)
+{
+    {
+        Queue &own = *queues[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.local.empty())
+        {
+            task = std::move(own.local.back());
+            own.local.pop_back();
+            count--;
+            return true;
+        }
+        if (!own.injected.empty())
+        {
+            task = std::move(own.injected.front());
+            own.injected.pop_front();
+            count--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i)
+    {
+        Queue &other = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        auto &tasks = other.injected.empty() ? other.local : other.injected;
+        if (!tasks.empty())
+        {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(unsigned int index)
+{
+    currentPool = this;
+    currentQueue = index;
+    while (true)
+    {
+        std::function<void()> task;
+        if (take(index, task))
+        {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleepLock);
+        if (count > 0)
+        {
+            // A task has been counted but not pushed yet, it will
+            // be there in a moment.
+            guard.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        if (stopping)
+            return;
+        wake.wait(guard, [this]()
+                  { return stopping || count > 0; });
+    }
+}
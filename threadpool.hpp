@@ -0,0 +1,67 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+
+// A fixed set of threads for running handlers that would hold up an event
+// loop, such as ones that block on the disk or on another service.
+//
+// Each thread has its own queues.  Work handed in from outside goes round
+// the threads in turn and is run oldest first, so nobody's request waits
+// behind ones that came after it.  Work submitted from inside a task stays
+// with that thread, where it is run newest first while it is still warm
+// in the cache (and ahead of the work from outside, which is usually what
+// it is part of).  A thread that runs out of work steals the oldest task
+// from one of the others, so a handful of slow tasks on one thread don't
+// leave the rest of the pool sitting idle.
+//
+// The pool holds at most "capacity" tasks that haven't started yet.
+// Beyond that trySubmit() refuses, and it is up to the caller to shed the
+// work, rather than letting the queue (and the latency) grow without
+// bound.
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned int threads, size_t _capacity);
+
+    // Runs everything already queued, then stops the threads.
+    ~ThreadPool();
+
+    // Returns false, without taking the task, if the pool is full.
+    bool trySubmit(std::function<void()> task);
+
+    // Tasks waiting for a thread.
+    size_t queued() const { return count; }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        // Submitted from outside the pool, and by the thread itself.
+        std::deque<std::function<void()>> injected;
+        std::deque<std::function<void()>> local;
+    };
+
+    const size_t capacity;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> count = 0;
+    std::atomic<unsigned int> nextQueue = 0;
+
+    // Idle threads sleep here until there is work or we are stopping.
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void run(unsigned int index);
+    bool take(unsigned int index, std::function<void()> &task);
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Deadlines for a great many connections, to within a tick.  Time is cut
+// into ticks, and a timer goes in the slot for its tick, modulo the
+// number of slots, so setting one and firing one are both O(1), however
+// many there are and however far off they are.  Going round the slots
+// only looks at the ones whose ticks have come, rather than at every
+// connection.
+//
+// Timers can't be cancelled.  Whoever set one is expected to check, when
+// it fires, whether it still matters, and set another if it has to.
+template <typename T>
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TimerWheel(std::chrono::milliseconds _tick = std::chrono::milliseconds(100), size_t slotCount = 512)
+        : tick(_tick), slots(slotCount), origin(Clock::now())
+    {
+    }
+
+    // "value" is handed back by expire() once "when" has passed.
+    void schedule(Clock::time_point when, T value)
+    {
+        uint64_t at = std::max<int64_t>(0, (when - origin + tick - Clock::duration(1)) / tick);
+        // Anything already due goes in the next tick to come.
+        at = std::max(at, current + 1);
+        slots[at % slots.size()].push_back(Entry{at, std::move(value)});
+        count++;
+    }
+
+    // Calls "fired" with every timer that is due by "now".  It can set
+    // new timers as it goes.
+    template <typename F>
+    void expire(Clock::time_point now, F fired)
+    {
+        if (now < origin)
+            return;
+        uint64_t target = (now - origin) / tick;
+        // However long it has been, each slot only needs looking at once.
+        uint64_t steps = std::min<uint64_t>(target - std::min(target, current), slots.size());
+        std::vector<T> due;
+        for (uint64_t i = 1; i <= steps; ++i)
+        {
+            auto &slot = slots[(current + i) % slots.size()];
+            auto later = std::partition(slot.begin(), slot.end(), [target](const Entry &e)
+                                        { return e.at > target; });
+            for (auto it = later; it != slot.end(); ++it)
+                due.push_back(std::move(it->value));
+            slot.erase(later, slot.end());
+        }
+        current = std::max(current, target);
+        count -= due.size();
+        for (auto &value : due)
+            fired(value);
+    }
+
+    // When the next tick ends, which is as soon as anything could be due.
+    Clock::time_point nextTick() const { return origin + tick * (current + 1); }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+private:
+    struct Entry
+    {
+        uint64_t at;
+        T value;
+    };
+
+    const std::chrono::milliseconds tick;
+    std::vector<std::vector<Entry>> slots;
+    Clock::time_point origin;
+    // The last tick that has been expired.
+    uint64_t current = 0;
+    size_t count = 0;
+};
+
+#endif
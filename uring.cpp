@@ -0,0 +1,207 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <algorithm>
+
+#include "uring.hpp"
+
+static int uringSetup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+static int uringRegister(int fd, unsigned int opcode, void *arg, unsigned int args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+IoUring::IoUring(unsigned int entries)
+{
+    struct io_uring_params params = {};
+    int fd = uringSetup(entries, &params);
+    if (fd < 0)
+        return;
+    // Everything below relies on the rings sharing one mapping (5.4+).
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        return;
+    }
+    // With a single mapping it has to be big enough for both rings.
+    sqRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+                          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        sqRing = nullptr;
+        close(fd);
+        return;
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *entriesMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (entriesMemory == MAP_FAILED)
+    {
+        munmap(sqRing, sqRingSize);
+        sqRing = nullptr;
+        close(fd);
+        return;
+    }
+    sqes = static_cast<struct io_uring_sqe *>(entriesMemory);
+
+    char *sq = static_cast<char *>(sqRing);
+    sqHead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    char *cq = sq;
+    cqHead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    sqEntries = params.sq_entries;
+    ringFd = fd;
+}
+
+IoUring::~IoUring()
+{
+    if (ringFd == -1)
+        return;
+    // Closing the ring cancels anything still in flight.
+    close(ringFd);
+    munmap(sqes, sqesSize);
+    munmap(sqRing, sqRingSize);
+    if (bufferRing != nullptr)
+        munmap(bufferRing, bufferRingSize);
+}
+
+bool IoUring::supported()
+{
+    static const bool result = []()
+    {
+        IoUring ring(4);
+        if (!ring.ok())
+            return false;
+        std::vector<char> memory(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+        auto probe = reinterpret_cast<struct io_uring_probe *>(memory.data());
+        if (uringRegister(ring.ringFd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        // Multishot recv arrived in the same release (6.0) as zero copy
+        // send, which is the nearest thing to a feature flag for it.
+        for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ,
+                       IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_SEND_ZC})
+        {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+        // And provided buffer rings (5.19) have to register.
+        return ring.provideBuffers(0, 2, 64);
+    }();
+    return result;
+}
+
+struct io_uring_sqe *IoUring::prepare()
+{
+    unsigned int tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+    {
+        submit();
+        tail = *sqTail;
+    }
+    unsigned int index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return sqe;
+}
+
+void IoUring::reserve(unsigned int count)
+{
+    if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + count > sqEntries)
+    {
+        submit();
+    }
+}
+
+bool IoUring::submit(unsigned int waitFor)
+{
+    while (true)
+    {
+        int result = uringEnter(ringFd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (result >= 0)
+        {
+            toSubmit -= std::min((unsigned int)result, toSubmit);
+            if (toSubmit == 0 || waitFor > 0)
+                return true;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            // Anything submitted before the signal has been taken.
+            if (waitFor == 0)
+                continue;
+            return true;
+        }
+        if (errno == EAGAIN || errno == EBUSY)
+        {
+            // The completion queue is full, so the caller has to reap
+            // some before more can go in.
+            return true;
+        }
+        std::cerr << "io_uring_enter error: " << strerror(errno) << "\n";
+        return false;
+    }
+}
+
+bool IoUring::provideBuffers(uint16_t group, unsigned int count, size_t size)
+{
+    bufferRingSize = count * sizeof(struct io_uring_buf);
+    void *memory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+    bufferRing = static_cast<struct io_uring_buf_ring *>(memory);
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)bufferRing;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (uringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(bufferRing, bufferRingSize);
+        bufferRing = nullptr;
+        return false;
+    }
+    bufferCount = count;
+    bufferSize = size;
+    bufferGroup = group;
+    bufferMemory.reset(new char[count * size]);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        recycle(i);
+    }
+    return true;
+}
+
+void IoUring::recycle(uint16_t id)
+{
+    // The ring's tail overlays the reserved field of the first entry. The
+    // header spells that as a union with a flexible array, which C++
+    // compilers lay out differently, so index the entries directly.
+    struct io_uring_buf *entries = reinterpret_cast<struct io_uring_buf *>(bufferRing);
+    uint16_t *tailp = &entries[0].resv;
+    uint16_t tail = *tailp;
+    struct io_uring_buf &entry = entries[tail & (bufferCount - 1)];
+    entry.addr = (uint64_t)buffer(id);
+    entry.len = bufferSize;
+    entry.bid = id;
+    __atomic_store_n(tailp, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
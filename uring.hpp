@@ -0,0 +1,92 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// A small wrapper over the raw io_uring system calls, with just what the
+// io_uring worker needs: a submission and completion queue mapped into
+// our memory, and a ring of provided buffers the kernel picks from when a
+// multishot recv has data, so we don't need a buffer per idle connection.
+//
+// There is no liburing dependency, so this talks to the kernel directly.
+class IoUring
+{
+public:
+    IoUring(unsigned int entries);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // False if the ring couldn't be set up, in which case none of the
+    // rest can be used.
+    bool ok() const { return ringFd != -1; }
+
+    // Whether this kernel has everything the io_uring worker uses:
+    // multishot accept and recv, provided buffer rings, and the basic
+    // send, read, poll and timeout operations.  Worked out once.
+    static bool supported();
+
+    // The next free submission entry, cleared.  If the queue is full
+    // what's in it is submitted first to make room.
+    struct io_uring_sqe *prepare();
+
+    // Makes sure the next "count" calls to prepare() won't submit in
+    // between, which would split a linked chain.
+    void reserve(unsigned int count);
+
+    // Submits everything prepared and waits for at least "waitFor"
+    // completions.  Returns false on an error other than EINTR.
+    bool submit(unsigned int waitFor = 0);
+
+    // Calls "f" with each completion that has arrived, then frees their
+    // slots.  "f" may prepare new entries.
+    template <typename F>
+    unsigned int completions(F f)
+    {
+        unsigned int seen = 0;
+        unsigned int head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            f(cqes[head & *cqMask]);
+            head++;
+            seen++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+    // Sets up "count" provided buffers of "size" bytes in buffer group
+    // "group".  Count must be a power of two.
+    bool provideBuffers(uint16_t group, unsigned int count, size_t size);
+    char *buffer(uint16_t id) { return bufferMemory.get() + (size_t)id * bufferSize; }
+    // Gives a buffer from a completion back to the kernel.
+    void recycle(uint16_t id);
+
+private:
+    int ringFd = -1;
+
+    void *sqRing = nullptr;
+    size_t sqRingSize = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    // Entries prepared but not yet handed to the kernel.
+    unsigned int toSubmit = 0;
+    unsigned int sqEntries = 0;
+
+    struct io_uring_buf_ring *bufferRing = nullptr;
+    size_t bufferRingSize = 0;
+    unsigned int bufferCount = 0;
+    size_t bufferSize = 0;
+    uint16_t bufferGroup = 0;
+    std::unique_ptr<char[]> bufferMemory;
+};
+
+#endif
@@ -0,0 +1,500 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "uringworker.hpp"
+
+// Received data is copied out of these straight away, so a few hundred
+// is plenty for however many connections there are.
+static const uint16_t bufferGroup = 0;
+static const unsigned int bufferCount = 256;
+static const size_t bufferSize = 4096;
+// How much of a file each linked read and send moves.
+static const size_t fileBufferSize = 64 * 1024;
+// The same limits on what a connection buffers as ServerWorker has.
+static const size_t maxPendingOutput = 1 << 20;
+static const size_t maxReadAhead = 64 * 1024;
+
+static const int idBits = 56;
+
+static uint64_t tag(uint64_t operation, uint64_t id)
+{
+    return (operation << idBits) | id;
+}
+
+UringWorker::UringWorker(WebServer &_server, int _listenSocket)
+    : server(_server), listenSocket(_listenSocket), ring(1024), deadlines(_server.deadlineTick())
+{
+    if (ring.ok())
+    {
+        buffersReady = ring.provideBuffers(bufferGroup, bufferCount, bufferSize);
+    }
+    tickMs = (int)server.deadlineTick().count();
+    tick.tv_sec = tickMs / 1000;
+    tick.tv_nsec = (tickMs % 1000) * 1000000L;
+}
+
+UringWorker::~UringWorker()
+{
+    for (auto &[id, c] : connections)
+    {
+        server.release(c);
+        close(c.socket);
+    }
+}
+
+void UringWorker::run()
+{
+    armAccept();
+    // The stop eventfd only needs to be noticed once.
+    auto sqe = ring.prepare();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server.stopFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(STOP, 0);
+    armTick();
+
+    auto handle = [this](const struct io_uring_cqe &cqe)
+    { completed(cqe); };
+    while (server.pagesLeft > 0 && !stopping)
+    {
+        if (!ring.submit(1))
+            return;
+        ring.completions(handle);
+    }
+
+    // The epoll loop sends each response as soon as it has been made, but
+    // ours may only just have been queued, so we give them a moment to go.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    auto sending = [this]()
+    {
+        return std::any_of(connections.begin(), connections.end(), [](auto &entry)
+                           { return entry.second.sending; });
+    };
+    while (sending() && std::chrono::steady_clock::now() < deadline)
+    {
+        if (!ring.submit(1))
+            return;
+        ring.completions(handle);
+    }
+}
+
+void UringWorker::armAccept()
+{
+    auto sqe = ring.prepare();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag(ACCEPT, 0);
+}
+
+// One recv that keeps going, taking a buffer from the ring each time.
+void UringWorker::armRecv(UringConnection &c)
+{
+    auto sqe = ring.prepare();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c.socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup;
+    sqe->user_data = tag(RECV, c.id);
+    c.inflight++;
+    c.receiving = true;
+}
+
+// A multishot recv reads whatever arrives whether or not we are ready for
+// it, so, as ServerWorker stops reading, we cancel it while dispatch is
+// held back or the connection is closing, or the input is a request's
+// worth ahead of the parser, and leave the rest in the kernel until we
+// ask again.
+void UringWorker::steerRecv(UringConnection &c)
+{
+    if (c.dead)
+        return;
+    bool wanted = c.state != Connection::CLOSING && c.output.pending() < maxPendingOutput &&
+                  c.input.size() < c.parser.length() + maxReadAhead;
+    if (wanted && !c.receiving && !c.peerClosed)
+    {
+        armRecv(c);
+    }
+    else if (!wanted && c.receiving && !c.cancelling)
+    {
+        auto sqe = ring.prepare();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(RECV, c.id);
+        sqe->user_data = tag(CANCEL, c.id);
+        c.inflight++;
+        c.cancelling = true;
+    }
+}
+
+void UringWorker::armTick()
+{
+    auto sqe = ring.prepare();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)&tick;
+    sqe->len = 1;
+    sqe->user_data = tag(TICK, 0);
+}
+
+void UringWorker::completed(const struct io_uring_cqe &cqe)
+{
+    uint64_t operation = cqe.user_data >> idBits;
+    uint64_t id = cqe.user_data & ((1ULL << idBits) - 1);
+    switch (operation)
+    {
+    case ACCEPT:
+        if (cqe.res >= 0)
+        {
+            accepted(cqe.res);
+        }
+        else if (cqe.res != -EAGAIN && cqe.res != -EINTR)
+        {
+            std::cerr << "Accept returned an error, error: " << strerror(-cqe.res) << "\n";
+            server.metrics.add(Metrics::ACCEPT_ERRORS);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            armAccept();
+        return;
+    case STOP:
+        stopping = true;
+        return;
+    case TICK:
+        expireDeadlines();
+        armTick();
+        return;
+    }
+
+    auto found = connections.find(id);
+    if (found == connections.end())
+    {
+        // It has already gone, but any buffer it was given still has to
+        // go back.
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+            ring.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+    UringConnection &c = found->second;
+    switch (operation)
+    {
+    case RECV:
+        received(c, cqe);
+        break;
+    case SEND:
+    case FILE_SEND:
+        c.inflight--;
+        sent(c, cqe.res);
+        break;
+    case FILE_READ:
+        // If this failed, or came up short, the linked send is cancelled
+        // and sent() deals with it.
+        c.inflight--;
+        break;
+    case CANCEL:
+        // The recv itself says when it has stopped.
+        c.inflight--;
+        break;
+    }
+    reap(id);
+}
+
+void UringWorker::accepted(int socket)
+{
+    uint64_t id = nextConnectionId++;
+    UringConnection &c = connections[id];
+    c.socket = socket;
+    c.id = id;
+    c.lastActive = std::chrono::steady_clock::now();
+    c.requestStarted = c.lastActive;
+    c.parser.setMaxBodyBytes(server.maxBodyBytes);
+    if (server.accessLog || server.admission)
+    {
+        // Multishot accept doesn't give us the address.
+        socklen_t length = sizeof(c.peer);
+        getpeername(socket, (struct sockaddr *)&c.peer, &length);
+    }
+    if (!server.admit(c))
+    {
+        close(socket);
+        connections.erase(id);
+        return;
+    }
+    armRecv(c);
+    watch(c);
+}
+
+void UringWorker::received(UringConnection &c, const struct io_uring_cqe &cqe)
+{
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more)
+    {
+        c.inflight--;
+        c.receiving = false;
+        c.cancelling = false;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && !c.dead)
+        {
+            if (c.input.empty())
+                c.requestStarted = std::chrono::steady_clock::now();
+            c.input.append(ring.buffer(buffer), cqe.res);
+            server.metrics.add(Metrics::BYTES_IN, cqe.res);
+        }
+        ring.recycle(buffer);
+    }
+    if (c.dead)
+        return;
+    if (cqe.res > 0)
+    {
+        // As in ServerWorker::readConnection().
+        if (c.output.empty())
+            c.lastActive = std::chrono::steady_clock::now();
+    }
+    else if (cqe.res == 0)
+    {
+        c.peerClosed = true;
+    }
+    // Running out of buffers only lasts a moment, and a cancelled recv is
+    // one we stopped, so either way steerRecv() asks again when it should.
+    else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+    {
+        kill(c);
+        return;
+    }
+    processRequests(c);
+    steerRecv(c);
+}
+
+// The same as ServerWorker::processRequests(), except that nothing is
+// dispatched while a send is in flight, since the kernel is reading the
+// output queue's memory and appending to it could move it.
+void UringWorker::processRequests(UringConnection &c)
+{
+    if (c.sending || c.dead)
+        return;
+    size_t start = 0;
+    while (c.state != Connection::CLOSING && c.output.pending() < maxPendingOutput)
+    {
+        std::string_view input = c.input;
+        auto status = c.parser.parse(input.substr(start));
+        if (status == RequestParser::NEED_MORE)
+        {
+            break;
+        }
+        if (status == RequestParser::MALFORMED)
+        {
+            std::cerr << "Malformed request caught: " << c.parser.error() << "\n";
+            server.metrics.add(Metrics::PARSE_ERRORS);
+            server.pageDone();
+            c.state = Connection::CLOSING;
+            break;
+        }
+        if (status == RequestParser::TOO_MANY_HEADERS)
+        {
+            // There's no request to log, as the view couldn't hold it.
+            server.metrics.add(Metrics::PARSE_ERRORS);
+            server.refuse(c, HTTPResponder::REQUEST_HEADER_FIELDS_TOO_LARGE, "", "", std::chrono::steady_clock::now());
+            break;
+        }
+        const HTTPRequestView &view = c.parser.request();
+        if (status == RequestParser::TOO_LARGE)
+        {
+            server.refuse(c, HTTPResponder::PAYLOAD_TOO_LARGE, view.get_command(), view.get_resource(), std::chrono::steady_clock::now());
+            break;
+        }
+        if (!server.admitRequest(c, view))
+        {
+            break;
+        }
+        c.requests++;
+        bool keepAlive = server.keepConnection(c, view);
+        {
+            auto started = std::chrono::steady_clock::now();
+            size_t before = c.output.pending();
+            c.sentEarly = 0;
+            HTTPRequest request(view, &arena);
+            HTTPResponder response(c.socket, &c.output, &arena);
+            response.headers["Connection"] = keepAlive ? "keep-alive" : "close";
+            response.headOnly = view.get_command() == "HEAD";
+            // Nothing is in flight while we are in here, so a stream can
+            // be written straight to the socket.
+            response.backpressure = [this, &c](OutputQueue &, size_t below)
+            { return server.drainStream(c, below); };
+            server.DispatchResponse(request, response);
+            response.end();
+            size_t after = c.output.pending() + c.sentEarly;
+            server.logAccess(&c, view.get_command(), view.get_resource(), response.sentStatus,
+                             after > before ? after - before : 0, started);
+        }
+        arena.reset();
+        server.pageDone();
+        if (!keepAlive)
+        {
+            c.state = Connection::CLOSING;
+        }
+        start += c.parser.length();
+        c.parser.reset();
+    }
+    c.input.erase(0, start);
+    if (start > 0 && !c.input.empty())
+        c.requestStarted = std::chrono::steady_clock::now();
+    startSend(c);
+    if (!c.dead)
+        watch(c);
+}
+
+void UringWorker::startSend(UringConnection &c)
+{
+    if (c.sending || c.dead)
+        return;
+    if (c.output.empty())
+    {
+        finished(c);
+        return;
+    }
+    int count = c.output.gather(c.vectors, 64);
+    if (count > 0)
+    {
+        c.message = {};
+        c.message.msg_iov = c.vectors;
+        c.message.msg_iovlen = count;
+        auto sqe = ring.prepare();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c.socket;
+        sqe->addr = (uint64_t)&c.message;
+        sqe->len = 1;
+        // The kernel keeps going until it has all gone (or failed).
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = tag(SEND, c.id);
+        c.inflight++;
+        c.sending = true;
+        return;
+    }
+
+    // A file range: read a piece of it into the connection's buffer,
+    // and send that once the read is done.
+    int fd;
+    off_t offset;
+    size_t length;
+    c.output.frontFile(fd, offset, length);
+    if (!c.fileBuffer)
+        c.fileBuffer.reset(new char[fileBufferSize]);
+    c.fileLength = std::min(length, fileBufferSize);
+    ring.reserve(2);
+    auto read = ring.prepare();
+    read->opcode = IORING_OP_READ;
+    read->fd = fd;
+    read->addr = (uint64_t)c.fileBuffer.get();
+    read->len = c.fileLength;
+    read->off = offset;
+    read->flags = IOSQE_IO_LINK;
+    read->user_data = tag(FILE_READ, c.id);
+    auto send = ring.prepare();
+    send->opcode = IORING_OP_SEND;
+    send->fd = c.socket;
+    send->addr = (uint64_t)c.fileBuffer.get();
+    send->len = c.fileLength;
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    send->user_data = tag(FILE_SEND, c.id);
+    c.inflight += 2;
+    c.sending = true;
+}
+
+void UringWorker::sent(UringConnection &c, int result)
+{
+    c.sending = false;
+    if (c.dead)
+        return;
+    if (result < 0)
+    {
+        if (result != -EPIPE && result != -ECONNRESET)
+            std::cerr << "Send error : " << strerror(-result) << "\n";
+        server.metrics.add(Metrics::SEND_ERRORS);
+        kill(c);
+        return;
+    }
+    server.metrics.add(Metrics::BYTES_OUT, result);
+    c.output.advance(result);
+    c.lastActive = std::chrono::steady_clock::now();
+    // Carry on with anything that came in meanwhile, which also sends
+    // the rest of the output.
+    processRequests(c);
+    steerRecv(c);
+}
+
+// Everything has been sent, so see whether the connection is done.
+void UringWorker::finished(UringConnection &c)
+{
+    if (c.peerClosed && c.state != Connection::CLOSING && !c.input.empty())
+    {
+        // They hung up in the middle of a request, so it will never
+        // be complete.
+        std::cerr << "Malformed request caught\n";
+        server.metrics.add(Metrics::PARSE_ERRORS);
+        server.pageDone();
+    }
+    if (c.state == Connection::CLOSING || c.peerClosed)
+    {
+        kill(c);
+    }
+}
+
+// The kernel may still have operations on the socket, so we shut it down
+// (which makes them finish) and only free the connection in reap() once
+// they have all come back.
+void UringWorker::kill(UringConnection &c)
+{
+    if (c.dead)
+        return;
+    c.dead = true;
+    shutdown(c.socket, SHUT_RDWR);
+}
+
+void UringWorker::reap(uint64_t id)
+{
+    auto found = connections.find(id);
+    if (found != connections.end() && found->second.dead && found->second.inflight == 0)
+    {
+        server.release(found->second);
+        close(found->second.socket);
+        connections.erase(found);
+    }
+}
+
+// See ServerWorker::watch().
+void UringWorker::watch(UringConnection &c)
+{
+    auto due = server.deadline(c);
+    if (due < c.timerDue)
+    {
+        deadlines.schedule(due, Deadline{c.id, due});
+        c.timerDue = due;
+    }
+}
+
+void UringWorker::expireDeadlines()
+{
+    auto now = std::chrono::steady_clock::now();
+    deadlines.expire(now, [this, now](const Deadline &d)
+                     {
+        auto found = connections.find(d.connection);
+        if (found == connections.end() || found->second.dead || found->second.timerDue != d.due)
+            return;
+        UringConnection &c = found->second;
+        c.timerDue = std::chrono::steady_clock::time_point::max();
+        if (server.deadline(c) > now)
+        {
+            watch(c);
+            return;
+        }
+        if (!c.input.empty())
+            server.metrics.add(Metrics::TIMEOUTS);
+        kill(c);
+        reap(d.connection); });
+}
@@ -0,0 +1,108 @@
+#ifndef _URING_WORKER_H
+#define _URING_WORKER_H
+
+#include <unordered_map>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "webserver.hpp"
+#include "uring.hpp"
+
+// The io_uring counterpart of ServerWorker.  Instead of being told a
+// socket is ready and then making the system call itself, it queues the
+// accept, recv and send operations up front and the kernel tells it when
+// they are done, so a busy worker makes one io_uring_enter() per batch
+// rather than a call per operation:
+//
+// - one multishot accept on the listening socket produces every new
+//   connection,
+// - each connection has one multishot recv, which reads into buffers the
+//   kernel takes from a shared ring (so idle connections hold none),
+// - responses go out with sendmsg, and file ranges with a read into the
+//   connection's file buffer linked to a send from it.
+//
+// It handles the same requests as ServerWorker, with the same keep-alive
+// rules, but only ordinary handlers.
+class UringWorker
+{
+public:
+    UringWorker(WebServer &_server, int _listenSocket);
+    ~UringWorker();
+
+    // False if the ring couldn't be set up.
+    bool ok() const { return ring.ok() && buffersReady; }
+
+    void run();
+
+private:
+    struct UringConnection : Connection
+    {
+        // How many of our operations on it the kernel still has, and
+        // whether we are waiting for them so we can free it.
+        unsigned int inflight = 0;
+        bool dead = false;
+        bool sending = false;
+        // Whether its recv is still going, and whether we have asked for
+        // it to stop, see steerRecv().
+        bool receiving = false;
+        bool cancelling = false;
+        struct iovec vectors[64];
+        struct msghdr message = {};
+        std::unique_ptr<char[]> fileBuffer;
+        size_t fileLength = 0;
+    };
+
+    // What a completion is for goes in the top byte of its user_data,
+    // and the connection id in the rest.
+    enum Operation : uint64_t
+    {
+        ACCEPT = 1,
+        RECV,
+        SEND,
+        FILE_READ,
+        FILE_SEND,
+        STOP,
+        TICK,
+        CANCEL
+    };
+
+    WebServer &server;
+    int listenSocket;
+    Arena arena;
+    std::unordered_map<uint64_t, UringConnection> connections;
+    uint64_t nextConnectionId = 1;
+    // This comes after the connections so it is destroyed (which cancels
+    // everything in flight) before they are.
+    IoUring ring;
+    bool buffersReady = false;
+    bool stopping = false;
+    int tickMs;
+    struct __kernel_timespec tick = {};
+
+    // The same deadlines as ServerWorker keeps, looked at every tick.
+    struct Deadline
+    {
+        uint64_t connection;
+        std::chrono::steady_clock::time_point due;
+    };
+    TimerWheel<Deadline> deadlines;
+
+    void completed(const struct io_uring_cqe &cqe);
+    void armAccept();
+    void armRecv(UringConnection &c);
+    void armTick();
+    void accepted(int socket);
+    void received(UringConnection &c, const struct io_uring_cqe &cqe);
+    void processRequests(UringConnection &c);
+    void steerRecv(UringConnection &c);
+    void startSend(UringConnection &c);
+    void sent(UringConnection &c, int result);
+    void finished(UringConnection &c);
+    void kill(UringConnection &c);
+    void watch(UringConnection &c);
+    void expireDeadlines();
+    void reap(uint64_t id);
+};
+
+#endif
@@ -1,10 +1,22 @@
 #include "webserver.hpp"
 #include <unistd.h>
 #include "httprequest.hpp"
+#include "uringworker.hpp"
+#include "bundle.hpp"
 #include <sstream>
 #include <fstream>
 #include <filesystem>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <time.h>
+#include <strings.h>
+#include <poll.h>
+#include <condition_variable>
 
 unsigned int abort_port = 0;
 
@@ -22,220 +34,1732 @@ void clean_close(int s)
     exit(1);
 }
 
-// You don't need to modify this function.
+// Once this much output is waiting on a connection we stop dispatching
+// its requests (and reading them) until the client catches up.
+static const size_t maxPendingOutput = 1 << 20;
+// How far ahead of the parser we read, see ServerWorker::wantsInput().
+static const size_t maxReadAhead = 64 * 1024;
+
+// This opens one listening socket on the port.  SO_REUSEPORT lets
+// every worker bind its own socket to the same port, and the kernel
+// then load-balances new connections between them.
+static int openListenSocket(struct sockaddr_in &serverAddress, int backlog)
+{
+    // This creates a "socket" (a File descriptor type object)
+    // that is used to listen to connections.
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    // Allow a restarted server to bind again right away rather than
+    // waiting out TIME_WAIT on connections the last one closed.
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+    if (bind(serverSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)))
+    {
+        std::cerr << "Bind returned an error, error: " << strerror(errno) << "\n";
+        exit(-1);
+    }
+    if (listen(serverSocket, backlog))
+    {
+        std::cerr << "Listen returned an error, error: " << strerror(errno) << "\n";
+        exit(-1);
+    }
+    // The event loop accepts until EAGAIN, so the listening socket
+    // has to be non-blocking too.
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+    return serverSocket;
+}
+
 // This constructor starts up the web server, listening on
-// the indicated port.  However, you do need to
-// understand this function, as it may inspire items on the
-// test.
-WebServer::WebServer(unsigned int _port) : port(_port)
+// the indicated port with one socket per worker.
+WebServer::WebServer(unsigned int _port, unsigned int _workers) : port(_port), workers(_workers == 0 ? 1 : _workers)
+{
+    RegisterHandler("/metrics", [this](HTTPRequest &r, HTTPResponder &resp)
+                    {
+        (void)r;
+        std::string body = metrics.prometheus();
+        if (accessLog)
+        {
+            body += "# HELP webserver_access_log_dropped_total Access log records dropped because a buffer was full.\n"
+                    "# TYPE webserver_access_log_dropped_total counter\n"
+                    "webserver_access_log_dropped_total " + std::to_string(accessLog->dropped()) + "\n";
+        }
+        resp.headers["Content-Type"] = "text/plain; version=0.0.4";
+        resp.sendResponse(body); });
+    if (port == 0)
+    {
+        // Port should never be 0, but testing code may override
+        // other functions for testing purposes so we want to
+        // be able to make dummies.
+        return;
+    }
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+    for (unsigned int i = 0; i < workers; ++i)
+    {
+        serverSockets.push_back(openListenSocket(serverAddress, listenBacklog));
+    }
+    std::cerr << "Listening For Connection\n";
+    stopFd = eventfd(0, EFD_NONBLOCK);
+    abort_port = serverSockets[0];
+    // Register a signal handler so we close the socket cleanly
+    // on control-C and a couple other cases
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = clean_close;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+
+    sigaction(SIGINT, &sigIntHandler, NULL);
+    sigaction(SIGHUP, &sigIntHandler, NULL);
+    sigaction(SIGTERM, &sigIntHandler, NULL);
+}
+
+WebServer::~WebServer()
+{
+    std::cerr << "Shutting down webserver\n";
+    if (port != 0)
+    {
+        for (auto s : serverSockets)
+        {
+            close(s);
+        }
+        close(stopFd);
+    }
+}
+
+// A limit for testing, can set it to only serve a few pages and quit.
+// This is important for e.g. valgrind checking, as valgrind will have
+// an opportunity to formally check things only if the program quits normally
+// rather than being killed with control-C.
+
+// With a single worker the loop runs right here on the calling thread,
+// otherwise we start a thread per worker and wait for them all.
+void WebServer::serve(uint64_t pages)
+{
+    if (port == 0)
+    {
+        std::cerr << "Not actually running a server, this should not happen\n";
+        exit(-1);
+    }
+    pagesLeft = pages;
+    // The stop eventfd may still be signalled from a previous serve().
+    uint64_t drain;
+    while (read(stopFd, &drain, sizeof(drain)) > 0)
+        ;
+    if (!asyncHandlers.empty() || !coroutineHandlers.empty())
+    {
+        handlerPool = std::make_unique<ThreadPool>(handlerThreads, maxQueuedHandlers);
+    }
+    if (!accessLogOptions.path.empty())
+    {
+        accessLog = std::make_unique<AccessLog>(accessLogOptions);
+        if (!accessLog->ok())
+            accessLog.reset();
+    }
+    if (admissionOptions.maxConnections > 0 || admissionOptions.maxConnectionsPerPeer > 0 ||
+        admissionOptions.requestsPerSecond > 0)
+    {
+        admission = std::make_unique<Admission>(admissionOptions);
+    }
+    // The sockets were opened with whatever the backlog was then, and
+    // listening again is how it is changed.
+    for (auto s : serverSockets)
+    {
+        listen(s, listenBacklog);
+    }
+
+    bool uring = false;
+    if (backend == IO_URING)
+    {
+        uring = IoUring::supported() && asyncHandlers.empty() && coroutineHandlers.empty() && bodyHandlers.empty();
+        if (!uring)
+        {
+            std::cerr << "The io_uring backend can't be used here, falling back to epoll\n";
+        }
+    }
+    auto runWorker = [this, uring](int s)
+    {
+        if (uring)
+        {
+            UringWorker worker(*this, s);
+            if (worker.ok())
+            {
+                worker.run();
+                return;
+            }
+        }
+        ServerWorker worker(*this, s);
+        worker.run();
+    };
+
+    if (workers == 1)
+    {
+        runWorker(serverSockets[0]);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (auto s : serverSockets)
+        {
+            threads.emplace_back(runWorker, s);
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+    }
+    // This waits for any handlers still running.  Their responses
+    // have nowhere to go now, so they are just dropped.
+    handlerPool.reset();
+    // And this writes out whatever is left of the log.
+    accessLog.reset();
+    admission.reset();
+}
+
+// This is for handlers running on the worker's own thread, which nothing
+// else can happen on until they return, so we write to the socket right
+// here, waiting on it with poll().  A client that takes nothing for the
+// idle timeout is given up on: its output is thrown away and it is closed
+// once the handler has finished.
+bool WebServer::drainStream(Connection &c, size_t below)
+{
+    // The io_uring worker's sockets block, and we need to be able to stop.
+    int flags = fcntl(c.socket, F_GETFL);
+    bool blocking = flags != -1 && !(flags & O_NONBLOCK);
+    if (blocking)
+        fcntl(c.socket, F_SETFL, flags | O_NONBLOCK);
+    bool ok = true;
+    while (ok && c.output.pending() > below)
+    {
+        size_t before = c.output.pending();
+        auto result = c.output.write(c.socket);
+        size_t sent = before - c.output.pending();
+        metrics.add(Metrics::BYTES_OUT, sent);
+        c.sentEarly += sent;
+        if (sent > 0)
+            c.lastActive = std::chrono::steady_clock::now();
+        if (result == OutputQueue::ERROR)
+        {
+            metrics.add(Metrics::SEND_ERRORS);
+            ok = false;
+        }
+        else if (result == OutputQueue::AGAIN)
+        {
+            struct pollfd p = {c.socket, POLLOUT, 0};
+            int ready = poll(&p, 1, idleTimeoutMs > 0 ? (int)idleTimeoutMs : -1);
+            if (ready == 0 || (ready == -1 && errno != EINTR))
+                ok = false;
+        }
+    }
+    if (blocking)
+        fcntl(c.socket, F_SETFL, flags);
+    if (!ok)
+    {
+        c.output.advance(c.output.pending());
+        c.state = Connection::CLOSING;
+    }
+    return ok;
+}
+
+// "c" is nullptr if the connection has already gone.
+void WebServer::logAccess(const Connection *c, std::string_view method, std::string_view resource, int status,
+                          uint64_t bytes, std::chrono::steady_clock::time_point started)
+{
+    if (!accessLog)
+        return;
+    static const struct sockaddr_in nobody = {};
+    accessLog->log(method, resource, status, bytes, std::chrono::steady_clock::now() - started,
+                   c != nullptr ? c->peer : nobody);
+}
+
+// Either we don't know where this request's body ends (or don't want to
+// read that far to find out), or it has more headers than we keep, so
+// nothing after it can be parsed, or the client is making too many
+// requests, so we don't want to parse them.
+void WebServer::refuse(Connection &c, int status, std::string_view method, std::string_view resource,
+                       std::chrono::steady_clock::time_point started)
+{
+    static std::string tooLarge = "<HTML><HEAD><TITLE>Payload Too Large</TITLE><BODY><H3>Request body too large.</H3></BODY></HTML>";
+    static std::string tooMany = "<HTML><HEAD><TITLE>Too Many Requests</TITLE><BODY><H3>Slow down, try again later.</H3></BODY></HTML>";
+    static std::string tooManyHeaders = "<HTML><HEAD><TITLE>Request Header Fields Too Large</TITLE><BODY><H3>Too many request headers.</H3></BODY></HTML>";
+    size_t before = c.output.pending();
+    {
+        HTTPResponder response(c.socket, &c.output);
+        response.headers["Connection"] = "close";
+        response.headOnly = method == "HEAD";
+        if (status == HTTPResponder::TOO_MANY_REQUESTS)
+        {
+            response.headers["Retry-After"] = "1";
+            response.sendResponse(tooMany, status);
+        }
+        else if (status == HTTPResponder::REQUEST_HEADER_FIELDS_TOO_LARGE)
+        {
+            response.sendResponse(tooManyHeaders, status);
+        }
+        else
+        {
+            response.sendResponse(tooLarge, status);
+        }
+    }
+    metrics.responded(status);
+    logAccess(&c, method, resource, status, c.output.pending() - before, started);
+    pageDone();
+    c.state = Connection::CLOSING;
+}
+
+// A connection that is turned away gets a canned response, from one
+// non-blocking send() straight after the accept, so it costs next to
+// nothing.  If the socket won't take that it just gets closed.
+bool WebServer::admit(Connection &c)
+{
+    if (!admission)
+        return true;
+    auto verdict = admission->connect(c.peer.sin_addr.s_addr);
+    if (verdict == Admission::ADMIT)
+    {
+        c.admitted = true;
+        return true;
+    }
+    static const std::string_view busy = "HTTP/1.1 503 \r\nConnection: close\r\nRetry-After: 1\r\n"
+                                         "Content-Length: 0\r\n\r\n";
+    static const std::string_view tooMany = "HTTP/1.1 429 \r\nConnection: close\r\nRetry-After: 1\r\n"
+                                            "Content-Length: 0\r\n\r\n";
+    int status = verdict == Admission::FULL ? HTTPResponder::UNAVAILABLE : HTTPResponder::TOO_MANY_REQUESTS;
+    auto response = verdict == Admission::FULL ? busy : tooMany;
+    auto sent = send(c.socket, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    metrics.add(Metrics::SHED);
+    metrics.responded(status);
+    logAccess(&c, "", "", status, sent > 0 ? sent : 0, std::chrono::steady_clock::now());
+    pageDone();
+    return false;
+}
+
+bool WebServer::admitRequest(Connection &c, const HTTPRequestView &view)
+{
+    if (!admission || admission->request(c.peer.sin_addr.s_addr))
+        return true;
+    metrics.add(Metrics::SHED);
+    refuse(c, HTTPResponder::TOO_MANY_REQUESTS, view.get_command(), view.get_resource(),
+           std::chrono::steady_clock::now());
+    return false;
+}
+
+void WebServer::release(Connection &c)
+{
+    if (c.admitted && admission)
+        admission->disconnect(c.peer.sin_addr.s_addr);
+    c.admitted = false;
+}
+
+// Takes one page off the shared budget.  Whoever takes the last one
+// signals the stop eventfd, which every worker is watching.
+void WebServer::pageDone()
+{
+    uint64_t left = pagesLeft.load();
+    while (left > 0 && !pagesLeft.compare_exchange_weak(left, left - 1))
+        ;
+    if (left == 1)
+    {
+        uint64_t one = 1;
+        if (write(stopFd, &one, sizeof(one)) == -1)
+        {
+            std::cerr << "Stop signal error: " << strerror(errno) << "\n";
+        }
+    }
+}
+
+void WebServer::stop()
+{
+    pagesLeft = 0;
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) == -1)
+    {
+        std::cerr << "Stop signal error: " << strerror(errno) << "\n";
+    }
+}
+
+// A request that has been sent off to the handler pool.  It carries its
+// own copy of the request, since the connection's input buffer moves on
+// without it, and its own queue to put the response in.
+struct HandlerJob
+{
+    int socket;
+    uint64_t connection;
+    bool keepAlive;
+    HTTPRequest request;
+    OutputQueue output;
+    // For the access log.
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    int status = 0;
+    uint64_t bytes = 0;
+
+    // While an async handler's stream waits for the client, see streamOut().
+    std::mutex streamLock;
+    std::condition_variable streamWake;
+    bool streamWaiting = false;
+    bool streamGone = false;
+
+    HandlerJob(const HTTPRequestView &view, int _socket, uint64_t _connection, bool _keepAlive)
+        : socket(_socket), connection(_connection), keepAlive(_keepAlive), request(view)
+    {
+        // Building the header map now copies everything out of the view.
+        request.get_headers();
+    }
+};
+
+// A coroutine handler in progress.  The responder it was given writes to
+// the job's own queue, and whatever it has written is moved over to the
+// connection every time it stops to wait.
+struct CoroutineJob : HandlerJob
+{
+    HTTPResponder responder;
+    HandlerTask::Handle handle;
+    // For the metrics, since it doesn't go through DispatchResponse().
+    size_t route = Metrics::NO_ROUTE;
+
+    CoroutineJob(const HTTPRequestView &view, int _socket, uint64_t _connection, bool _keepAlive)
+        : HandlerJob(view, _socket, _connection, _keepAlive), responder(_socket, &output)
+    {
+        responder.headers["Connection"] = keepAlive ? "keep-alive" : "close";
+        responder.headOnly = view.get_command() == "HEAD";
+    }
+    ~CoroutineJob()
+    {
+        if (handle)
+            handle.destroy();
+    }
+};
+
+// A request whose body is going to a body handler's sink as it arrives.
+// Like a HandlerJob it has its own copy of the request, since the input
+// buffer moves on (and is emptied) as the body goes through it.
+struct BodyUpload
+{
+    HTTPRequest request;
+    BodyReader reader;
+    std::unique_ptr<BodySink> sink;
+    bool keepAlive;
+    size_t route = Metrics::NO_ROUTE;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    BodyUpload(const HTTPRequestView &view, const BodyReader &_reader, bool _keepAlive)
+        : request(view), reader(_reader), keepAlive(_keepAlive)
+    {
+        request.get_headers();
+    }
+};
+
+// Work done on the handler pool that has to be carried on in the event
+// loop, such as sending the response of an async handler.  The worker
+// runs each of these when it is woken through the eventfd.  The pool
+// holds on to this too, so it stays valid even if the worker has already
+// gone (in which case nothing in it is ever run).
+struct HandlerCompletions
+{
+    int eventFd;
+    std::mutex lock;
+    std::vector<std::function<void()>> done;
+
+    HandlerCompletions() : eventFd(eventfd(0, EFD_NONBLOCK)) {}
+    ~HandlerCompletions() { close(eventFd); }
+
+    void post(std::function<void()> then)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.push_back(std::move(then));
+        }
+        uint64_t one = 1;
+        if (write(eventFd, &one, sizeof(one)) == -1)
+        {
+            std::cerr << "Handler completion error: " << strerror(errno) << "\n";
+        }
+    }
+};
+
+// While a request is coming in it has the header or body deadline, and
+// at any other time (including while the client is taking a response)
+// the idle timeout, which can also cut a request short that has stopped
+// altogether.  Handlers can take as long as they like.
+//
+// While output is waiting, the idle timeout runs from when the client
+// last took some of it, so one that keeps sending but never reads still
+// times out.
+std::chrono::steady_clock::time_point WebServer::deadline(const Connection &c) const
+{
+    auto never = std::chrono::steady_clock::time_point::max();
+    if (c.awaitingHandler)
+        return never;
+    auto idle = idleTimeoutMs > 0 ? c.lastActive + std::chrono::milliseconds(idleTimeoutMs) : never;
+    if (!c.output.empty() || (c.input.empty() && !c.upload))
+        return idle;
+    if (c.upload || c.parser.readingBody())
+    {
+        if (bodyTimeoutMs == 0)
+            return idle;
+        auto started = c.upload ? c.upload->started : c.requestStarted;
+        size_t received = c.upload ? c.upload->reader.received() : c.parser.bodyReader().received();
+        auto allowed = std::chrono::milliseconds(bodyTimeoutMs);
+        if (minBodyRate > 0)
+            allowed += std::chrono::milliseconds(received / minBodyRate * 1000);
+        return std::min(idle, started + allowed);
+    }
+    if (headerTimeoutMs == 0)
+        return idle;
+    return std::min(idle, c.requestStarted + std::chrono::milliseconds(headerTimeoutMs));
+}
+
+// Deadlines are met to within a tick, so a tick is a small part of the
+// shortest timeout.
+std::chrono::milliseconds WebServer::deadlineTick() const
+{
+    unsigned int shortest = 4000;
+    for (auto timeout : {idleTimeoutMs, headerTimeoutMs, bodyTimeoutMs})
+    {
+        if (timeout > 0)
+            shortest = std::min(shortest, timeout);
+    }
+    return std::chrono::milliseconds(std::clamp((int)shortest / 4, 10, 1000));
+}
+
+ServerWorker::ServerWorker(WebServer &_server, int _listenSocket)
+    : server(_server), listenSocket(_listenSocket), completions(std::make_shared<HandlerCompletions>()),
+      deadlines(_server.deadlineTick())
+{
+    epollFd = epoll_create1(0);
+    if (epollFd == -1)
+    {
+        std::cerr << "Epoll create returned an error, error: " << strerror(errno) << "\n";
+        exit(-1);
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listenSocket;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &ev);
+
+    // This one is level-triggered and never read here, so once it is
+    // signalled every worker keeps waking up until it notices.
+    ev.events = EPOLLIN;
+    ev.data.fd = server.stopFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, server.stopFd, &ev);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = completions->eventFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, completions->eventFd, &ev);
+}
+
+ServerWorker::~ServerWorker()
+{
+    // Coroutines still waiting for something are abandoned.
+    timers.clear();
+    fdWaiters.clear();
+    coroutines.clear();
+
+    // Anything still open when we hit the page limit is simply dropped.
+    while (!connections.empty())
+    {
+        auto &c = connections.begin()->second;
+        if (c.streamWaiter)
+            releaseStream(c, true);
+        server.release(c);
+        int fd = c.socket;
+        close(fd);
+        connections.erase(fd);
+    }
+    close(epollFd);
+}
+
+// Rather than accepting a connection and serving it to completion before
+// looking at the next one, this hands every socket to epoll in
+// edge-triggered mode and reacts to whichever ones are ready.  Each
+// connection carries its own little state machine (see Connection), so
+// thousands of them can be in progress on this one thread.
+void ServerWorker::run()
+{
+    const int maxEvents = 256;
+    struct epoll_event events[maxEvents];
+
+    while (server.pagesLeft > 0)
+    {
+        // We have to be back in time for the first coroutine timer, and
+        // for the next tick of the deadlines if any are set.
+        auto wakeAt = std::chrono::steady_clock::time_point::max();
+        if (!timers.empty())
+            wakeAt = timers.begin()->first;
+        if (!deadlines.empty())
+            wakeAt = std::min(wakeAt, deadlines.nextTick());
+        int timeout = -1;
+        if (wakeAt != std::chrono::steady_clock::time_point::max())
+        {
+            auto until = wakeAt - std::chrono::steady_clock::now();
+            timeout = std::max(0, (int)std::chrono::ceil<std::chrono::milliseconds>(until).count());
+        }
+        int count = epoll_wait(epollFd, events, maxEvents, timeout);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Epoll wait returned an error, error: " << strerror(errno) << "\n";
+            break;
+        }
+        for (int i = 0; i < count && server.pagesLeft > 0; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listenSocket)
+            {
+                acceptConnections();
+                continue;
+            }
+            if (fd == completions->eventFd)
+            {
+                handlersFinished();
+                continue;
+            }
+            auto waiter = fdWaiters.find(fd);
+            if (waiter != fdWaiters.end())
+            {
+                auto [job, seen] = waiter->second;
+                *seen = events[i].events;
+                fdWaiters.erase(waiter);
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                wake(job);
+                continue;
+            }
+            auto found = connections.find(fd);
+            if (found == connections.end())
+                continue;
+            Connection &c = found->second;
+            // A hangup or error still goes through the read path so we see
+            // any data that arrived first and then notice the close.
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                if (!readConnection(c))
+                    continue;
+            }
+            pump(c);
+        }
+        fireTimers();
+        expireDeadlines();
+    }
+}
+
+// Because the listening socket is edge-triggered we have to keep
+// accepting until the kernel tells us there is nobody left waiting.
+void ServerWorker::acceptConnections()
+{
+    while (true)
+    {
+        struct sockaddr_in peer = {};
+        socklen_t peerLength = sizeof(peer);
+        int clientSocket = accept4(listenSocket, (struct sockaddr *)&peer, &peerLength, SOCK_NONBLOCK);
+        if (clientSocket == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                std::cerr << "Accept returned an error, error: " << strerror(errno) << "\n";
+                server.metrics.add(Metrics::ACCEPT_ERRORS);
+            }
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        Connection &c = connections[clientSocket];
+        c.socket = clientSocket;
+        c.id = nextConnectionId++;
+        c.lastActive = std::chrono::steady_clock::now();
+        c.requestStarted = c.lastActive;
+        c.peer = peer;
+        if (!server.admit(c))
+        {
+            close(clientSocket);
+            connections.erase(clientSocket);
+            continue;
+        }
+        c.parser.setMaxBodyBytes(server.maxBodyBytes);
+        // Body handlers need to see requests before their bodies are in.
+        c.parser.pauseAfterHeaders = !server.bodyHandlers.empty();
+
+        // We register for both directions once, up front.  With
+        // edge triggering we only hear about changes, so there is no
+        // cost to leaving EPOLLOUT on while we are still reading.
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &ev) == -1)
+        {
+            std::cerr << "Epoll add returned an error, error: " << strerror(errno) << "\n";
+            closeConnection(c);
+            continue;
+        }
+        watch(c);
+    }
+}
+
+// This reads what is currently available onto the end of the
+// connection's input.  Parsing it is left to processRequests.
+//
+// We only read what we are ready to do something with.  While dispatch is
+// held back behind a full output queue, or waiting on a handler, or the
+// connection is closing, anything more the client sends stays in the
+// kernel, so once the socket buffers fill TCP makes the client wait
+// rather than us buffering it all.  Nor do we read more than a request's
+// worth ahead of the parser.  Either way the connection is marked
+// "unread", and pump() comes back for the rest when it can: with edge
+// triggering we won't hear about it again otherwise.
+bool ServerWorker::readConnection(Connection &c)
+{
+    const size_t buflen = 4096;
+    char buffer[buflen];
+    c.unread = false;
+    while (true)
+    {
+        if (!wantsInput(c))
+        {
+            c.unread = true;
+            break;
+        }
+        auto result = recv(c.socket, buffer, buflen, 0);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            std::cerr << "Socket error: " << strerror(errno) << "\n";
+            closeConnection(c);
+            return false;
+        }
+        // Returns 0 if the other side is done sending, so break out...
+        if (result == 0)
+        {
+            c.peerClosed = true;
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        // While there is output waiting only the client taking it counts,
+        // see WebServer::deadline().
+        if (c.output.empty())
+            c.lastActive = now;
+        if (c.input.empty() && !c.upload)
+            c.requestStarted = now;
+        c.input.append(buffer, result);
+        server.metrics.add(Metrics::BYTES_IN, result);
+    }
+    return true;
+}
+
+// Whether readConnection() should take any more input right now.  The
+// parser has already looked at everything up to its length(), which is
+// at most the header limit plus the body it is reading, and we allow one
+// request's headers' worth beyond that (anything larger is refused anyway).
+bool ServerWorker::wantsInput(const Connection &c) const
+{
+    if (c.state == Connection::CLOSING || c.awaitingHandler || c.output.pending() >= maxPendingOutput)
+        return false;
+    return c.input.size() < c.parser.length() + maxReadAhead;
+}
+
+// Does a Connection header value contain the "close" token?
+static bool wantsClose(const HTTPRequestView &view)
+{
+    auto header = view.find_header("connection");
+    if (header == nullptr)
+    {
+        return false;
+    }
+    const std::string_view close = "close";
+    auto found = std::search(header->value.begin(), header->value.end(), close.begin(), close.end(),
+                             [](char a, char b)
+                             { return tolower(a) == b; });
+    return found != header->value.end();
+}
+
+// Whether the connection stays open for more requests after this one.
+bool WebServer::keepConnection(const Connection &c, const HTTPRequestView &view) const
+{
+    return idleTimeoutMs > 0 && c.requests < maxRequestsPerConnection && !wantsClose(view);
+}
+
+// Dispatches every complete request sitting in the input buffer, in order,
+// so pipelined requests get their responses queued back to back.  It stops
+// early if too much output is already waiting, and returns true in that
+// case so the caller knows to come back once the output has drained.
+bool ServerWorker::processRequests(Connection &c)
+{
+    size_t start = 0;
+    bool heldBack = false;
+    while (c.state != Connection::CLOSING && !c.awaitingHandler)
+    {
+        if (c.output.pending() >= maxPendingOutput)
+        {
+            heldBack = true;
+            break;
+        }
+        if (c.upload)
+        {
+            if (!feedUpload(c, start))
+                break;
+            continue;
+        }
+        // The parser remembers how far it got through the request at
+        // "start", so each byte is only looked at once however it arrives.
+        std::string_view input = c.input;
+        auto status = c.parser.parse(input.substr(start));
+        if (status == RequestParser::NEED_MORE)
+        {
+            break;
+        }
+        if (status == RequestParser::MALFORMED)
+        {
+            std::cerr << "Malformed request caught: " << c.parser.error() << "\n";
+            server.metrics.add(Metrics::PARSE_ERRORS);
+            server.pageDone();
+            c.state = Connection::CLOSING;
+            break;
+        }
+        if (status == RequestParser::TOO_MANY_HEADERS)
+        {
+            // There's no request to log, as the view couldn't hold it.
+            server.metrics.add(Metrics::PARSE_ERRORS);
+            server.refuse(c, HTTPResponder::REQUEST_HEADER_FIELDS_TOO_LARGE, "", "", std::chrono::steady_clock::now());
+            break;
+        }
+        // The HTTPRequest handed to the handler borrows from the
+        // parser's view, which points into the input buffer.
+        const HTTPRequestView &view = c.parser.request();
+        if (status == RequestParser::TOO_LARGE)
+        {
+            server.refuse(c, HTTPResponder::PAYLOAD_TOO_LARGE, view.get_command(), view.get_resource(), std::chrono::steady_clock::now());
+            break;
+        }
+        auto body = status == RequestParser::HEADERS_DONE ? server.bodyHandlerFor(view.get_resource()) : nullptr;
+        if (status == RequestParser::HEADERS_DONE && body == nullptr)
+        {
+            // Not one for a body handler, so the body is read in as usual.
+            continue;
+        }
+        if (!server.admitRequest(c, view))
+        {
+            break;
+        }
+        c.requests++;
+        bool keepAlive = server.keepConnection(c, view);
+        if (body != nullptr)
+        {
+            // Everything after the headers goes to feedUpload().
+            startUpload(c, view, keepAlive, *body);
+            start += c.parser.length();
+            c.parser.reset();
+            continue;
+        }
+        auto coroutine = server.coroutineFor(view.get_resource());
+        if (coroutine != nullptr)
+        {
+            // This only returns once the handler first stops to wait, or
+            // has finished.  In the meantime the connection is awaitingHandler.
+            startCoroutine(c, view, keepAlive, *coroutine);
+            start += c.parser.length();
+            c.parser.reset();
+            continue;
+        }
+        bool async = server.handlerPool != nullptr && server.runsOnPool(view.get_resource());
+        if (async && handOff(c, view, keepAlive))
+        {
+            // Everything else waits until its response is back.
+            c.awaitingHandler = true;
+            start += c.parser.length();
+            c.parser.reset();
+            break;
+        }
+        {
+            auto started = std::chrono::steady_clock::now();
+            size_t before = c.output.pending();
+            c.sentEarly = 0;
+            HTTPRequest request(view, &arena);
+            HTTPResponder response(c.socket, &c.output, &arena);
+            response.headers["Connection"] = keepAlive ? "keep-alive" : "close";
+            response.headOnly = view.get_command() == "HEAD";
+            response.backpressure = [this, &c](OutputQueue &, size_t below)
+            { return server.drainStream(c, below); };
+            if (async)
+            {
+                // The pool is already full, so rather than let the backlog
+                // (and everybody's wait) keep growing we turn this one away.
+                respondUnavailable(request, response);
+                server.metrics.responded(response.sentStatus);
+            }
+            else
+            {
+                server.DispatchResponse(request, response);
+            }
+            response.end();
+            size_t after = c.output.pending() + c.sentEarly;
+            server.logAccess(&c, view.get_command(), view.get_resource(), response.sentStatus,
+                             after > before ? after - before : 0, started);
+        }
+        // The response has been copied into the output queue, so
+        // nothing from the arena is in use any more.
+        arena.reset();
+        server.pageDone();
+        if (!keepAlive)
+        {
+            c.state = Connection::CLOSING;
+        }
+        start += c.parser.length();
+        c.parser.reset();
+    }
+    c.input.erase(0, start);
+    if (start > 0 && !c.input.empty() && !c.upload)
+    {
+        // The next request's clock starts now.
+        c.requestStarted = std::chrono::steady_clock::now();
+    }
+    return heldBack;
+}
+
+// Sends a request off to the handler pool.  Returns false if the pool
+// is full.
+bool ServerWorker::handOff(Connection &c, const HTTPRequestView &view, bool keepAlive)
+{
+    auto job = std::make_shared<HandlerJob>(view, c.socket, c.id, keepAlive);
+    auto done = completions;
+    WebServer &webServer = server;
+    ServerWorker *worker = this;
+    return server.handlerPool->trySubmit([job, done, &webServer, worker]()
+                                         {
+        HTTPResponder response(job->socket, &job->output);
+        response.headers["Connection"] = job->keepAlive ? "keep-alive" : "close";
+        response.headOnly = job->request.get_command_view() == "HEAD";
+        response.backpressure = [job, done, worker, &webServer](OutputQueue &, size_t below)
+        {
+            // The event loop takes what we have so far, and lets us go on
+            // once the client has taken enough of it.  If that doesn't
+            // happen within the idle timeout (or the worker has gone)
+            // the client is given up on.
+            std::unique_lock<std::mutex> lock(job->streamLock);
+            job->streamWaiting = true;
+            done->post([job, worker, below]()
+                       { worker->streamOut(job, below); });
+            auto patience = std::chrono::milliseconds(webServer.idleTimeoutMs > 0 ? webServer.idleTimeoutMs : 5000);
+            if (!job->streamWake.wait_for(lock, patience, [&job]() { return !job->streamWaiting; }))
+            {
+                job->streamWaiting = false;
+                job->streamGone = true;
+            }
+            return !job->streamGone;
+        };
+        webServer.DispatchResponse(job->request, response);
+        response.end();
+        job->status = response.sentStatus;
+        done->post([job, worker]()
+                   { worker->finishJob(*job); }); });
+}
+
+// Runs everything the handler pool has sent back to us.
+void ServerWorker::handlersFinished()
+{
+    uint64_t drain;
+    while (read(completions->eventFd, &drain, sizeof(drain)) > 0)
+        ;
+    std::vector<std::function<void()>> finished;
+    {
+        std::lock_guard<std::mutex> guard(completions->lock);
+        finished.swap(completions->done);
+    }
+    for (auto &then : finished)
+    {
+        then();
+    }
+}
+
+// Queues a finished async handler's response on its connection, if it
+// is still open, and carries on with the connection.
+void ServerWorker::finishJob(HandlerJob &job)
+{
+    server.pageDone();
+    auto found = connections.find(job.socket);
+    bool open = found != connections.end() && found->second.id == job.connection;
+    server.logAccess(open ? &found->second : nullptr, job.request.get_command_view(), job.request.get_resource_view(),
+                     job.status, job.bytes + job.output.pending(), job.started);
+    if (!open)
+        return;
+    Connection &c = found->second;
+    c.awaitingHandler = false;
+    c.output.splice(job.output);
+    // A stream that gave up on the client is cut short, and the only way
+    // to tell the client that is to close the connection.
+    if (!job.keepAlive || job.streamGone)
+    {
+        c.state = Connection::CLOSING;
+    }
+    c.lastActive = std::chrono::steady_clock::now();
+    pump(c);
+}
+
+// An async handler's stream has more waiting than it should.  While the
+// handler waits, its output so far is moved over to the connection and
+// sent, and it is let go again (by writeConnection()) once no more than
+// "below" bytes are left.
+void ServerWorker::streamOut(std::shared_ptr<HandlerJob> job, size_t below)
+{
+    auto found = connections.find(job->socket);
+    bool open = found != connections.end() && found->second.id == job->connection;
+    {
+        std::lock_guard<std::mutex> guard(job->streamLock);
+        if (!job->streamWaiting)
+            return; // It has already given up.
+        if (open)
+        {
+            job->bytes += job->output.pending();
+            found->second.output.splice(job->output);
+        }
+        else
+        {
+            job->streamWaiting = false;
+            job->streamGone = true;
+        }
+    }
+    if (!open)
+    {
+        job->streamWake.notify_one();
+        return;
+    }
+    Connection &c = found->second;
+    c.streamWaiter = job;
+    c.streamResumeBelow = below;
+    c.lastActive = std::chrono::steady_clock::now();
+    pump(c);
+}
+
+void ServerWorker::releaseStream(Connection &c, bool gone)
+{
+    auto job = std::move(c.streamWaiter);
+    c.streamWaiter.reset();
+    {
+        std::lock_guard<std::mutex> guard(job->streamLock);
+        job->streamWaiting = false;
+        job->streamGone = job->streamGone || gone;
+    }
+    job->streamWake.notify_one();
+}
+
+void ServerWorker::startCoroutine(Connection &c, const HTTPRequestView &view, bool keepAlive,
+                                  const CoroutineHandler &handler)
+{
+    auto owned = std::make_unique<CoroutineJob>(view, c.socket, c.id, keepAlive);
+    CoroutineJob *job = owned.get();
+    job->route = server.routeId(server.findHandler(view.get_resource()));
+    coroutines[job] = std::move(owned);
+    c.awaitingHandler = true;
+    // A stream has to go out through the connection, after anything
+    // already waiting there.
+    job->responder.backpressure = [this, job](OutputQueue &out, size_t below)
+    {
+        auto found = connections.find(job->socket);
+        if (found == connections.end() || found->second.id != job->connection)
+            return false;
+        job->bytes += out.pending();
+        found->second.output.splice(out);
+        return server.drainStream(found->second, below);
+    };
+    job->handle = handler(job->request, job->responder).release();
+    job->handle.promise().worker = this;
+    job->handle.promise().job = job;
+    // We are already in the middle of the connection's processRequests(),
+    // which carries on from here, so no pump().
+    resume(job);
+}
+
+// Sets a body handler going on a request of which only the headers are in
+// so far.  Its body is fed to the sink by feedUpload() as it arrives.
+void ServerWorker::startUpload(Connection &c, const HTTPRequestView &view, bool keepAlive, const BodyHandler &handler)
+{
+    BodyReader reader = c.parser.bodyReader();
+    reader.maxBytes = server.maxStreamedBodyBytes;
+    if (reader.length() > reader.maxBytes)
+    {
+        // No point asking the handler about something we won't take.
+        server.refuse(c, HTTPResponder::PAYLOAD_TOO_LARGE, view.get_command(), view.get_resource(), std::chrono::steady_clock::now());
+        return;
+    }
+    auto expect = view.find_header("expect");
+    const std::string_view goAhead = "100-continue";
+    if (expect != nullptr && std::equal(expect->value.begin(), expect->value.end(), goAhead.begin(), goAhead.end(),
+                                        [](char a, char b)
+                                        { return tolower(a) == b; }))
+    {
+        c.output.append("HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    c.upload = std::make_shared<BodyUpload>(view, reader, keepAlive);
+    c.upload->route = server.routeId(server.findHandler(view.get_resource()));
+    c.upload->sink = handler(c.upload->request);
+}
+
+// Hands the body of the connection's upload, from "start" in the input,
+// to its sink, moving "start" past it, and once the body is all in has
+// the sink respond.  Returns false if it needs more input first.
+bool ServerWorker::feedUpload(Connection &c, size_t &start)
+{
+    BodyUpload &upload = *c.upload;
+    std::string_view piece;
+    auto status = upload.reader.read(c.input, start, piece);
+    for (; status == BodyReader::PIECE; status = upload.reader.read(c.input, start, piece))
+    {
+        upload.sink->write(piece);
+    }
+    if (status == BodyReader::NEED_MORE)
+    {
+        return false;
+    }
+    // This keeps the request (and the sink) around until we are done.
+    auto finished = std::move(c.upload);
+    if (status == BodyReader::TOO_LARGE)
+    {
+        server.refuse(c, HTTPResponder::PAYLOAD_TOO_LARGE, finished->request.get_command_view(), finished->request.get_resource_view(),
+                              finished->started);
+        return true;
+    }
+    if (status == BodyReader::MALFORMED)
+    {
+        std::cerr << "Malformed request caught: " << finished->reader.error() << "\n";
+        server.metrics.add(Metrics::PARSE_ERRORS);
+        server.pageDone();
+        c.state = Connection::CLOSING;
+        return true;
+    }
+    {
+        size_t before = c.output.pending();
+        c.sentEarly = 0;
+        HTTPResponder response(c.socket, &c.output, &arena);
+        response.headers["Connection"] = finished->keepAlive ? "keep-alive" : "close";
+        response.headOnly = finished->request.get_command_view() == "HEAD";
+        response.backpressure = [this, &c](OutputQueue &, size_t below)
+        { return server.drainStream(c, below); };
+        finished->sink->finish(response);
+        response.end();
+        server.metrics.responded(finished->route, response.sentStatus,
+                                 std::chrono::steady_clock::now() - finished->started);
+        size_t after = c.output.pending() + c.sentEarly;
+        server.logAccess(&c, finished->request.get_command_view(), finished->request.get_resource_view(),
+                         response.sentStatus, after > before ? after - before : 0, finished->started);
+    }
+    arena.reset();
+    server.pageDone();
+    if (!finished->keepAlive)
+    {
+        c.state = Connection::CLOSING;
+    }
+    return true;
+}
+
+// Runs a coroutine handler until it next stops to wait, and passes on
+// whatever it wrote.  Once it has finished the connection is free to go
+// on to its next request.  Returns the connection, if it is still open.
+Connection *ServerWorker::resume(CoroutineJob *job)
+{
+    job->handle.resume();
+    if (job->handle.done())
+    {
+        // In case it left a stream open.
+        job->responder.end();
+    }
+    auto found = connections.find(job->socket);
+    Connection *c = nullptr;
+    job->bytes += job->output.pending();
+    if (found != connections.end() && found->second.id == job->connection)
+    {
+        c = &found->second;
+        c->output.splice(job->output);
+    }
+    if (!job->handle.done())
+        return c;
+
+    if (job->handle.promise().error)
+    {
+        // We don't know how much of a response it sent, so the
+        // connection can't be used for anything else.
+        std::cerr << "Coroutine handler for " << job->request.get_resource_view() << " threw an exception\n";
+        job->keepAlive = false;
+    }
+    server.metrics.responded(job->route, job->responder.sentStatus, std::chrono::steady_clock::now() - job->started);
+    server.logAccess(c, job->request.get_command_view(), job->request.get_resource_view(), job->responder.sentStatus,
+                     job->bytes, job->started);
+    server.pageDone();
+    if (c != nullptr)
+    {
+        c->awaitingHandler = false;
+        if (!job->keepAlive)
+            c->state = Connection::CLOSING;
+        c->lastActive = std::chrono::steady_clock::now();
+    }
+    coroutines.erase(job);
+    return c;
+}
+
+// Resumes a coroutine from the event loop itself, so we can carry
+// straight on with its connection.
+void ServerWorker::wake(CoroutineJob *job)
+{
+    Connection *c = resume(job);
+    if (c != nullptr)
+        pump(*c);
+}
+
+void ServerWorker::fireTimers()
+{
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() && timers.begin()->first <= now)
+    {
+        CoroutineJob *job = timers.begin()->second;
+        timers.erase(timers.begin());
+        wake(job);
+    }
+}
+
+void ServerWorker::wakeAt(std::chrono::steady_clock::time_point deadline, CoroutineJob *job)
+{
+    timers.emplace(deadline, job);
+}
+
+bool ServerWorker::wakeOnFd(int fd, uint32_t events, uint32_t *seen, CoroutineJob *job)
+{
+    // Descriptors we are already watching for ourselves can't be
+    // added again.
+    if (fd == listenSocket || fd == server.stopFd || fd == completions->eventFd || connections.contains(fd) ||
+        fdWaiters.contains(fd))
+        return false;
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    // Regular files can't go in an epoll set, and the caller falls
+    // back to poll(), which says they are always ready.
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return false;
+    fdWaiters[fd] = {job, seen};
+    return true;
+}
+
+bool ServerWorker::runOffLoop(std::function<std::string()> work, std::string *result, CoroutineJob *job)
+{
+    if (server.handlerPool == nullptr)
+        return false;
+    auto done = completions;
+    ServerWorker *worker = this;
+    return server.handlerPool->trySubmit([work, result, job, done, worker]()
+                                         {
+        // The result is only put in place back on the event loop, when
+        // we know the coroutine (which owns "result") is still there.
+        auto data = std::make_shared<std::string>(work());
+        done->post([data, result, job, worker]()
+                   {
+            *result = std::move(*data);
+            worker->wake(job); }); });
+}
+
+// This drives a connection forward as far as it can go right now:
+// dispatch whatever requests are in, send whatever output is queued, and
+// repeat if we had to stop dispatching because the output was backed up.
+bool ServerWorker::pump(Connection &c)
+{
+    while (true)
+    {
+        bool heldBack = processRequests(c);
+        if (!writeConnection(c))
+            return false;
+        if (!c.output.empty())
+        {
+            // The socket is full, so we wait for EPOLLOUT.
+            if (c.state != Connection::CLOSING)
+                c.state = Connection::WRITING;
+            watch(c);
+            return true;
+        }
+        if (c.awaitingHandler)
+        {
+            // Nothing more to do until the handler pool is done.
+            return true;
+        }
+        if (c.peerClosed && c.state != Connection::CLOSING && (!c.input.empty() || c.upload))
+        {
+            // They hung up in the middle of a request, so it will never
+            // be complete.
+            std::cerr << "Malformed request caught\n";
+            server.metrics.add(Metrics::PARSE_ERRORS);
+            server.pageDone();
+        }
+        if (c.state == Connection::CLOSING || c.peerClosed)
+        {
+            closeConnection(c);
+            return false;
+        }
+        c.state = Connection::READING;
+        if (c.unread && wantsInput(c))
+        {
+            // Now we can take the input we left waiting.
+            if (!readConnection(c))
+                return false;
+            continue;
+        }
+        if (!heldBack)
+        {
+            watch(c);
+            return true;
+        }
+    }
+}
+
+// Sends as much of the queued response as the socket will take.  If
+// it fills up we wait for the next EPOLLOUT and pick up where we left off.
+bool ServerWorker::writeConnection(Connection &c)
 {
-    if (port == 0)
+    size_t before = c.output.pending();
+    auto result = c.output.write(c.socket);
+    server.metrics.add(Metrics::BYTES_OUT, before - c.output.pending());
+    if (result == OutputQueue::ERROR)
     {
-        // Port should never be 0, but testing code may override
-        // other functions for testing purposes so we want to
-        // be able to make dummies.
-        return;
+        server.metrics.add(Metrics::SEND_ERRORS);
+        closeConnection(c);
+        return false;
     }
-    // This creates a "socket" (a File descriptor type object)
-    // that is used to listen to connections.   By default we use
-    // port 8080.
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(port);
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(serverSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)))
+    if (c.output.pending() != before)
     {
-        std::cerr << "Bind returned an error, error: " << strerror(errno) << "\n";
-        exit(-1);
+        c.lastActive = std::chrono::steady_clock::now();
     }
-    std::cerr << "Listening For Connection\n";
-    if (listen(serverSocket, 10))
+    if (c.streamWaiter && c.output.pending() <= c.streamResumeBelow)
     {
-        std::cerr << "Listen returned an error, error: " << strerror(errno) << "\n";
-        exit(-1);
+        releaseStream(c, false);
     }
-    abort_port = serverSocket;
-    // Register a signal handler so we close the socket cleanly
-    // on control-C and a couple other cases
-    struct sigaction sigIntHandler;
-    sigIntHandler.sa_handler = clean_close;
-    sigemptyset(&sigIntHandler.sa_mask);
-    sigIntHandler.sa_flags = 0;
+    return true;
+}
 
-    sigaction(SIGINT, &sigIntHandler, NULL);
-    sigaction(SIGHUP, &sigIntHandler, NULL);
-    sigaction(SIGTERM, &sigIntHandler, NULL);
+// Makes sure the timer wheel looks at the connection by its deadline.
+// Deadlines mostly move later, as the client makes progress, and then the
+// timer that is already set does: it fires, finds there is longer to go,
+// and sets another.
+void ServerWorker::watch(Connection &c)
+{
+    auto due = server.deadline(c);
+    if (due < c.timerDue)
+    {
+        deadlines.schedule(due, Deadline{c.socket, c.id, due});
+        c.timerDue = due;
+    }
 }
 
-WebServer::~WebServer()
+// Closes every connection that has gone past its deadline, whether it is
+// a keep-alive connection waiting for its next request or a client that
+// is taking too long over one.
+void ServerWorker::expireDeadlines()
 {
-    std::cerr << "Shutting down webserver\n";
-    if (port != 0)
+    auto now = std::chrono::steady_clock::now();
+    deadlines.expire(now, [this, now](const Deadline &d)
+                     {
+        auto found = connections.find(d.socket);
+        if (found == connections.end() || found->second.id != d.connection || found->second.timerDue != d.due)
+            return;
+        Connection &c = found->second;
+        c.timerDue = std::chrono::steady_clock::time_point::max();
+        if (server.deadline(c) > now)
+        {
+            watch(c);
+            return;
+        }
+        if (!c.input.empty() || c.upload)
+            server.metrics.add(Metrics::TIMEOUTS);
+        closeConnection(c); });
+}
+
+// Closing the socket also removes it from the epoll set.
+void ServerWorker::closeConnection(Connection &c)
+{
+    if (c.streamWaiter)
+        releaseStream(c, true);
+    server.release(c);
+    int fd = c.socket;
+    close(fd);
+    connections.erase(fd);
+}
+
+// Registers a handler function into the system.  The map owns the
+// handler, and the router is just an index over the map.
+void WebServer::RegisterHandler(std::string path, std::function<void(HTTPRequest &r, HTTPResponder &resp)> responder)
+{
+    auto &handler = handlerFunctions[path];
+    handler = responder;
+    router.add(path, &handler);
+    if (!routeIds.contains(&handler))
     {
-        close(serverSocket);
+        routeIds[&handler] = metrics.addRoute(path);
     }
+    asyncHandlers.erase(&handler);
+    coroutineHandlers.erase(&handler);
+    bodyHandlers.erase(&handler);
 }
 
-// Again, you do not need to modify this function, but you do need to understand it.
+void WebServer::RegisterAsyncHandler(std::string path, std::function<void(HTTPRequest &r, HTTPResponder &resp)> responder)
+{
+    RegisterHandler(path, responder);
+    asyncHandlers.insert(&handlerFunctions[path]);
+}
 
-// A limit for testing, can set it to only serve a few pages and quit.
-// This is important for e.g. valgrind checking, as valgrind will have
-// an opportunity to formally check things only if the program quits normally
-// rather than being killed with control-C.
-void WebServer::serve(uint64_t pages)
+// The handler table gets a version that just runs the coroutine to the end,
+// for when DispatchResponse() is called without an event loop.
+void WebServer::RegisterCoroutineHandler(std::string path, CoroutineHandler responder)
 {
-    if (port == 0)
+    RegisterHandler(path, [responder](HTTPRequest &r, HTTPResponder &resp)
+                    { responder(r, resp).runBlocking(); });
+    coroutineHandlers[&handlerFunctions[path]] = responder;
+}
+
+// And again for body handlers: this version has the whole body already.
+void WebServer::RegisterBodyHandler(std::string path, BodyHandler responder)
+{
+    RegisterHandler(path, [responder](HTTPRequest &r, HTTPResponder &resp)
+                    {
+                        auto sink = responder(r);
+                        if (!r.get_payload_view().empty())
+                            sink->write(r.get_payload_view());
+                        sink->finish(resp); });
+    bodyHandlers[&handlerFunctions[path]] = responder;
+}
+
+// This makes the same choice as DispatchResponse(), without calling
+// anything.  It returns nullptr if a static route would win.
+const HandlerFunction *WebServer::findHandler(std::string_view path) const
+{
+    if (path.empty() || path[0] != '/')
+        return nullptr;
+    RouteScore score;
+    auto handler = router.find(path, score);
+    if (handler == nullptr || (staticScore != nullptr && staticScore(path) > score))
+        return nullptr;
+    return handler;
+}
+
+bool WebServer::runsOnPool(std::string_view path) const
+{
+    auto handler = findHandler(path);
+    return handler != nullptr && asyncHandlers.contains(handler);
+}
+
+const CoroutineHandler *WebServer::coroutineFor(std::string_view path) const
+{
+    if (coroutineHandlers.empty())
+        return nullptr;
+    auto found = coroutineHandlers.find(findHandler(path));
+    return found == coroutineHandlers.end() ? nullptr : &found->second;
+}
+
+const BodyHandler *WebServer::bodyHandlerFor(std::string_view path) const
+{
+    if (bodyHandlers.empty())
+        return nullptr;
+    auto found = bodyHandlers.find(findHandler(path));
+    return found == bodyHandlers.end() ? nullptr : &found->second;
+}
+
+// The path must start with "/", otherwise we respond with a
+// respondError() response and return.
+
+// Then we look for the bound responder for the path.  If there is one
+// for the absolute name, that is the one we call.
+
+// If that is not the case we use a "path responder", one bound to the
+// entire path.  So if the request was for "/this/is/a/test", we look
+// for responders for "/this/is/a/", "/this/is/", "/this/", and "/" and use
+// the first one found.
+
+// The router finds both in a single pass over the path, and then we see if
+// any of the compile-time routes do better.  There will always be A
+// responder for "/" in the configuration.
+//
+// Every response is timed and counted in metrics, under its route.
+void WebServer::DispatchResponse(HTTPRequest &request, HTTPResponder &responder)
+{
+    auto started = std::chrono::steady_clock::now();
+    size_t route = callHandler(request, responder);
+    metrics.responded(route, responder.sentStatus, std::chrono::steady_clock::now() - started);
+}
+
+size_t WebServer::callHandler(HTTPRequest &request, HTTPResponder &responder)
+{
+    std::string_view path = request.get_resource_view();
+
+    // path must start with "/" and should not be empty
+    if(path.empty() || path[0] != '/'){
+        respondError(request, responder);
+        return Metrics::NO_ROUTE;
+    }
+
+    RouteScore score;
+    auto handler = router.find(path, score);
+    if(staticRoutes != nullptr && staticRoutes(path, score, request, responder)){
+        return Metrics::STATIC_ROUTE;
+    }
+    if(handler == nullptr){
+        respondNotFound(request, responder);
+        return Metrics::NO_ROUTE;
+    }
+    (*handler)(request, responder);
+    return routeId(handler);
+}
+
+size_t WebServer::routeId(const HandlerFunction *handler) const
+{
+    auto found = routeIds.find(handler);
+    return found == routeIds.end() ? Metrics::NO_ROUTE : found->second;
+}
+
+// You don't need to change this function, but it is
+// another one you should understand.  The pieces go straight into the
+// output queue's buffer, so there is no temporary string per header.
+void HTTPResponder::formatHeaders(OutputQueue &out, int status, size_t length, std::string_view fixed)
+{
+    char number[24];
+    sentStatus = status;
+    out.append("HTTP/1.1 ");
+    out.append(std::string_view(number, snprintf(number, sizeof(number), "%d", status)));
+    out.append(" \r\n");
+
+    for (auto &a : headers)
     {
-        std::cerr << "Not actually running a server, this should not happen\n";
-        exit(-1);
+        // We know the real length better than the handler does.
+        if (a.first == "Content-Length")
+            continue;
+        out.append(a.first);
+        out.append(": ");
+        out.append(a.second);
+        out.append("\r\n");
     }
-    while (pages > 0)
+    if (length != std::string::npos)
     {
-        int clientSocket = accept(serverSocket, nullptr, nullptr);
-        if (clientSocket == -1)
-        {
-            std::cerr << "Accept returned an error, error: " << strerror(errno) << "\n";
-        }
-        else
-        {
-            serveSocket(clientSocket);
-        }
-        pages--;
+        // Clients need this to find the end of the body on a
+        // connection that stays open.
+        out.append("Content-Length: ");
+        out.append(std::string_view(number, snprintf(number, sizeof(number), "%zu", length)));
+        out.append("\r\n");
     }
+    out.append(fixed);
+    out.append("\r\n");
 }
 
-// And this reads data up until \r\n\r\n, hands it to the constructor
-// and then dispatches the result.  Again, you do not need to modify this
-// function.
-void WebServer::serveSocket(int socket)
+void HTTPResponder::sendResponse(std::string &response, int status)
 {
-    const size_t buflen = 10000;
-    char buffer[buflen];
-    size_t recv_count = 0;
-    std::string received = "";
-    while (true)
+    // Without an event loop the socket is blocking, so we queue
+    // the response locally and flush it until it has all gone.
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    formatHeaders(*out, status, response.size());
+    if (!headOnly)
+        out->append(response);
+    if (out == &queue)
     {
-        auto result = recv(socket, buffer + recv_count, buflen - 1 - recv_count, 0);
-        if (result == -1)
-        {
-            std::cerr << "Socket error: " << strerror(errno) << "\n";
-            return;
-        }
-        // Returns 0 if no more data avilable, so break out...
-        if (result == 0)
-            break;
-        // The return value we want to add a null terminator
-        recv_count += result;
-        buffer[recv_count + 1] = '\0';
-        std::string data(buffer, recv_count);
-        if (data.find("\r\n\r\n") != data.npos ||
-            data.find("\n\n") != data.npos)
-        {
-            received = data;
-            break;
-        }
+        queue.flush(socket);
     }
-    try
+}
+
+void HTTPResponder::sendFile(std::shared_ptr<const CachedFile> file, int status)
+{
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    // The file brings its own Content-Length.
+    formatHeaders(*out, status, std::string::npos, file->headers);
+    if (!headOnly)
     {
-        HTTPRequest request(received);
-        HTTPResponder response(socket);
-        DispatchResponse(request, response);
+        if (file->bytes)
+            out->appendShared(file->bytes);
+        else
+            out->appendFile(file->file, 0, file->size);
     }
-    catch (MalformedRequestException &e)
+    if (out == &queue)
     {
-        std::cerr << "Malformed request caught\n";
+        queue.flush(socket);
     }
-    close(socket);
 }
 
-// Registers a handler function into the system.
-void WebServer::RegisterHandler(std::string path, std::function<void(HTTPRequest &r, HTTPResponder &resp)> responder)
+void HTTPResponder::sendMapped(std::shared_ptr<const void> owner, std::string_view body, std::string_view fixed,
+                               int status)
 {
-    handlerFunctions[path] = responder;
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    formatHeaders(*out, status, body.size(), fixed);
+    if (!headOnly)
+        out->appendMapped(std::move(owner), body);
+    if (out == &queue)
+    {
+        queue.flush(socket);
+    }
 }
 
-// This is the first major function YOU need to write.
-// You should examine the path.  the path must start with "/", otherwise
-// you should respond with a respondError() response and return.
+HTTPResponder::~HTTPResponder()
+{
+    if (streaming)
+        end();
+}
 
-// Then you need to check to see if there is a bound responder for the
-// specified item.  It should first check the handlerFuncitons to see if the
-// absolute name is in there.  If so, it should call the handlerFunction and
-// return.
+void HTTPResponder::beginStream(int status)
+{
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    formatHeaders(*out, status, std::string::npos, "Transfer-Encoding: chunked\r\n");
+    streaming = true;
+    lastChunk = std::chrono::steady_clock::now();
+    if (out == &queue)
+    {
+        clientGone = queue.flush(socket) != OutputQueue::DONE;
+    }
+}
 
-// If that is not the case it needs to search for a "path responder",
-// One bound to the entire path.  So if the request was for "/this/is/a/test",
-// it should check for responders for "/this/is/a/test", "/this/is/a/",
-// "/this/is/", "/this/", and "/" and use the first one found.
+bool HTTPResponder::write(std::string_view data)
+{
+    if (!streaming)
+        beginStream();
+    if (clientGone)
+        return false;
+    if (headOnly)
+        return true;
+    pending.append(data);
+    if (pending.size() >= streamFlushBytes || std::chrono::steady_clock::now() - lastChunk >= streamFlushInterval)
+    {
+        sendChunk();
+    }
+    return !clientGone;
+}
 
-// There will always be A responder for "/" in the configuration.
-void WebServer::DispatchResponse(HTTPRequest &request, HTTPResponder &responder)
+void HTTPResponder::flush()
 {
-    
+    if (streaming)
+        sendChunk();
+}
 
-    // get path
-    std::string path = request.get_resource();
-    
-    // path must start with "/" and should not be empty
-    auto pos = path.find_first_of('/');
-    if(pos != 0 || path.empty()){
-        respondError(request, responder);
+void HTTPResponder::end()
+{
+    if (!streaming)
+        return;
+    sendChunk();
+    streaming = false;
+    // A HEAD response has no chunks, not even the last one.
+    if (clientGone || headOnly)
         return;
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    out->append("0\r\n\r\n");
+    if (out == &queue)
+    {
+        queue.flush(socket);
     }
+}
 
-    //check if path is in handlerFunctions
-    auto handler = handlerFunctions.find(path);
-    if(handler != handlerFunctions.end()){
-        handler -> second(request, responder);
+void HTTPResponder::sendChunk()
+{
+    if (pending.empty() || clientGone)
+    {
+        pending.clear();
         return;
     }
-
-    //check for path responder and if it is in handlerFunctions
-    auto path_responder = path;
-    while(!path_responder.empty()){
-        auto last = path_responder.find_last_of('/');
-        if(last == std::string::npos){
-            break;
-        }
-        path_responder = path_responder.substr(0, last + 1);
-        handler = handlerFunctions.find(path_responder);
-        if(handler != handlerFunctions.end()){
-            handler -> second(request, responder);
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    char size[24];
+    out->append(std::string_view(size, snprintf(size, sizeof(size), "%zx\r\n", pending.size())));
+    out->append(pending);
+    out->append("\r\n");
+    pending.clear();
+    lastChunk = std::chrono::steady_clock::now();
+    if (out == &queue)
+    {
+        clientGone = queue.flush(socket) != OutputQueue::DONE;
+        return;
+    }
+    if (out->pending() <= streamMaxBuffered)
+        return;
+    size_t below = streamMaxBuffered / 2;
+    if (backpressure)
+    {
+        clientGone = !backpressure(*out, below);
+        return;
+    }
+    while (out->pending() > below)
+    {
+        auto result = out->write(socket);
+        struct pollfd p = {socket, POLLOUT, 0};
+        if (result == OutputQueue::ERROR || (result == OutputQueue::AGAIN && poll(&p, 1, -1) == -1 && errno != EINTR))
+        {
+            clientGone = true;
             return;
         }
-        path_responder = path_responder.substr(0,last);
     }
-
-    // there will always be "/"
-    handlerFunctions["/"](request, responder);
 }
 
-// You don't need to change this function, but it is
-// another one you should understand.
-void HTTPResponder::sendResponse(std::string &response, int status)
+void HTTPResponder::sendNotModified(std::string_view validators)
 {
-    std::ostringstream out;
-    out << "HTTP/1.1 " << status << " \r\n";
-
-    for (auto a : headers)
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    // A 304 has no body, and no Content-Length either since that would
+    // be the length of the body it isn't sending.
+    formatHeaders(*out, NOT_MODIFIED, std::string::npos, validators);
+    if (out == &queue)
     {
-        out << a.first << ": " << a.second << "\r\n";
+        queue.flush(socket);
     }
-    out << "\r\n"
-        << response;
-    std::string data = out.str();
+}
 
-    auto payload = data.c_str();
-    int length = data.length();
-    auto sent = send(socket, payload, length, 0);
-    if (sent == -1)
+void HTTPResponder::sendFileRanges(std::shared_ptr<const CachedFile> file,
+                                   const std::vector<std::pair<size_t, size_t>> &ranges)
+{
+    OutputQueue queue;
+    OutputQueue *out = output != nullptr ? output : &queue;
+    auto appendRange = [&](size_t first, size_t last)
+    {
+        if (headOnly)
+            return;
+        if (file->bytes)
+            out->appendShared(file->bytes, first, last - first + 1);
+        else
+            out->appendFile(file->file, first, last - first + 1);
+    };
+    char range[80];
+    if (ranges.size() == 1)
+    {
+        auto [first, last] = ranges.front();
+        snprintf(range, sizeof(range), "bytes %zu-%zu/%zu", first, last, file->size);
+        headers["Content-Range"] = range;
+        formatHeaders(*out, PARTIAL_CONTENT, last - first + 1, file->headersAfterLength());
+        appendRange(first, last);
+    }
+    else
     {
-        std::cerr << "Send error : " << strerror(errno) << "\n";
+        // The boundary only has to be unlikely to turn up in the file.
+        static std::atomic<uint64_t> responses = 0;
+        char boundary[40];
+        snprintf(boundary, sizeof(boundary), "webserver-%016llx", (unsigned long long)responses++);
+        // Each part's header comes before its bytes; the length has to
+        // be known before any of it goes out.
+        std::vector<std::string> parts;
+        size_t length = 0;
+        for (auto [first, last] : ranges)
+        {
+            snprintf(range, sizeof(range), "bytes %zu-%zu/%zu", first, last, file->size);
+            parts.push_back(std::string("\r\n--") + boundary + "\r\nContent-Type: " + file->mimetype +
+                            "\r\nContent-Range: " + range + "\r\n\r\n");
+            length += parts.back().size() + last - first + 1;
+        }
+        std::string end = std::string("\r\n--") + boundary + "--\r\n";
+        length += end.size();
+        headers["Content-Type"] = std::string("multipart/byteranges; boundary=") + boundary;
+        formatHeaders(*out, PARTIAL_CONTENT, length, file->headersAfterLength());
+        for (size_t i = 0; i < ranges.size() && !headOnly; ++i)
+        {
+            out->append(parts[i]);
+            appendRange(ranges[i].first, ranges[i].second);
+        }
+        if (!headOnly)
+            out->append(end);
     }
-    else if (sent < length)
+    if (out == &queue)
     {
-        std::cerr << "HERE needs fixing!" << "\n";
+        queue.flush(socket);
     }
 }
 
@@ -245,14 +1769,15 @@ void HTTPResponder::sendResponse(std::string &response, int status)
 void dummyHandler(HTTPRequest &r, HTTPResponder &resp)
 {
     (void)r;
-    std::string payload = dummypayload;
+    // sendResponse() only reads it, so one copy does for every request.
+    static std::string payload = dummypayload;
     resp.sendResponse(payload);
 }
 
 void respondNotFound(HTTPRequest &r, HTTPResponder &resp)
 {
     (void)r;
-    std::string payload = "<HTML><HEAD><TITLE>File Not Found!</TITLE><BODY><H3>File Not Found!</H3></BODY></HTML>";
+    static std::string payload = "<HTML><HEAD><TITLE>File Not Found!</TITLE><BODY><H3>File Not Found!</H3></BODY></HTML>";
     resp.sendResponse(payload, resp.NOTFOUND);
 }
 
@@ -263,10 +1788,17 @@ void respondForbidden(HTTPRequest &r, HTTPResponder &resp)
     resp.sendResponse(payload, resp.FORBIDDEN);
 }
 
+void respondUnavailable(HTTPRequest &r, HTTPResponder &resp)
+{
+    (void)r;
+    static std::string payload = "<HTML><HEAD><TITLE>Service Unavailable</TITLE><BODY><H3>Too busy, try again later.</H3></BODY></HTML>";
+    resp.sendResponse(payload, resp.UNAVAILABLE);
+}
+
 void respondError(HTTPRequest &r, HTTPResponder &resp)
 {
     (void)r;
-    std::string payload = "<HTML><HEAD><TITLE>File Not Found!</TITLE><BODY><H3>File Not Found!</H3></BODY></HTML>";
+    static std::string payload = "<HTML><HEAD><TITLE>File Not Found!</TITLE><BODY><H3>File Not Found!</H3></BODY></HTML>";
     resp.sendResponse(payload, resp.BADREQUEST);
 }
 
@@ -325,6 +1857,9 @@ std::string mimetype(std::string filename)
 
     // get extension
     auto extension_pos = filename.find_last_of('.');
+    if (extension_pos == std::string::npos) {
+        return("application/octet-stream");
+    }
     auto extension = filename.substr(extension_pos);
 
     // find and return extension
@@ -338,6 +1873,223 @@ std::string mimetype(std::string filename)
 
 }
 
+// How much an Accept-Encoding header wants "coding", from 0 (not at
+// all) to 1.  Codings that aren't listed get the "*" entry's rating,
+// or 0 if there isn't one.
+static double acceptRating(std::string_view accept, std::string_view coding)
+{
+    double star = 0;
+    while (!accept.empty())
+    {
+        auto comma = accept.find(',');
+        std::string_view entry = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+        auto semicolon = entry.find(';');
+        std::string_view name = entry.substr(0, semicolon);
+        while (!name.empty() && isspace((unsigned char)name.front()))
+            name.remove_prefix(1);
+        while (!name.empty() && isspace((unsigned char)name.back()))
+            name.remove_suffix(1);
+        double q = 1;
+        if (semicolon != std::string_view::npos)
+        {
+            auto param = entry.substr(semicolon + 1);
+            auto equals = param.find('=');
+            if (equals != std::string_view::npos)
+                q = atof(std::string(param.substr(equals + 1)).c_str());
+        }
+        auto same = [](std::string_view a, std::string_view b)
+        {
+            return a.size() == b.size() &&
+                   std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+                              { return tolower((unsigned char)x) == y; });
+        };
+        if (same(name, coding) || (coding == "gzip" && same(name, "x-gzip")))
+            return q;
+        if (name == "*")
+            star = q;
+    }
+    return star;
+}
+
+static std::shared_ptr<const CachedFile> chooseEncoding(const std::shared_ptr<const CachedFile> &file,
+                                                        std::string_view accept)
+{
+    double gzip = file->gzip ? acceptRating(accept, "gzip") : 0;
+    double deflate = file->deflate ? acceptRating(accept, "deflate") : 0;
+    if (gzip > 0 && gzip >= deflate)
+        return file->gzip;
+    if (deflate > 0)
+        return file->deflate;
+    return file;
+}
+
+// Does an If-None-Match header list "etag"?  This is the weak comparison,
+// which ignores any W/ on the front, and "*" matches anything.
+static bool etagListed(std::string_view list, std::string_view etag)
+{
+    while (!list.empty())
+    {
+        while (!list.empty() && (list.front() == ',' || isspace((unsigned char)list.front())))
+            list.remove_prefix(1);
+        if (list.empty())
+            break;
+        if (list.front() == '*')
+            return true;
+        if (list.substr(0, 2) == "W/")
+            list.remove_prefix(2);
+        if (list.empty() || list.front() != '"')
+            return false;
+        auto close = list.find('"', 1);
+        if (close == std::string_view::npos)
+            return false;
+        if (list.substr(0, close + 1) == etag)
+            return true;
+        list.remove_prefix(close + 1);
+    }
+    return false;
+}
+
+// Is what we would send, with "etag" and last changed at "modified",
+// unchanged as far as the client is concerned?  If-None-Match wins when
+// it is there; otherwise If-Modified-Since, which we only understand in
+// the usual IMF-fixdate form.
+static bool notModified(HTTPRequest &request, std::string_view etag, time_t modified)
+{
+    auto match = request.get_header("if-none-match");
+    if (!match.empty())
+    {
+        return etagListed(match, etag);
+    }
+    auto since = request.get_header("if-modified-since");
+    if (since.empty() || since.size() >= 64)
+    {
+        return false;
+    }
+    char date[64];
+    memcpy(date, since.data(), since.size());
+    date[since.size()] = '\0';
+    struct tm when = {};
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &when);
+    if (end == nullptr || *end != '\0')
+    {
+        return false;
+    }
+    return modified <= timegm(&when);
+}
+
+// Requests for more ranges than this get the whole file instead.
+static const size_t maxRanges = 16;
+
+// Parses a Range header into "ranges", dropping any that start past the
+// end of a file of "size" bytes and cutting short any that end past it.
+// Returns false if the header isn't one we understand (or asks for too
+// many ranges), in which case it should be ignored.
+static bool parseRanges(std::string_view header, size_t size, std::vector<std::pair<size_t, size_t>> &ranges)
+{
+    if (header.size() < 6 || strncasecmp(header.data(), "bytes=", 6) != 0)
+        return false;
+    header.remove_prefix(6);
+    size_t count = 0;
+    while (!header.empty())
+    {
+        auto comma = header.find(',');
+        std::string_view spec = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+        while (!spec.empty() && isspace((unsigned char)spec.front()))
+            spec.remove_prefix(1);
+        while (!spec.empty() && isspace((unsigned char)spec.back()))
+            spec.remove_suffix(1);
+        if (spec.empty())
+            continue;
+        if (++count > maxRanges)
+            return false;
+        auto dash = spec.find('-');
+        if (dash == std::string_view::npos)
+            return false;
+        auto number = [](std::string_view digits, size_t &value)
+        {
+            if (digits.empty() || digits.size() > 18)
+                return false;
+            value = 0;
+            for (char c : digits)
+            {
+                if (c < '0' || c > '9')
+                    return false;
+                value = value * 10 + (c - '0');
+            }
+            return true;
+        };
+        size_t first, last;
+        if (dash == 0)
+        {
+            // The last "last" bytes.
+            if (!number(spec.substr(1), last))
+                return false;
+            if (last == 0 || size == 0)
+                continue;
+            ranges.push_back({size - std::min(last, size), size - 1});
+            continue;
+        }
+        if (!number(spec.substr(0, dash), first))
+            return false;
+        if (dash + 1 == spec.size())
+            last = SIZE_MAX;
+        else if (!number(spec.substr(dash + 1), last) || last < first)
+            return false;
+        if (first >= size)
+            continue;
+        ranges.push_back({first, std::min(last, size - 1)});
+    }
+    return count > 0;
+}
+
+// Should a Range be honoured?  Only if If-Range, when there is one, names
+// what we would send: its ETag (compared strongly), or exactly its date.
+static bool rangeStillGood(HTTPRequest &request, std::string_view etag, std::string_view lastModified)
+{
+    auto condition = request.get_header("if-range");
+    if (condition.empty())
+        return true;
+    if (condition.front() == '"')
+        return condition == etag;
+    return condition == lastModified;
+}
+
+// The Cache-Control values from a CachePolicy, made once when the
+// responder is, so each request is just a lookup.
+class CacheControl
+{
+public:
+    CacheControl(const CachePolicy &policy)
+    {
+        for (auto &[extension, age] : policy.maxAge)
+        {
+            values[extension] = age >= 0 ? "max-age=" + std::to_string(age) : "";
+        }
+        otherwise = policy.otherwise >= 0 ? "max-age=" + std::to_string(policy.otherwise) : "";
+    }
+
+    // The value for the file "name", or "" for none.
+    const std::string &operator()(std::string_view name) const
+    {
+        auto dot = name.find_last_of("./");
+        if (dot == std::string_view::npos || name[dot] != '.' || name.size() - dot > 16)
+            return otherwise;
+        char lower[16];
+        size_t length = name.size() - dot;
+        for (size_t i = 0; i < length; ++i)
+            lower[i] = tolower((unsigned char)name[dot + i]);
+        auto found = values.find(std::string_view(lower, length));
+        return found == values.end() ? otherwise : found->second;
+    }
+
+private:
+    std::map<std::string, std::string, std::less<>> values;
+    std::string otherwise;
+};
+
 // This is the final major function you need to write.
 
 // When created it takes a "path", a starting point to the initial files, and should return
@@ -347,18 +2099,30 @@ std::string mimetype(std::string filename)
 
 // If the request contains the exact string "/../" anywhere in it you MUST instead do responseForbidden.
 
-// You should then check if the full path to the file exists using std::filesystem::exists.
-// If the file doesn't exist do respondNotFound and return.
+// The file itself comes from a FileCache, which is shared by every worker
+// and keeps small files in memory and big ones open, so a popular file
+// is only read from disk once.  If the file doesn't exist (or isn't a
+// regular file we can open) do respondNotFound and return.
 
-// Otherwise, load the file as a binary blob into a std::string.  The easiest way to do this
-// is open the file as an ifstream() in std::ifstream::binary mode.  If the ifstream is not
-// good you should then do respondNotFound and return
+// If the file has compressed versions, the client's Accept-Encoding picks
+// one: whichever of gzip and deflate it rates highest (gzip on a tie), as
+// long as it doesn't rate it 0, and the file as it is otherwise.
 
-// Then you can create a stringstream as a buffer, and read in all the data and then get
-// the std::string from the stringstream...
+// Every response carries the ETag and Last-Modified of what it sends, and
+// the Cache-Control from "policy" for the file's extension.  A GET or HEAD
+// whose If-None-Match or If-Modified-Since shows the client already has
+// that gets a 304 instead of the file.  A GET with a Range gets just the
+// bytes it asks for, as a 206, or a 416 if none of them are in the file.
 
-std::function<void(HTTPRequest &, HTTPResponder &)> generateFileResponder(std::string path)
+std::function<void(HTTPRequest &, HTTPResponder &)> generateFileResponder(std::string path,
+                                                                        std::shared_ptr<FileCache> cache,
+                                                                        CachePolicy policy)
 {
+    if (!cache)
+    {
+        cache = std::make_shared<FileCache>();
+    }
+    CacheControl cacheControlFor(policy);
     return [=](HTTPRequest &request, HTTPResponder &responder)
     {
         
@@ -374,24 +2138,104 @@ std::function<void(HTTPRequest &, HTTPResponder &)> generateFileResponder(std::s
             respondForbidden(request, responder);
             return;
         }
-         // check if file exists
-        if(!std::filesystem::exists(Path)){
+        // look the file up, loading it if need be
+        auto file = cache->get(Path);
+        if(!file){
             respondNotFound(request, responder);
             return;
         }
-        //open file, check if input is good
-        std::ifstream input{Path, std::ifstream::binary};
-        if(!input.good()){
-            respondNotFound(request, responder);
+
+        if(file->gzip || file->deflate){
+            file = chooseEncoding(file, request.get_header("accept-encoding"));
+        }
+        auto &control = cacheControlFor(Path);
+        if(!control.empty()){
+            responder.headers["Cache-Control"] = control;
+        }
+        auto method = request.get_command_view();
+        if((method == "GET" || method == "HEAD") && notModified(request, file->etag, file->mtime.tv_sec)){
+            responder.sendNotModified(file->validators);
             return;
         }
-        
-        //load file into std::stringstream 
-        std::stringstream buf;
-        buf << input.rdbuf();
-        std::string file = buf.str();
+        responder.headers["Content-Type"] = file->mimetype;
+        auto range = request.get_header("range");
+        if(!range.empty() && method == "GET" && rangeStillGood(request, file->etag, file->lastModified)){
+            std::vector<std::pair<size_t, size_t>> ranges;
+            if(parseRanges(range, file->size, ranges)){
+                if(ranges.empty()){
+                    responder.headers["Content-Range"] = "bytes */" + std::to_string(file->size);
+                    std::string empty;
+                    responder.sendResponse(empty, HTTPResponder::RANGE_NOT_SATISFIABLE);
+                }else{
+                    responder.sendFileRanges(file, ranges);
+                }
+                return;
+            }
+        }
+        responder.sendFile(file);
+    };
+}
 
-        responder.headers["Content-Type"] = mimetype(Path);
-        responder.sendResponse(file);
+// Serving from an AssetBundle is the same as serving files, except that
+// everything about the file was worked out when the bundle was packed.
+// Only gzip versions are packed, and a request for several ranges gets
+// the whole file, which HTTP allows.
+std::function<void(HTTPRequest &, HTTPResponder &)> generateBundleResponder(std::shared_ptr<AssetBundle> bundle,
+                                                                          CachePolicy policy)
+{
+    CacheControl cacheControlFor(policy);
+    return [=](HTTPRequest &request, HTTPResponder &responder)
+    {
+        std::string_view resource = request.get_resource_view();
+        std::string index;
+        if (!resource.empty() && resource.back() == '/')
+        {
+            index = std::string(resource) + "index.html";
+            resource = index;
+        }
+        AssetBundle::Asset asset;
+        if (!bundle->find(resource, asset))
+        {
+            respondNotFound(request, responder);
+            return;
+        }
+        const AssetBundle::Version *version = &asset.identity;
+        if (!asset.gzip.body.empty() && acceptRating(request.get_header("accept-encoding"), "gzip") > 0)
+        {
+            version = &asset.gzip;
+        }
+        auto &control = cacheControlFor(resource);
+        if (!control.empty())
+        {
+            responder.headers["Cache-Control"] = control;
+        }
+        auto method = request.get_command_view();
+        if ((method == "GET" || method == "HEAD") && notModified(request, version->etag, asset.modified))
+        {
+            responder.sendNotModified(version->validators);
+            return;
+        }
+        responder.headers["Content-Type"] = asset.mimetype;
+        auto range = request.get_header("range");
+        std::vector<std::pair<size_t, size_t>> ranges;
+        if (!range.empty() && method == "GET" && rangeStillGood(request, version->etag, asset.lastModified) &&
+            parseRanges(range, version->body.size(), ranges) && ranges.size() < 2)
+        {
+            if (ranges.empty())
+            {
+                responder.headers["Content-Range"] = "bytes */" + std::to_string(version->body.size());
+                std::string empty;
+                responder.sendResponse(empty, HTTPResponder::RANGE_NOT_SATISFIABLE);
+                return;
+            }
+            auto [first, last] = ranges.front();
+            char contentRange[80];
+            snprintf(contentRange, sizeof(contentRange), "bytes %zu-%zu/%zu", first, last, version->body.size());
+            responder.headers["Content-Range"] = contentRange;
+            responder.sendMapped(bundle, version->body.substr(first, last - first + 1), version->headers,
+                                 HTTPResponder::PARTIAL_CONTENT);
+            return;
+        }
+        responder.sendMapped(bundle, version->body, version->headers);
     };
-}
\ No newline at end of file
+}
@@ -1,3 +1,6 @@
+#ifndef _WEBSERVER_H
+#define _WEBSERVER_H
+
 #include <iostream>
 #include <string>
 #include <string.h>
@@ -5,41 +8,413 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include "httprequest.hpp"
+#include "outputqueue.hpp"
+#include "router.hpp"
+#include "arena.hpp"
+#include "threadpool.hpp"
+#include "coroutine.hpp"
+#include "metrics.hpp"
+#include "accesslog.hpp"
+#include "admission.hpp"
+#include "timerwheel.hpp"
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <type_traits>
 
 // const std::string hello_response = "HTTP/1.1 400 OK\r\nContent-Type: text/HTML\r\nConnection: close\r\n\r\n<HTML><HEAD><TITLE>Hello World</TITLE><BODY><H3>Hello World</H3></BODY></HTML>";
 
 const std::string dummypayload = "<HTML><HEAD><TITLE>Hello world!</TITLE><BODY><H3>Hello World!</H3></BODY></HTML>";
 
 class HTTPResponder;
+struct HandlerCompletions;
+struct HandlerJob;
+struct BodyUpload;
+
+// The state of a single client connection inside the event loop.
+// A connection is READING while it waits for requests.  Every complete
+// request in "input" is dispatched in order, with the responses queued in
+// "output", and while some of that is still unsent it is WRITING.  Once
+// the connection should not take any more requests (the client asked for
+// Connection: close, or it hit the request cap) it is CLOSING, and is closed
+// as soon as the output has drained.
+//
+// While a request's handler is still going elsewhere (on the handler
+// pool, or a coroutine handler that is waiting for something) the
+// connection is "awaitingHandler", and nothing more is read from its
+// input until the handler is done, so responses to pipelined requests
+// still go out in order.
+//
+// A connection that is slow to send a request is closed, whether or not
+// it keeps trickling bytes in: the headers have to be in within
+// headerTimeoutMs of the request starting, and the body at a reasonable
+// rate after that (see WebServer::bodyTimeoutMs).
+struct Connection
+{
+    enum State
+    {
+        READING,
+        WRITING,
+        CLOSING
+    };
+
+    int socket;
+    // Sockets get reused, so finished handlers find their way back with this.
+    uint64_t id = 0;
+    State state = READING;
+    std::string input;
+    RequestParser parser;
+    OutputQueue output;
+    unsigned int requests = 0;
+    bool peerClosed = false;
+    bool awaitingHandler = false;
+    // There may be input still waiting in the kernel that we chose not to
+    // read yet, see ServerWorker::readConnection().
+    bool unread = false;
+    std::chrono::steady_clock::time_point lastActive;
+    // Who is on the other end, for the access log.
+    struct sockaddr_in peer = {};
+    // Output written out while the handler was still streaming it, which
+    // the access log still counts as part of its response.
+    uint64_t sentEarly = 0;
+    // An async handler waiting for the client to catch up with its stream.
+    std::shared_ptr<HandlerJob> streamWaiter;
+    size_t streamResumeBelow = 0;
+    // A request whose body is going to a body handler as it arrives, see
+    // WebServer::RegisterBodyHandler().
+    std::shared_ptr<BodyUpload> upload;
+    // When the request now coming in started, and when the worker's timer
+    // wheel is next due to look at the connection's deadline.
+    std::chrono::steady_clock::time_point requestStarted;
+    std::chrono::steady_clock::time_point timerDue = std::chrono::steady_clock::time_point::max();
+    // Whether it counts against the Admission limits.
+    bool admitted = false;
+};
+
+
+// The type of a coroutine handler, see HandlerTask.
+typedef std::function<HandlerTask(HTTPRequest &, HTTPResponder &)> CoroutineHandler;
+
+// Where a body handler's request body goes, a piece at a time as it
+// arrives, so it never has to be held in memory all at once.  write() is
+// called with each piece in order and then finish() once the body is all
+// in, to send the response.  If the body never completes (the client went
+// away, broke the framing or sent more than maxStreamedBodyBytes) the
+// sink is destroyed without finish() being called.  Both are called on
+// the event loop, so shouldn't block.
+class BodySink
+{
+public:
+    virtual ~BodySink() {}
+    virtual void write(std::string_view piece) = 0;
+    virtual void finish(HTTPResponder &responder) = 0;
+};
+
+// The type of a body handler, which is called as soon as the headers are
+// in and returns the sink for the body.  The request, which has no
+// payload, stays put for as long as the sink is around.
+typedef std::function<std::unique_ptr<BodySink>(HTTPRequest &)> BodyHandler;
 
 class WebServer
 {
 public:
     const unsigned int port;
-    WebServer(unsigned int _port = 0);
+
+    // How many worker threads serve() runs.  Each worker has its own
+    // SO_REUSEPORT listening socket and its own event loop, so the kernel
+    // spreads incoming connections across them and they never share state
+    // apart from the (read-only while serving) handler table.
+    const unsigned int workers;
+
+    WebServer(unsigned int _port = 0, unsigned int _workers = 1);
 
     ~WebServer();
 
     // Virtual so we can have a test version that overwrites and doesn't actually send any information.
     // If port == 0 it doesn't actually open a socket on the constructor so this version
     // will be OK.
+    //
+    // Each worker runs a non-blocking, edge-triggered epoll loop, so any number of
+    // connections can be in flight at once and a slow client only delays itself.
+    // It returns once "pages" responses have been completed across all workers.
     virtual void serve(uint64_t pages = 0xFFFFFFFFFFFFFFFF);
 
+    // Makes serve() return early, as if the page budget had run out.
+    // Safe to call from any thread while it is running.
+    void stop();
+
     // This is the public function used to register handlers.  Handlers are functions
     // that take an HTTP request object and an HTTP Responder object.  The request is the
     // request as sent to the user.  The responder is an object that can be used to send
     // the response.
+    //
+    // Handlers must all be registered before serve() is called, as the
+    // workers read the table without any locking.
     void RegisterHandler(std::string path, std::function<void(HTTPRequest &, HTTPResponder &)> f);
 
+    // And this one is for coroutine handlers, ones that return a
+    // HandlerTask.  They run on the event loop like ordinary handlers,
+    // but can co_await timers, other file descriptors and file reads
+    // without holding up the other connections.
+    template <typename F>
+        requires std::is_same_v<std::invoke_result_t<F &, HTTPRequest &, HTTPResponder &>, HandlerTask>
+    void RegisterHandler(std::string path, F f)
+    {
+        RegisterCoroutineHandler(path, CoroutineHandler(std::move(f)));
+    }
+
+    // Like RegisterHandler(), but the handler is run on the handler pool
+    // instead of on the event loop, for handlers that might block (on the
+    // disk, say) and so hold up every other connection on the worker.
+    // The response is handed back to the event loop to send.  When the
+    // pool already has maxQueuedHandlers requests waiting, any more get a
+    // 503 straight away.
+    void RegisterAsyncHandler(std::string path, std::function<void(HTTPRequest &, HTTPResponder &)> f);
+
+    // For requests with bodies too big to hold in memory, uploads say.
+    // Rather than waiting for the whole body, "f" is called once the
+    // headers are in, and the body is fed to the BodySink it returns as
+    // it arrives.  A client that sent "Expect: 100-continue" is told to go
+    // ahead at that point.  Anywhere else than the epoll loop (which is
+    // the only backend that does this, see Backend) the body is read in
+    // up to maxBodyBytes and handed over in one piece.
+    void RegisterBodyHandler(std::string path, BodyHandler f);
+
+    // Adds a set of routes fixed at compile time, see StaticRouter.
+    template <typename Router>
+    void RegisterStaticRoutes()
+    {
+        staticRoutes = &Router::dispatch;
+        staticScore = &Router::score;
+    }
+
+    // How many connections the kernel holds waiting to be accepted.
+    int listenBacklog = 511;
+
+    // Keep-alive settings, which should be set before serve() is called.
+    // A connection is closed once it has been idle for idleTimeoutMs
+    // milliseconds or once it has served maxRequestsPerConnection requests.
+    // Setting the timeout to 0 turns keep-alive off entirely.
+    unsigned int idleTimeoutMs = 5000;
+    unsigned int maxRequestsPerConnection = 100;
+
+    // Deadlines for clients sending requests, against slowloris attacks
+    // and the like.  The headers have to be in within headerTimeoutMs of
+    // the request starting.  The body then gets bodyTimeoutMs, and
+    // another second for every minBodyRate bytes of it that arrive, so a
+    // big upload can take as long as it needs as long as it keeps going.
+    // A timeout of 0 leaves only the idle timeout.
+    unsigned int headerTimeoutMs = 10000;
+    unsigned int bodyTimeoutMs = 10000;
+    size_t minBodyRate = 16 << 10;
+
+    // Limits on connections and on each address's request rate, see
+    // Admission, to be set before serve() is called.  A connection over
+    // the limits gets a 503 (or a 429, if it is its address that has too
+    // many) and is closed as soon as it is accepted, and a request over
+    // its address's rate gets a 429 and the connection is closed, in
+    // both cases without reading any more from it.  There are no limits
+    // by default.
+    Admission::Options admissionOptions;
+
+    // The handler pool, which serve() only starts if there are any
+    // async handlers.  Also to be set before serve() is called.
+    unsigned int handlerThreads = 4;
+    unsigned int maxQueuedHandlers = 256;
+
+    // The longest request body that is read into memory for a handler,
+    // and the longest that is streamed to a body handler.  A request with
+    // a longer body gets a 413 and the connection is closed.  These are
+    // also to be set before serve() is called.
+    size_t maxBodyBytes = 1 << 20;
+    size_t maxStreamedBodyBytes = SIZE_MAX;
+
+    // How the workers talk to the kernel.  IO_URING runs each worker as an
+    // UringWorker instead of an epoll loop, as long as the kernel supports
+    // it and no async, coroutine or body handlers are registered (which
+    // only the epoll loop knows how to run), falling back to EPOLL
+    // otherwise.
+    enum Backend
+    {
+        EPOLL,
+        IO_URING
+    };
+    Backend backend = EPOLL;
+
+    // Counters for everything the server does, see Metrics.  The
+    // constructor registers a handler for /metrics that serves them in
+    // Prometheus' text format; registering anything else there replaces it.
+    Metrics metrics;
+
+    // The access log is off unless accessLogOptions.path is set before
+    // serve() is called, see AccessLog.  It is written out in full by the
+    // time serve() returns.
+    AccessLog::Options accessLogOptions;
+
 protected:
-    int serverSocket;
+    friend class ServerWorker;
+    friend class UringWorker;
+
+    // One listening socket per worker.
+    std::vector<int> serverSockets;
     struct sockaddr_in serverAddress;
 
-    void serveSocket(int socket);
+    // The page budget shared by all the workers, and an eventfd that
+    // wakes every worker up when it runs out.
+    std::atomic<uint64_t> pagesLeft = 0;
+    int stopFd = -1;
+
+    // Called by a worker every time it finishes with a connection.
+    void pageDone();
+
+    // Whether a connection stays open after "view", which is its
+    // c.requests'th request.
+    bool keepConnection(const Connection &c, const HTTPRequestView &view) const;
+
     void DispatchResponse(HTTPRequest &request, HTTPResponder &responder);
 
     std::map<std::string, std::function<void(HTTPRequest &, HTTPResponder &)>> handlerFunctions;
+
+    // Every path in handlerFunctions, indexed for prefix matching.
+    RadixRouter router;
+    StaticDispatch staticRoutes = nullptr;
+    StaticScore staticScore = nullptr;
+
+    // The handlers registered with RegisterAsyncHandler(), and the
+    // pool they run on while serving.
+    std::unordered_set<const HandlerFunction *> asyncHandlers;
+    std::unique_ptr<ThreadPool> handlerPool;
+
+    // And the coroutine handlers, each under the handler from the table
+    // that stands in for it.
+    std::unordered_map<const HandlerFunction *, CoroutineHandler> coroutineHandlers;
+    void RegisterCoroutineHandler(std::string path, CoroutineHandler f);
+
+    // And the body handlers, in the same way.
+    std::unordered_map<const HandlerFunction *, BodyHandler> bodyHandlers;
+
+    // Turns a request away with "status" (a 413 or a 429), and closes the
+    // connection after it.
+    void refuse(Connection &c, int status, std::string_view method, std::string_view resource,
+                std::chrono::steady_clock::time_point started);
+
+    // Only there while serving.
+    std::unique_ptr<Admission> admission;
+    // Whether to take on a connection that has just been accepted.  If not
+    // it has been sent a response and closed.
+    bool admit(Connection &c);
+    // Whether its address can make another request.  If not it has been
+    // refused.
+    bool admitRequest(Connection &c, const HTTPRequestView &view);
+    // And the connection is finished with.
+    void release(Connection &c);
+
+    // When a connection has to have made some progress by, or
+    // time_point::max() if there isn't a deadline.
+    std::chrono::steady_clock::time_point deadline(const Connection &c) const;
+    // How often the workers' timer wheels tick.
+    std::chrono::milliseconds deadlineTick() const;
+
+    // Only there while serving.
+    std::unique_ptr<AccessLog> accessLog;
+    void logAccess(const Connection *c, std::string_view method, std::string_view resource, int status,
+                   uint64_t bytes, std::chrono::steady_clock::time_point started);
+
+    // Each handler's route number in metrics.
+    std::unordered_map<const HandlerFunction *, size_t> routeIds;
+
+    // DispatchResponse() without the metrics.  Returns the route taken.
+    size_t callHandler(HTTPRequest &request, HTTPResponder &responder);
+    size_t routeId(const HandlerFunction *handler) const;
+
+    // Writes a streaming handler's output out of "c" while the handler is
+    // still running, see HTTPResponder::backpressure.
+    bool drainStream(Connection &c, size_t below);
+
+    // Which kind of handler DispatchResponse() would pick.
+    const HandlerFunction *findHandler(std::string_view path) const;
+    bool runsOnPool(std::string_view path) const;
+    const CoroutineHandler *coroutineFor(std::string_view path) const;
+    const BodyHandler *bodyHandlerFor(std::string_view path) const;
+};
+
+// A single event loop: one listening socket, one epoll instance and the
+// connections accepted through it.  Workers are only ever touched by
+// the thread running them.
+class ServerWorker
+{
+public:
+    ServerWorker(WebServer &_server, int _listenSocket);
+    ~ServerWorker();
+
+    void run();
+
+    // These are for the awaitables in coroutine.hpp, which call them to
+    // have a suspended coroutine resumed once something has happened.
+    // The last two return false if they can't, and the awaitable then
+    // blocks instead.
+    void wakeAt(std::chrono::steady_clock::time_point deadline, CoroutineJob *job);
+    bool wakeOnFd(int fd, uint32_t events, uint32_t *seen, CoroutineJob *job);
+    bool runOffLoop(std::function<std::string()> work, std::string *result, CoroutineJob *job);
+
+private:
+    WebServer &server;
+    int listenSocket;
+
+    // The epoll instance and the connections it is tracking, keyed by socket.
+    int epollFd;
+    std::unordered_map<int, Connection> connections;
+
+    // Requests on this worker are handled one at a time, so they can all
+    // share one arena, which is reset after each.
+    Arena arena;
+
+    // Where the handler pool sends back finished responses.
+    std::shared_ptr<HandlerCompletions> completions;
+    uint64_t nextConnectionId = 0;
+
+    // Coroutine handlers that are waiting for something, and what.
+    std::unordered_map<CoroutineJob *, std::unique_ptr<CoroutineJob>> coroutines;
+    std::multimap<std::chrono::steady_clock::time_point, CoroutineJob *> timers;
+    std::unordered_map<int, std::pair<CoroutineJob *, uint32_t *>> fdWaiters;
+
+    // Every connection's deadline, see WebServer::deadline().  Each entry
+    // is for the connection it names with the id it had then, and only if
+    // it is still due when it was set for.
+    struct Deadline
+    {
+        int socket;
+        uint64_t connection;
+        std::chrono::steady_clock::time_point due;
+    };
+    TimerWheel<Deadline> deadlines;
+
+    // The pieces of the event loop.  The connection ones return false
+    // if they closed (and so destroyed) the connection.
+    void acceptConnections();
+    bool readConnection(Connection &c);
+    bool wantsInput(const Connection &c) const;
+    bool processRequests(Connection &c);
+    bool handOff(Connection &c, const HTTPRequestView &view, bool keepAlive);
+    void handlersFinished();
+    void finishJob(HandlerJob &job);
+    void streamOut(std::shared_ptr<HandlerJob> job, size_t below);
+    void releaseStream(Connection &c, bool gone);
+    void startCoroutine(Connection &c, const HTTPRequestView &view, bool keepAlive, const CoroutineHandler &handler);
+    void startUpload(Connection &c, const HTTPRequestView &view, bool keepAlive, const BodyHandler &handler);
+    bool feedUpload(Connection &c, size_t &start);
+    Connection *resume(CoroutineJob *job);
+    void wake(CoroutineJob *job);
+    void fireTimers();
+    bool pump(Connection &c);
+    bool writeConnection(Connection &c);
+    void closeConnection(Connection &c);
+    void watch(Connection &c);
+    void expireDeadlines();
 };
 
 class HTTPResponder
@@ -51,29 +426,126 @@ public:
 
     // Major HTTP response codes.
     static const int OK = 200;
+    static const int PARTIAL_CONTENT = 206;
+    static const int NOT_MODIFIED = 304;
     static const int FORBIDDEN = 403;
     static const int NOTFOUND = 404;
     static const int BADREQUEST = 400;
+    static const int PAYLOAD_TOO_LARGE = 413;
+    static const int RANGE_NOT_SATISFIABLE = 416;
+    static const int TOO_MANY_REQUESTS = 429;
+    static const int REQUEST_HEADER_FIELDS_TOO_LARGE = 431;
+    static const int UNAVAILABLE = 503;
 
-    HTTPResponder(int _socket) : socket(_socket)
+    // If "_output" is given the response is appended to it rather than
+    // being sent directly, which is how the event loop queues responses
+    // on a non-blocking socket.  The headers are allocated from "memory",
+    // which the event loop points at its per-request Arena.
+    HTTPResponder(int _socket, OutputQueue *_output = nullptr,
+                  std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+        : socket(_socket), headers(memory), output(_output), pending(memory)
     {
-        // For now we are always closing the connection, so we
-        // will always set the "Connection" header to "Close"
+        // By default we close the connection after responding.  The
+        // event loop changes this to "keep-alive" when it is keeping
+        // the connection open for further requests.
         headers["Connection"] = "Close";
     }
 
+    // Ends a stream the handler left open.
+    virtual ~HTTPResponder();
+
     // And this is a map of extra headers, allowing handlers to
     // set various fields.  In particular one important one is
     // "Content-Type", which specifies what type of data is being
     // returned.
 
-    std::map<std::string, std::string> headers;
+    std::pmr::map<std::pmr::string, std::pmr::string> headers;
+
+    // The status of the response once it has been sent, for the metrics.
+    int sentStatus = 0;
+
+    // Set for a HEAD request.  The response goes out just as it would for
+    // a GET, Content-Length and all, but without the body, since on a
+    // connection that stays open the client would take that for the
+    // next response.
+    bool headOnly = false;
 
     // Virtual so we can do a test version that doesn't actually send/receive data
     // for unit testing as well.
     virtual void sendResponse(std::string &response, int status = HTTPResponder::OK);
 
+    // Sends a whole file from the FileCache as the body.  The file's contents
+    // and its own header lines are shared rather than copied, and large
+    // files go out with sendfile().
+    virtual void sendFile(std::shared_ptr<const CachedFile> file, int status = HTTPResponder::OK);
+
+    // Sends "body", which stays put for as long as "owner" is held (part
+    // of an AssetBundle, say), without copying it, after the preformatted
+    // header lines in "fixed".
+    virtual void sendMapped(std::shared_ptr<const void> owner, std::string_view body, std::string_view fixed,
+                            int status = HTTPResponder::OK);
+
+    // Tells the client its copy is still good: a 304 with the header lines
+    // in "validators" and no body.
+    virtual void sendNotModified(std::string_view validators);
+
+    // Streaming, for a body that isn't all known up front.  beginStream()
+    // sends the status and headers, with Transfer-Encoding: chunked in
+    // place of a Content-Length, each write() adds to the body, and end()
+    // finishes it.  Small writes are gathered up and go out as one chunk
+    // once streamFlushBytes have built up, or when a write() comes at
+    // least streamFlushInterval after the last chunk, or on flush().
+    //
+    // Once more than streamMaxBuffered bytes are waiting for the client,
+    // write() waits for it to take at least half of them, so a slow reader
+    // holds up its own handler rather than making us buffer without end.
+    // For a handler on the event loop that wait holds up the worker too, so
+    // big streams are better off in an async handler.  write() returns
+    // false, and drops what it was given, once the client has gone.
+    virtual void beginStream(int status = HTTPResponder::OK);
+    virtual bool write(std::string_view data);
+    virtual void flush();
+    virtual void end();
+
+    size_t streamFlushBytes = 16 << 10;
+    std::chrono::milliseconds streamFlushInterval{50};
+    size_t streamMaxBuffered = 256 << 10;
+
+    // How write() waits for a slow client, set by whoever queues the
+    // output.  It is called with the queue once that holds more than
+    // streamMaxBuffered, and returns once no more than "below" bytes of it
+    // are left, or false if the client has gone.  Without one the queue
+    // is written straight to the socket.
+    std::function<bool(OutputQueue &, size_t below)> backpressure;
+
+    // Sends just some byte ranges of the file as a 206, each range being
+    // its first and last byte, both within the file.  One range goes out
+    // as it is and several as a multipart/byteranges body.  Either way the
+    // bytes are shared from the cache or sent from the open file, so
+    // nothing is read in or copied whatever the size of the file.
+    virtual void sendFileRanges(std::shared_ptr<const CachedFile> file,
+                                const std::vector<std::pair<size_t, size_t>> &ranges);
+
+protected:
+    // Appends the status line and headers, ending with the blank line, to
+    // "out".  Content-Length is always written from "length" rather than
+    // taken from the headers map, unless "length" is npos, when "fixed"
+    // must already carry it.  "fixed" is a block of already formatted
+    // header lines that goes in as is.
+    void formatHeaders(OutputQueue &out, int status, size_t length, std::string_view fixed = "");
+
 private:
+    OutputQueue *output;
+
+    // The stream's writes that haven't gone out as a chunk yet.
+    std::pmr::string pending;
+    bool streaming = false;
+    bool clientGone = false;
+    std::chrono::steady_clock::time_point lastChunk;
+
+    // Queues "pending" as a chunk and sends it on or waits for the client
+    // as need be.
+    void sendChunk();
 };
 
 // A couple of dummy handler functions.  This first one is a hello world...
@@ -84,8 +556,32 @@ void dummyHandler(HTTPRequest &r, HTTPResponder &resp);
 void respondError(HTTPRequest &r, HTTPResponder &resp);
 void respondNotFound(HTTPRequest &r, HTTPResponder &resp);
 void responseForbidden(HTTPRequest &r, HTTPResponder &resp);
+void respondUnavailable(HTTPRequest &r, HTTPResponder &resp);
+
+// How long clients may keep a file before checking whether it has
+// changed, as the max-age of a Cache-Control header, in seconds, by
+// extension (".css", say, in lower case).  Files with other extensions
+// get "otherwise".  A negative age means no Cache-Control header at all,
+// so the client decides for itself.
+struct CachePolicy
+{
+    std::map<std::string, int> maxAge;
+    int otherwise = -1;
+};
 
 // And this is a generator function for generating file responders.
-std::function<void(HTTPRequest &, HTTPResponder &)> generateFileResponder(std::string path);
+// Pass in a FileCache to share it between responders or to look at its
+// statistics, otherwise each responder gets its own.
+std::function<void(HTTPRequest &, HTTPResponder &)> generateFileResponder(std::string path,
+                                                                        std::shared_ptr<FileCache> cache = nullptr,
+                                                                        CachePolicy policy = CachePolicy());
+
+// And the same for an AssetBundle made by bundle_pack, serving its files
+// straight from the mapping.
+class AssetBundle;
+std::function<void(HTTPRequest &, HTTPResponder &)> generateBundleResponder(std::shared_ptr<AssetBundle> bundle,
+                                                                          CachePolicy policy = CachePolicy());
 
 std::string mimetype(std::string filename);
+
+#endif
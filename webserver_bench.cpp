@@ -0,0 +1,367 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "webserver.hpp"
+
+// A load generator for the webserver.  It starts a WebServer on a loopback
+// port, points a number of client threads at it and prints the throughput
+// and latency percentiles for each kind of request:
+//
+//   dummy     /dummy, the in-memory handler
+//   small     a 4KB static file
+//   large     a 1MB static file
+//   notfound  a path that 404s
+//
+// Clients either hold one keep-alive connection each and send a request as
+// soon as the last response is in, or open a fresh connection per request
+// with "Connection: close".  Run it before and after a change, on an
+// otherwise quiet machine, and compare.
+//
+// Usage: webserver_bench [--clients N] [--requests N] [--workers N]
+//                        [--mode keepalive|close|both]
+//                        [--backend epoll|io_uring] [--only SCENARIO]
+
+// Latencies go in a log-linear histogram, in the manner of HdrHistogram:
+// every power of two is split into the same number of linear sub-buckets,
+// so any value is recorded to within 0.1% and the whole thing is a flat
+// array of counts that two threads' worth can simply be added together.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : counts(bucketCount, 0) {}
+
+    void record(uint64_t nanos)
+    {
+        ++counts[indexFor(nanos)];
+        ++total;
+        maximum = std::max(maximum, nanos);
+    }
+
+    void add(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < bucketCount; ++i)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maximum; }
+
+    // The highest value that falls in the same bucket as the given
+    // percentile, the way HdrHistogram reports it.
+    uint64_t percentile(double p) const
+    {
+        if (total == 0)
+            return 0;
+        uint64_t wanted = std::max<uint64_t>(1, (uint64_t)(p / 100.0 * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; ++i)
+        {
+            seen += counts[i];
+            if (seen >= wanted)
+                return std::min(highestIn(i), maximum);
+        }
+        return maximum;
+    }
+
+private:
+    // 2048 sub-buckets gives three significant digits; 40 bits of
+    // nanoseconds is eighteen minutes, which is plenty.
+    static constexpr unsigned int subBits = 11;
+    static constexpr uint64_t subCount = 1 << subBits;
+    static constexpr uint64_t halfCount = subCount / 2;
+    static constexpr unsigned int maxBits = 40;
+    static constexpr size_t bucketCount = subCount + (maxBits - subBits + 1) * halfCount;
+
+    static size_t indexFor(uint64_t value)
+    {
+        value = std::min(value, ((uint64_t)1 << maxBits) - 1);
+        if (value < subCount)
+            return value;
+        unsigned int shift = (63 - __builtin_clzll(value)) - (subBits - 1);
+        return subCount + (shift - 1) * halfCount + ((value >> shift) - halfCount);
+    }
+
+    static uint64_t highestIn(size_t index)
+    {
+        if (index < subCount)
+            return index;
+        size_t k = index - subCount;
+        unsigned int shift = k / halfCount + 1;
+        uint64_t sub = k % halfCount + halfCount;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t maximum = 0;
+};
+
+struct Scenario
+{
+    const char *name;
+    const char *path;
+    int status;
+    // Big responses get fewer requests, so every scenario takes
+    // roughly as long.
+    int divisor;
+};
+
+static const Scenario scenarios[] = {
+    {"dummy", "/dummy", 200, 1},
+    {"small", "/small.html", 200, 1},
+    {"large", "/large.bin", 200, 20},
+    {"notfound", "/nothere.html", 404, 1},
+};
+
+struct Options
+{
+    int clients = 8;
+    int requests = 5000;
+    unsigned int workers = 1;
+    bool keepAlive = true;
+    bool close = true;
+    WebServer::Backend backend = WebServer::EPOLL;
+    std::string only;
+};
+
+static int connectTo(unsigned int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(s);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static bool sendAll(int s, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        auto result = send(s, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0)
+            return false;
+        sent += result;
+    }
+    return true;
+}
+
+// Reads one response and returns its status, or -1 if the connection
+// broke first.  The body is read (Content-Length tells us how much) but
+// not kept.
+static int readResponse(int s, std::string &buffer)
+{
+    buffer.clear();
+    size_t want = std::string::npos;
+    char chunk[65536];
+    while (want == std::string::npos || buffer.size() < want)
+    {
+        auto count = recv(s, chunk, sizeof(chunk), 0);
+        if (count <= 0)
+            return -1;
+        if (want == std::string::npos)
+        {
+            buffer.append(chunk, count);
+            auto end = buffer.find("\r\n\r\n");
+            if (end == std::string::npos)
+                continue;
+            auto length = buffer.find("Content-Length: ");
+            if (length == std::string::npos || length > end)
+                return -1;
+            want = end + 4 + strtoul(buffer.c_str() + length + 16, nullptr, 10);
+            // Keep just the headers and a count of the body from here on.
+            size_t have = buffer.size();
+            buffer.resize(end + 4);
+            want -= have - buffer.size();
+        }
+        else
+        {
+            want -= count;
+        }
+    }
+    if (buffer.size() < 12)
+        return -1;
+    return atoi(buffer.c_str() + 9);
+}
+
+struct ClientResult
+{
+    LatencyHistogram latencies;
+    uint64_t errors = 0;
+};
+
+static void runClient(unsigned int port, const Scenario &scenario, bool keepAlive, int requests,
+                      ClientResult &result)
+{
+    std::string request = std::string("GET ") + scenario.path + " HTTP/1.1\r\nHost: localhost\r\n" +
+                          (keepAlive ? "" : "Connection: close\r\n") + "\r\n";
+    std::string buffer;
+    int s = -1;
+    for (int i = 0; i < requests; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (s == -1)
+        {
+            s = connectTo(port);
+            if (s == -1)
+            {
+                ++result.errors;
+                continue;
+            }
+        }
+        int status = -1;
+        if (sendAll(s, request))
+        {
+            status = readResponse(s, buffer);
+        }
+        if (!keepAlive || status == -1)
+        {
+            close(s);
+            s = -1;
+        }
+        if (status != scenario.status)
+        {
+            ++result.errors;
+            continue;
+        }
+        std::chrono::nanoseconds took = std::chrono::steady_clock::now() - start;
+        result.latencies.record(took.count());
+    }
+    if (s != -1)
+        close(s);
+}
+
+static void runScenario(const Options &options, const Scenario &scenario, bool keepAlive, unsigned int port,
+                        const std::string &content)
+{
+    WebServer server(port, options.workers);
+    server.backend = options.backend;
+    server.maxRequestsPerConnection = 0xFFFFFFFF;
+    server.idleTimeoutMs = 60000;
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", generateFileResponder(content));
+    std::thread serving([&server]() { server.serve(); });
+
+    // One request first, so the file cache is warm and the server is
+    // definitely listening.
+    ClientResult warmup;
+    for (int attempt = 0; attempt < 100 && warmup.latencies.count() == 0; ++attempt)
+    {
+        runClient(port, scenario, false, 1, warmup);
+        if (warmup.latencies.count() == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    int requests = std::max(1, options.requests / scenario.divisor);
+    std::vector<ClientResult> results(options.clients);
+    std::vector<std::thread> clients;
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < options.clients; ++c)
+    {
+        clients.emplace_back(runClient, port, std::cref(scenario), keepAlive, requests, std::ref(results[c]));
+    }
+    for (auto &t : clients)
+    {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    server.stop();
+    serving.join();
+
+    ClientResult total;
+    for (auto &r : results)
+    {
+        total.latencies.add(r.latencies);
+        total.errors += r.errors;
+    }
+    auto micros = [](uint64_t nanos) { return nanos / 1000.0; };
+    std::cout << std::left << std::setw(10) << scenario.name << std::setw(11)
+              << (keepAlive ? "keepalive" : "close") << std::right << std::fixed << std::setprecision(0)
+              << std::setw(12) << total.latencies.count() / elapsed.count() << std::setprecision(1)
+              << std::setw(10) << micros(total.latencies.percentile(50)) << std::setw(10)
+              << micros(total.latencies.percentile(99)) << std::setw(10)
+              << micros(total.latencies.percentile(99.9)) << std::setw(10) << micros(total.latencies.max())
+              << std::setw(8) << total.errors << "\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--clients" && !value.empty())
+            options.clients = std::max(1, atoi(value.c_str()));
+        else if (arg == "--requests" && !value.empty())
+            options.requests = std::max(1, atoi(value.c_str()));
+        else if (arg == "--workers" && !value.empty())
+            options.workers = std::max(1, atoi(value.c_str()));
+        else if (arg == "--mode" && (value == "keepalive" || value == "close" || value == "both"))
+        {
+            options.keepAlive = value != "close";
+            options.close = value != "keepalive";
+        }
+        else if (arg == "--backend" && (value == "epoll" || value == "io_uring"))
+            options.backend = value == "epoll" ? WebServer::EPOLL : WebServer::IO_URING;
+        else if (arg == "--only" && !value.empty())
+            options.only = value;
+        else
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--clients N] [--requests N] [--workers N] [--mode keepalive|close|both]"
+                         " [--backend epoll|io_uring] [--only dummy|small|large|notfound]\n";
+            return 1;
+        }
+        ++i;
+    }
+
+    std::string content = "webserver_bench_content";
+    std::filesystem::create_directories(content);
+    std::ofstream(content + "/small.html", std::ios::binary) << std::string(4096, 's');
+    std::ofstream(content + "/large.bin", std::ios::binary) << std::string(1 << 20, 'l');
+
+    std::cout << options.clients << " clients, " << options.requests << " requests each, " << options.workers
+              << " worker(s), " << (options.backend == WebServer::EPOLL ? "epoll" : "io_uring") << "\n";
+    std::cout << std::left << std::setw(10) << "scenario" << std::setw(11) << "mode" << std::right
+              << std::setw(12) << "req/s" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << std::setw(10) << "max us" << std::setw(8) << "errors" << "\n";
+    unsigned int port = 18300;
+    for (const auto &scenario : scenarios)
+    {
+        if (!options.only.empty() && options.only != scenario.name)
+            continue;
+        if (options.keepAlive)
+            runScenario(options, scenario, true, port++, content);
+        if (options.close)
+            runScenario(options, scenario, false, port++, content);
+    }
+    std::filesystem::remove_all(content);
+    return 0;
+}
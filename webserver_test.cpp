@@ -1,6 +1,18 @@
 #include <gtest/gtest.h>
 
 #include "webserver.hpp"
+#include "alloccounter.hpp"
+#include "uring.hpp"
+#include "bundle.hpp"
+#include <thread>
+#include <unistd.h>
+#include <fstream>
+#include <filesystem>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 class MockHTTPResponder : public HTTPResponder
 {
@@ -13,6 +25,60 @@ public:
         payload = response;
         responseCode = status;
     }
+
+    // Files are read back in so tests can look at them like any other payload.
+    virtual void sendFile(std::shared_ptr<const CachedFile> file, int status = HTTPResponder::OK)
+    {
+        if (file->bytes)
+        {
+            payload = *file->bytes;
+        }
+        else
+        {
+            payload.resize(file->size);
+            auto count = pread(file->file->fd, payload.data(), file->size, 0);
+            payload.resize(count < 0 ? 0 : count);
+        }
+        responseCode = status;
+    }
+    virtual void sendFileRanges(std::shared_ptr<const CachedFile> file,
+                                const std::vector<std::pair<size_t, size_t>> &ranges)
+    {
+        sendFile(file);
+        std::string whole = payload;
+        payload.clear();
+        for (auto [first, last] : ranges)
+        {
+            payload += whole.substr(first, last - first + 1);
+        }
+        responseCode = HTTPResponder::PARTIAL_CONTENT;
+    }
+    virtual void sendMapped(std::shared_ptr<const void> owner, std::string_view body, std::string_view fixed,
+                            int status = HTTPResponder::OK)
+    {
+        (void)owner;
+        (void)fixed;
+        payload = body;
+        responseCode = status;
+    }
+    virtual void beginStream(int status = HTTPResponder::OK)
+    {
+        payload.clear();
+        responseCode = status;
+    }
+    virtual bool write(std::string_view data)
+    {
+        payload += data;
+        return true;
+    }
+    virtual void flush() {}
+    virtual void end() {}
+    virtual void sendNotModified(std::string_view validators)
+    {
+        (void)validators;
+        payload.clear();
+        responseCode = HTTPResponder::NOT_MODIFIED;
+    }
     MockHTTPResponder() : HTTPResponder(0) {}
 };
 
@@ -62,3 +128,1885 @@ TEST(WebserverTests, TestBasic)
     EXPECT_TRUE(response->payload.find("Webslobber") != std::string::npos);
     EXPECT_EQ(response->headers["Content-Type"], "text/html");
 }
+
+TEST(WebserverTests, TestMimetype)
+{
+    EXPECT_EQ(mimetype("index.html"), "text/html");
+    EXPECT_EQ(mimetype("logo.SVG"), "image/svg+xml");
+    EXPECT_EQ(mimetype("archive.tar.gz"), "application/octet-stream");
+    // No extension at all, which used to throw.
+    EXPECT_EQ(mimetype("README"), "application/octet-stream");
+}
+
+
+// These tests run a real server on the loopback interface, so we need
+// a couple of small blocking client helpers.
+int connectLoopback(unsigned int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+void sendAll(int s, std::string data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        auto result = send(s, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0)
+            return;
+        sent += result;
+    }
+}
+
+// Reads until the server closes the connection.
+std::string readAll(int s)
+{
+    std::string result;
+    char buffer[4096];
+    while (true)
+    {
+        auto count = recv(s, buffer, sizeof(buffer), 0);
+        if (count <= 0)
+            break;
+        result.append(buffer, count);
+    }
+    return result;
+}
+
+TEST(WebserverTests, TestEventLoopSlowClient)
+{
+    const unsigned int port = 18081;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", respondNotFound);
+    std::thread serving([&server]() { server.serve(3); });
+
+    // The slow client connects first and only sends half its request.
+    // With the old accept-then-serve loop this would stall everybody else.
+    int slow = connectLoopback(port);
+    ASSERT_NE(slow, -1);
+    sendAll(slow, "GET /dummy HTTP/1.1\r\nHost: lo");
+
+    for (int i = 0; i < 2; ++i)
+    {
+        int fast = connectLoopback(port);
+        ASSERT_NE(fast, -1);
+        sendAll(fast, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        auto response = readAll(fast);
+        close(fast);
+        EXPECT_EQ(response.substr(0, 13), "HTTP/1.1 200 ");
+        EXPECT_NE(response.find(dummypayload), std::string::npos);
+    }
+
+    sendAll(slow, "calhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(slow);
+    close(slow);
+    EXPECT_NE(response.find(dummypayload), std::string::npos);
+    serving.join();
+}
+
+TEST(WebserverTests, TestMultipleWorkers)
+{
+    const unsigned int port = 18082;
+    const int clients = 8;
+    const int requestsEach = 25;
+    WebServer server(port, 4);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", respondNotFound);
+    std::thread serving([&server]() { server.serve(clients * requestsEach); });
+
+    std::atomic<int> good = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&good]()
+                             {
+            for (int j = 0; j < requestsEach; ++j)
+            {
+                int s = connectLoopback(port);
+                if (s == -1)
+                    continue;
+                sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+                if (readAll(s).find(dummypayload) != std::string::npos)
+                    good++;
+                close(s);
+            } });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    serving.join();
+    EXPECT_EQ(good, clients * requestsEach);
+}
+
+// Three pipelined requests in one send should get three responses, in
+// order, on the same connection, with the last one asking us to close.
+TEST(WebserverTests, TestKeepAlivePipelining)
+{
+    const unsigned int port = 18083;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", respondNotFound);
+    std::thread serving([&server]() { server.serve(3); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /missing HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    auto first = response.find("HTTP/1.1 200 ");
+    auto second = response.find("HTTP/1.1 404 ");
+    auto third = response.find("HTTP/1.1 200 ", first + 1);
+    EXPECT_EQ(first, 0);
+    EXPECT_NE(second, std::string::npos);
+    EXPECT_NE(third, std::string::npos);
+    EXPECT_LT(second, third);
+    EXPECT_NE(response.find("Connection: keep-alive"), std::string::npos);
+    EXPECT_NE(response.find("Connection: close"), std::string::npos);
+
+    serving.join();
+}
+
+// A HEAD response has the headers a GET would, Content-Length included,
+// and no body, whichever way the body would have gone out, or a pipelined
+// client would read the body as the start of the next response.
+TEST(WebserverTests, TestHeadPipelining)
+{
+    const unsigned int port = 18105;
+    std::string dir = "head_test";
+    std::filesystem::create_directories(dir);
+    std::string small = "small file\n";
+    std::string big(300000, 'b');
+    std::ofstream(dir + "/small.txt", std::ios::binary) << small;
+    std::ofstream(dir + "/big.txt", std::ios::binary) << big;
+
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/stream", [](HTTPRequest &, HTTPResponder &resp)
+                           {
+        resp.write("streamed");
+        resp.end(); });
+    server.RegisterHandler("/mapped", [](HTTPRequest &, HTTPResponder &resp)
+                           { resp.sendMapped(nullptr, "mapped body", ""); });
+    server.RegisterHandler("/", generateFileResponder(dir));
+    std::thread serving([&server]() { server.serve(6); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "HEAD /small.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "HEAD /big.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "HEAD /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "HEAD /stream HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "HEAD /mapped HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    serving.join();
+    std::filesystem::remove_all(dir);
+
+    // Each HEAD response is only its headers, so the next one starts
+    // straight after them.
+    std::vector<std::string> heads;
+    size_t at = 0;
+    for (int i = 0; i < 5; ++i)
+    {
+        ASSERT_EQ(response.compare(at, 9, "HTTP/1.1 "), 0) << "response " << i << " at " << at;
+        auto end = response.find("\r\n\r\n", at);
+        ASSERT_NE(end, std::string::npos);
+        heads.push_back(response.substr(at, end + 4 - at));
+        at = end + 4;
+    }
+    EXPECT_NE(heads[0].find("Content-Length: " + std::to_string(small.size()) + "\r\n"), std::string::npos);
+    EXPECT_NE(heads[1].find("Content-Length: " + std::to_string(big.size()) + "\r\n"), std::string::npos);
+    EXPECT_NE(heads[2].find("Content-Length: " + std::to_string(std::string(dummypayload).size()) + "\r\n"),
+              std::string::npos);
+    EXPECT_NE(heads[3].find("Transfer-Encoding: chunked\r\n"), std::string::npos);
+    EXPECT_NE(heads[4].find("Content-Length: 11\r\n"), std::string::npos);
+    EXPECT_EQ(response.compare(at, 13, "HTTP/1.1 200 "), 0);
+    EXPECT_EQ(response.substr(response.size() - std::string(dummypayload).size()), dummypayload);
+}
+
+// A keep-alive client that just goes quiet is dropped after the idle
+// timeout, even though the server still has pages left to serve.
+TEST(WebserverTests, TestIdleTimeout)
+{
+    const unsigned int port = 18084;
+    WebServer server(port);
+    server.idleTimeoutMs = 50;
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", respondNotFound);
+    std::thread serving([&server]() { server.serve(2); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    EXPECT_NE(response.find(dummypayload), std::string::npos);
+    EXPECT_NE(response.find("Connection: keep-alive"), std::string::npos);
+
+    s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    readAll(s);
+    close(s);
+    serving.join();
+}
+
+// The file responder sends files with sendfile(), and a file that is
+// rewritten in place must be picked up again rather than served stale
+// from the descriptor cache.
+TEST(WebserverTests, TestSendFile)
+{
+    const unsigned int port = 18085;
+    std::string dir = "sendfile_test";
+    std::filesystem::create_directories(dir);
+    std::string big(300000, 'x');
+    for (size_t i = 0; i < big.size(); i += 1000)
+    {
+        big[i] = 'a' + (i / 1000) % 26;
+    }
+    std::ofstream(dir + "/big.txt", std::ios::binary) << big;
+
+    auto cache = std::make_shared<FileCache>();
+    WebServer server(port);
+    server.RegisterHandler("/", generateFileResponder(dir, cache));
+    std::thread serving([&server]() { server.serve(3); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /big.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /nothere.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    auto body = response.find("\r\n\r\n") + 4;
+    EXPECT_NE(response.find("Content-Length: 300000\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Content-Type: text/plain\r\n"), std::string::npos);
+    EXPECT_EQ(response.substr(body, big.size()), big);
+    EXPECT_NE(response.find("HTTP/1.1 404 ", body + big.size()), std::string::npos);
+
+    std::ofstream(dir + "/big.txt", std::ios::binary) << "changed";
+    // The cache hears about the change asynchronously.
+    for (int i = 0; i < 200 && cache->stats().invalidations == 0; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /big.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.substr(response.find("\r\n\r\n") + 4), "changed");
+    serving.join();
+    std::filesystem::remove_all(dir);
+}
+
+// Small files are served from memory until inotify tells the cache they
+// changed, and the least recently used ones are evicted to stay in budget.
+TEST(WebserverTests, TestFileCache)
+{
+    std::string dir = "filecache_test";
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir + "/a.html", std::ios::binary) << std::string(600, 'a');
+    std::ofstream(dir + "/b.svg", std::ios::binary) << std::string(600, 'b');
+
+    auto cache = std::make_shared<FileCache>(1000);
+    MockWebServer server;
+    server.RegisterHandler("/", generateFileResponder(dir, cache));
+
+    auto response = server.testWithRequest("a.html");
+    EXPECT_EQ(response->payload, std::string(600, 'a'));
+    EXPECT_EQ(response->headers["Content-Type"], "text/html");
+    response = server.testWithRequest("a.html");
+    EXPECT_EQ(response->payload, std::string(600, 'a'));
+    auto stats = cache->stats();
+    EXPECT_EQ(stats.misses, 1);
+    EXPECT_EQ(stats.hits, 1);
+    // The compressed copies of a.html count towards the budget too,
+    // but all those a's come out tiny.
+    EXPECT_GT(stats.bytes, 600);
+    EXPECT_LT(stats.bytes, 700);
+
+    // Both won't fit in 1000 bytes, so a.html has to go.
+    response = server.testWithRequest("b.svg");
+    EXPECT_EQ(response->headers["Content-Type"], "image/svg+xml");
+    stats = cache->stats();
+    EXPECT_EQ(stats.evictions, 1);
+    EXPECT_EQ(stats.entries, 1);
+
+    std::ofstream(dir + "/b.svg", std::ios::binary) << "new";
+    for (int i = 0; i < 200 && cache->stats().invalidations == 0; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_GE(cache->stats().invalidations, 1);
+    response = server.testWithRequest("b.svg");
+    EXPECT_EQ(response->payload, "new");
+
+    response = server.testWithRequest("nothere.html");
+    EXPECT_EQ(response->responseCode, 404);
+
+    // A directory that wasn't there when it was asked for still gets
+    // watched once a file turns up in it.
+    EXPECT_EQ(cache->get(dir + "/later/c.html"), nullptr);
+    std::filesystem::create_directories(dir + "/later");
+    std::ofstream(dir + "/later/c.html", std::ios::binary) << "old";
+    EXPECT_EQ(*cache->get(dir + "/later/c.html")->bytes, "old");
+    auto invalidations = cache->stats().invalidations;
+    std::ofstream(dir + "/later/c.html", std::ios::binary) << "new";
+    for (int i = 0; i < 200 && cache->stats().invalidations == invalidations; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_EQ(*cache->get(dir + "/later/c.html")->bytes, "new");
+    std::filesystem::remove_all(dir);
+}
+
+// A chunked upload trickled in over several sends reaches the handler
+// decoded, and the request after it on the connection still works.
+TEST(WebserverTests, TestChunkedRequest)
+{
+    const unsigned int port = 18086;
+    WebServer server(port);
+    server.RegisterHandler("/echo", [](HTTPRequest &r, HTTPResponder &resp)
+                           {
+        std::string payload = r.get_payload();
+        resp.sendResponse(payload); });
+    server.RegisterHandler("/", respondNotFound);
+    std::thread serving([&server]() { server.serve(2); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nab");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    sendAll(s, "cd\r\n2\r\nef\r\n0\r\n\r\nGET /echo HTTP/1.1\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    EXPECT_NE(response.find("Content-Length: 6\r\n\r\nabcdef"), std::string::npos);
+    EXPECT_NE(response.find("Content-Length: 0\r\n\r\n"), std::string::npos);
+    serving.join();
+}
+
+// The router has to pick the same handler the original substring search
+// did: the exact path if there is one, otherwise the longest registered
+// path ending in "/" that the request starts with.
+void tagHandler(HTTPRequest &r, HTTPResponder &resp)
+{
+    std::string payload = "static:" + r.get_resource();
+    resp.sendResponse(payload);
+}
+
+TEST(WebserverTests, TestRouting)
+{
+    MockWebServer server;
+    auto tagged = [](std::string tag)
+    {
+        return [tag](HTTPRequest &r, HTTPResponder &resp)
+        {
+            (void)r;
+            std::string payload = tag;
+            resp.sendResponse(payload);
+        };
+    };
+    server.RegisterHandler("/", tagged("root"));
+    server.RegisterHandler("/this/", tagged("this/"));
+    server.RegisterHandler("/this/is/a/", tagged("this/is/a/"));
+    server.RegisterHandler("/this/is/a/test", tagged("exact"));
+    server.RegisterHandler("/thin", tagged("thin"));
+    server.RegisterHandler("/this/isnt/", tagged("isnt/"));
+
+    EXPECT_EQ(server.testWithRequest("this/is/a/test")->payload, "exact");
+    EXPECT_EQ(server.testWithRequest("this/is/a/test/more")->payload, "this/is/a/");
+    EXPECT_EQ(server.testWithRequest("this/is/a/testing")->payload, "this/is/a/");
+    EXPECT_EQ(server.testWithRequest("this/is/b")->payload, "this/");
+    EXPECT_EQ(server.testWithRequest("this/isnt/")->payload, "isnt/");
+    EXPECT_EQ(server.testWithRequest("this/isn")->payload, "this/");
+    EXPECT_EQ(server.testWithRequest("thin")->payload, "thin");
+    EXPECT_EQ(server.testWithRequest("thin/x")->payload, "root");
+    EXPECT_EQ(server.testWithRequest("th")->payload, "root");
+    EXPECT_EQ(server.testServe("GET nope HTTP/1.1\r\n\r\n")->responseCode, 400);
+
+    // Registering the same path again replaces the handler.
+    server.RegisterHandler("/this/", tagged("replaced"));
+    EXPECT_EQ(server.testWithRequest("this/is/b")->payload, "replaced");
+
+    // Static routes compete with the registered ones on the same terms.
+    server.RegisterStaticRoutes<StaticRouter<Route<"/this/is/", tagHandler>, Route<"/thin", tagHandler>>>();
+    EXPECT_EQ(server.testWithRequest("this/is/b")->payload, "static:/this/is/b");
+    EXPECT_EQ(server.testWithRequest("this/is/a/b")->payload, "this/is/a/");
+    EXPECT_EQ(server.testWithRequest("thin")->payload, "thin");
+    EXPECT_EQ(server.testWithRequest("this/x")->payload, "replaced");
+
+    static_assert(Route<"/a/", tagHandler>::score("/a/b") == 3);
+    static_assert(Route<"/a", tagHandler>::score("/a/b") == 0);
+    static_assert(Route<"/a", tagHandler>::score("/a") == EXACT_MATCH);
+}
+
+TEST(WebserverTests, TestPartialWrites)
+{
+    // A non-blocking socket with a tiny send buffer fills up almost at
+    // once, so the queue has to stop partway through pieces and resume.
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    int small = 4096;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+
+    std::string expected;
+    OutputQueue queue;
+    for (int i = 0; i < 100; ++i)
+    {
+        std::string piece = "piece " + std::to_string(i) + ";";
+        queue.append(piece);
+        expected += piece;
+        auto shared = std::make_shared<const std::string>(std::string(3000, 'a' + i % 26));
+        queue.appendShared(shared);
+        expected += *shared;
+    }
+    EXPECT_EQ(queue.pending(), expected.size());
+
+    std::string received;
+    char buffer[1000];
+    int rounds = 0;
+    while (queue.write(pair[0]) == OutputQueue::AGAIN)
+    {
+        rounds++;
+        auto count = recv(pair[1], buffer, sizeof(buffer), 0);
+        ASSERT_GT(count, 0);
+        received.append(buffer, count);
+    }
+    EXPECT_GT(rounds, 1);
+    EXPECT_TRUE(queue.empty());
+    shutdown(pair[0], SHUT_WR);
+    received += readAll(pair[1]);
+    EXPECT_EQ(received, expected);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// Callers that send for themselves (the io_uring worker) only use
+// gather() and advance(), and once everything has gone the queue has to
+// start again at the front of its buffer just as write() does.
+TEST(WebserverTests, TestGatherAdvance)
+{
+    OutputQueue queue;
+    struct iovec vectors[4];
+    const void *start = nullptr;
+    for (int round = 0; round < 100; ++round)
+    {
+        std::string piece(1000, 'a' + round % 26);
+        queue.append(piece);
+        auto shared = std::make_shared<const std::string>("shared");
+        queue.appendShared(shared);
+        ASSERT_EQ(queue.gather(vectors, 4), 2);
+        if (round == 0)
+            start = vectors[0].iov_base;
+        EXPECT_EQ(vectors[0].iov_base, start);
+        EXPECT_EQ(std::string((const char *)vectors[0].iov_base, vectors[0].iov_len), piece);
+        // Partway through a piece, then the rest.
+        queue.advance(600);
+        ASSERT_EQ(queue.gather(vectors, 4), 2);
+        EXPECT_EQ(vectors[0].iov_len, 400u);
+        queue.advance(400 + shared->size());
+        EXPECT_TRUE(queue.empty());
+        EXPECT_EQ(queue.gather(vectors, 4), 0);
+    }
+}
+
+TEST(WebserverTests, TestLargeResponseWithoutEventLoop)
+{
+    // Without an output queue the responder sends on its own, and has
+    // to keep going until the whole body is out even when it is far
+    // bigger than the socket buffer.
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    std::string body(4 << 20, 'x');
+    std::string received;
+    std::thread reader([&]() { received = readAll(pair[1]); });
+    {
+        HTTPResponder responder(pair[0]);
+        responder.headers["Content-Length"] = "1";
+        responder.sendResponse(body);
+    }
+    shutdown(pair[0], SHUT_WR);
+    reader.join();
+
+    auto split = received.find("\r\n\r\n");
+    ASSERT_NE(split, std::string::npos);
+    auto head = received.substr(0, split + 4);
+    EXPECT_EQ(head.substr(0, 13), "HTTP/1.1 200 ");
+    EXPECT_NE(head.find("Content-Length: " + std::to_string(body.size()) + "\r\n"), std::string::npos);
+    EXPECT_EQ(head.find("Content-Length: 1\r\n"), std::string::npos);
+    EXPECT_EQ(received.size() - head.size(), body.size());
+    close(pair[0]);
+    close(pair[1]);
+}
+
+TEST(WebserverTests, TestArena)
+{
+    Arena arena(256);
+    std::pmr::map<std::pmr::string, std::pmr::string> small(&arena);
+    small["Connection"] = "keep-alive";
+    EXPECT_GT(arena.used(), 0);
+    EXPECT_EQ(arena.capacity(), 256);
+
+    // Outgrowing the block still works (and is counted as an allocation),
+    // and the block is bigger next time.
+    {
+        auto before = allocationCount();
+        std::pmr::vector<char> big(1000, 'x', &arena);
+        EXPECT_EQ(big[999], 'x');
+        EXPECT_EQ(allocationCount(), before + 1);
+    }
+    arena.reset();
+    EXPECT_EQ(arena.used(), 0);
+    EXPECT_GE(arena.capacity(), 1000);
+
+    // But only so far.
+    Arena capped(256, 4096);
+    {
+        std::pmr::vector<char> huge(100000, 'x', &capped);
+        EXPECT_EQ(huge[99999], 'x');
+    }
+    capped.reset();
+    EXPECT_EQ(capped.capacity(), 4096);
+    {
+        std::pmr::vector<char> huge(100000, 'x', &capped);
+    }
+    capped.reset();
+    EXPECT_EQ(capped.capacity(), 4096);
+}
+
+// Once a keep-alive connection is warmed up, a whole round of reading,
+// parsing, dispatching and sending a request shouldn't allocate anything.
+TEST(WebserverTests, TestSteadyStateAllocations)
+{
+    auto before = allocationCount();
+    auto counted = std::make_unique<int>(1);
+    EXPECT_EQ(allocationCount(), before + 1);
+
+    const unsigned int port = 18087;
+    const int rounds = 40;
+    std::array<uint64_t, rounds> counts = {};
+    int calls = 0;
+    size_t lengths = 0;
+    WebServer server(port);
+    server.RegisterHandler("/count/", [&](HTTPRequest &r, HTTPResponder &resp)
+                           {
+                               // Looking at the request doesn't copy it out of the arena.
+                               lengths = r.get_resource_view().size() + r.get_header("x-long").size();
+                               // This runs on the worker's thread, so it sees its count.
+                               counts[calls++] = allocationCount();
+                               static std::string payload = "counted";
+                               resp.sendResponse(payload);
+                           });
+    std::thread serving([&server]() { server.serve(rounds); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    for (int i = 0; i < rounds; ++i)
+    {
+        // Long enough that none of it fits in a short string.
+        sendAll(s, "GET /count/" + std::string(300, 'u') + " HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n"
+                   "X-Long: " + std::string(1000, 'h') + "\r\n\r\n");
+        std::string response;
+        char buffer[4096];
+        while (response.find("counted") == std::string::npos)
+        {
+            auto count = recv(s, buffer, sizeof(buffer), 0);
+            ASSERT_GT(count, 0);
+            response.append(buffer, count);
+        }
+    }
+    close(s);
+    serving.join();
+
+    ASSERT_EQ(calls, rounds);
+    EXPECT_EQ(lengths, 307u + 1000u);
+    EXPECT_EQ(counts[rounds - 1], counts[rounds / 2]);
+}
+
+// A slow async handler runs on the pool, so other connections on the same
+// worker carry on, and a request pipelined behind it still comes second.
+TEST(WebserverTests, TestAsyncHandlers)
+{
+    const unsigned int port = 18088;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterAsyncHandler("/slow", [](HTTPRequest &r, HTTPResponder &resp)
+                                {
+                                    (void)r;
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                                    std::string payload = "slow";
+                                    resp.sendResponse(payload);
+                                });
+    std::thread serving([&server]() { server.serve(3); });
+
+    int slow = connectLoopback(port);
+    ASSERT_NE(slow, -1);
+    sendAll(slow, "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    auto started = std::chrono::steady_clock::now();
+    int fast = connectLoopback(port);
+    ASSERT_NE(fast, -1);
+    sendAll(fast, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(fast);
+    close(fast);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(200));
+    EXPECT_NE(response.find(dummypayload), std::string::npos);
+
+    response = readAll(slow);
+    close(slow);
+    auto first = response.find("\r\n\r\nslow");
+    auto second = response.find(dummypayload);
+    EXPECT_NE(first, std::string::npos);
+    EXPECT_NE(second, std::string::npos);
+    EXPECT_LT(first, second);
+    serving.join();
+}
+
+// Once the pool's queue is full, further async requests get a 503.
+TEST(WebserverTests, TestHandlerPoolSaturated)
+{
+    const unsigned int port = 18089;
+    WebServer server(port);
+    server.handlerThreads = 1;
+    server.maxQueuedHandlers = 1;
+    std::atomic<bool> started = false;
+    std::atomic<bool> release = false;
+    server.RegisterAsyncHandler("/block", [&](HTTPRequest &r, HTTPResponder &resp)
+                                {
+                                    (void)r;
+                                    started = true;
+                                    while (!release)
+                                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                                    std::string payload = "done";
+                                    resp.sendResponse(payload);
+                                });
+    std::thread serving([&server]() { server.serve(3); });
+
+    const std::string request = "GET /block HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    // The first one keeps the only thread busy...
+    int running = connectLoopback(port);
+    ASSERT_NE(running, -1);
+    sendAll(running, request);
+    while (!started)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // ...the second fills the queue...
+    int queued = connectLoopback(port);
+    ASSERT_NE(queued, -1);
+    sendAll(queued, request);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // ...and the third is turned away.
+    int rejected = connectLoopback(port);
+    ASSERT_NE(rejected, -1);
+    sendAll(rejected, request);
+    auto response = readAll(rejected);
+    close(rejected);
+    EXPECT_EQ(response.substr(0, 13), "HTTP/1.1 503 ");
+
+    release = true;
+    EXPECT_NE(readAll(running).find("done"), std::string::npos);
+    EXPECT_NE(readAll(queued).find("done"), std::string::npos);
+    close(running);
+    close(queued);
+    serving.join();
+}
+
+// Work from outside the pool runs in the order it came, and work a task
+// submits runs straight after it, newest first.
+TEST(WebserverTests, TestThreadPoolOrder)
+{
+    std::vector<int> order;
+    std::atomic<bool> release = false;
+    {
+        ThreadPool pool(1, 100);
+        ThreadPool *self = &pool;
+        ASSERT_TRUE(pool.trySubmit([&]()
+                                   {
+            while (!release)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1)); }));
+        for (int i = 0; i < 5; ++i)
+        {
+            ASSERT_TRUE(pool.trySubmit([&order, self, i]()
+                                       {
+                order.push_back(i);
+                if (i == 0)
+                {
+                    self->trySubmit([&order]() { order.push_back(10); });
+                    self->trySubmit([&order]() { order.push_back(11); });
+                } }));
+        }
+        release = true;
+    }
+    EXPECT_EQ(order, (std::vector<int>{0, 11, 10, 1, 2, 3, 4}));
+}
+
+HandlerTask sleepyHandler(HTTPRequest &r, HTTPResponder &resp)
+{
+    (void)r;
+    co_await sleepFor(std::chrono::milliseconds(200));
+    std::string payload = "slept";
+    resp.sendResponse(payload);
+}
+
+// Coroutine handlers wait on the event loop without holding it up.
+TEST(WebserverTests, TestCoroutineHandlers)
+{
+    const unsigned int port = 18090;
+    int pipeFds[2];
+    ASSERT_EQ(pipe(pipeFds), 0);
+    auto path = std::filesystem::temp_directory_path() / "coroutine_test.txt";
+    {
+        std::ofstream out(path);
+        out << "from the disk";
+    }
+
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/sleep", sleepyHandler);
+    server.RegisterHandler("/pipe", [&](HTTPRequest &r, HTTPResponder &resp) -> HandlerTask
+                           {
+                               (void)r;
+                               auto events = co_await readable(pipeFds[0]);
+                               char buffer[64];
+                               auto count = read(pipeFds[0], buffer, sizeof(buffer));
+                               std::string payload = (events & EPOLLIN) ? std::string(buffer, count) : "no data";
+                               resp.sendResponse(payload);
+                           });
+    server.RegisterHandler("/file", [&](HTTPRequest &r, HTTPResponder &resp) -> HandlerTask
+                           {
+                               (void)r;
+                               std::string payload = co_await readFile(path.string());
+                               resp.sendResponse(payload);
+                           });
+    std::thread serving([&server]() { server.serve(4); });
+
+    const std::string close = " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    int sleeping = connectLoopback(port);
+    ASSERT_NE(sleeping, -1);
+    sendAll(sleeping, "GET /sleep" + close);
+    int piped = connectLoopback(port);
+    ASSERT_NE(piped, -1);
+    sendAll(piped, "GET /pipe" + close);
+
+    // Both of those are waiting, but the loop still answers everyone else.
+    auto started = std::chrono::steady_clock::now();
+    int fast = connectLoopback(port);
+    ASSERT_NE(fast, -1);
+    sendAll(fast, "GET /dummy" + close);
+    EXPECT_NE(readAll(fast).find(dummypayload), std::string::npos);
+    ::close(fast);
+    int file = connectLoopback(port);
+    ASSERT_NE(file, -1);
+    sendAll(file, "GET /file" + close);
+    EXPECT_NE(readAll(file).find("\r\n\r\nfrom the disk"), std::string::npos);
+    ::close(file);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(150));
+
+    ASSERT_EQ(write(pipeFds[1], "through the pipe", 16), 16);
+    EXPECT_NE(readAll(piped).find("\r\n\r\nthrough the pipe"), std::string::npos);
+    EXPECT_NE(readAll(sleeping).find("\r\n\r\nslept"), std::string::npos);
+    ::close(piped);
+    ::close(sleeping);
+    serving.join();
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    std::filesystem::remove(path);
+
+    // Without an event loop the same handler just blocks.
+    MockWebServer mock;
+    mock.RegisterHandler("/sleep", sleepyHandler);
+    EXPECT_EQ(mock.testWithRequest("sleep")->payload, "slept");
+}
+
+// The same kind of traffic through the io_uring worker: pipelined
+// keep-alive requests, a file big enough to go out in linked read and
+// send pieces, a 404, and a slow client's request arriving in parts.
+TEST(WebserverTests, TestUringBackend)
+{
+    if (!IoUring::supported())
+    {
+        GTEST_SKIP() << "io_uring isn't available here";
+    }
+    const unsigned int port = 18091;
+    std::string dir = "uring_test";
+    std::filesystem::create_directories(dir);
+    std::string big(300000, 'x');
+    for (size_t i = 0; i < big.size(); i += 1000)
+    {
+        big[i] = 'a' + (i / 1000) % 26;
+    }
+    std::ofstream(dir + "/big.txt", std::ios::binary) << big;
+
+    WebServer server(port);
+    server.backend = WebServer::IO_URING;
+    server.RegisterHandler("/dummy", dummyHandler);
+    server.RegisterHandler("/", generateFileResponder(dir));
+    std::thread serving([&server]() { server.serve(5); });
+
+    int slow = connectLoopback(port);
+    ASSERT_NE(slow, -1);
+    sendAll(slow, "GET /dummy HTTP/1.1\r\nHost: lo");
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /big.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /nothere.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.find("HTTP/1.1 200 "), 0);
+    EXPECT_NE(response.find(dummypayload), std::string::npos);
+    auto body = response.find("Content-Length: 300000\r\n");
+    ASSERT_NE(body, std::string::npos);
+    body = response.find("\r\n\r\n", body) + 4;
+    EXPECT_EQ(response.substr(body, big.size()), big);
+    EXPECT_NE(response.find("HTTP/1.1 404 ", body + big.size()), std::string::npos);
+
+    sendAll(slow, "calhost\r\nConnection: close\r\n\r\n");
+    response = readAll(slow);
+    close(slow);
+    EXPECT_NE(response.find(dummypayload), std::string::npos);
+
+    // Anything malformed still counts as a page, and gets the
+    // connection closed.
+    s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "BLAH /dummy HTTP/1.1\r\n\r\n");
+    readAll(s);
+    close(s);
+    serving.join();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(WebserverTests, TestStop)
+{
+    const unsigned int port = 18092;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(); });
+
+    int s = -1;
+    for (int attempt = 0; attempt < 100 && s == -1; ++attempt)
+    {
+        s = connectLoopback(port);
+    }
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    EXPECT_NE(readAll(s).find(dummypayload), std::string::npos);
+    close(s);
+
+    // Without a page budget, only stop() gets serve() to return.
+    server.stop();
+    serving.join();
+}
+
+TEST(WebserverTests, TestMetrics)
+{
+    const unsigned int port = 18093;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(5); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /nothere HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    readAll(s);
+    close(s);
+    s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "BLAH /dummy HTTP/1.1\r\n\r\n");
+    readAll(s);
+    close(s);
+
+    s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    serving.join();
+
+    EXPECT_EQ(response.find("HTTP/1.1 200 "), 0);
+    EXPECT_NE(response.find("Content-Type: text/plain; version=0.0.4"), std::string::npos);
+    EXPECT_NE(response.find("webserver_responses_total{code=\"200\"} 2\n"), std::string::npos);
+    EXPECT_NE(response.find("webserver_responses_total{code=\"404\"} 1\n"), std::string::npos);
+    EXPECT_NE(response.find("webserver_parse_errors_total 1\n"), std::string::npos);
+    EXPECT_NE(response.find("webserver_request_duration_seconds_count{route=\"/dummy\"} 2\n"), std::string::npos);
+    EXPECT_NE(response.find("webserver_request_duration_seconds_bucket{route=\"/dummy\",le=\"+Inf\"} 2\n"),
+              std::string::npos);
+    EXPECT_NE(response.find("webserver_request_duration_seconds_count{route=\"none\"} 1\n"), std::string::npos);
+
+    // By now the /metrics response has been counted too.
+    EXPECT_EQ(server.metrics.responses(200), 3);
+    EXPECT_GT(server.metrics.total(Metrics::BYTES_IN), 0);
+    EXPECT_GT(server.metrics.total(Metrics::BYTES_OUT), response.size());
+}
+
+TEST(WebserverTests, TestAccessLog)
+{
+    const unsigned int port = 18094;
+    std::string path = "access_test.log";
+    std::filesystem::remove(path);
+    WebServer server(port);
+    server.accessLogOptions.path = path;
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(2); });
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "HEAD /not\\here HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    serving.join();
+
+    // serve() doesn't return until the log has been written.
+    std::ifstream in(path);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);)
+    {
+        lines.push_back(line);
+    }
+    ASSERT_EQ(lines.size(), 2);
+    EXPECT_EQ(lines[0].find("{\"time\":\""), 0);
+    EXPECT_NE(lines[0].find("\"peer\":\"127.0.0.1:"), std::string::npos);
+    EXPECT_NE(lines[0].find("\"method\":\"GET\",\"resource\":\"/dummy\",\"status\":200,\"bytes\":"),
+              std::string::npos);
+    EXPECT_NE(lines[1].find("\"method\":\"HEAD\",\"resource\":\"/not\\\\here\",\"status\":404,"), std::string::npos);
+    // Between them the two lines account for the whole response.
+    auto bytes = [](const std::string &line)
+    { return std::stoul(line.substr(line.find("\"bytes\":") + 8)); };
+    EXPECT_EQ(bytes(lines[0]) + bytes(lines[1]), response.size());
+    std::filesystem::remove(path);
+}
+
+TEST(WebserverTests, TestAccessLogDropsAndRotates)
+{
+    std::string path = "access_rotate.log";
+    for (auto suffix : {"", ".1", ".2", ".3"})
+    {
+        std::filesystem::remove(path + suffix);
+    }
+    AccessLog::Options options;
+    options.path = path;
+    options.ringSize = 4;
+    options.rotateBytes = 1000;
+    options.keep = 2;
+    // Long enough that only flush() writes anything.
+    options.flushInterval = std::chrono::hours(1);
+    struct sockaddr_in peer = {};
+    {
+        AccessLog log(options);
+        ASSERT_TRUE(log.ok());
+        // A full ring drops the rest rather than waiting.
+        for (int i = 0; i < 10; ++i)
+        {
+            log.log("GET", "/" + std::to_string(i), 200, 10, std::chrono::microseconds(5), peer);
+        }
+        EXPECT_EQ(log.dropped(), 6);
+        log.flush();
+        EXPECT_EQ(log.written(), 4);
+        // Each line is ~140 bytes, so this goes through a few files.
+        for (int round = 0; round < 6; ++round)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                log.log("GET", "/", 200, 10, std::chrono::microseconds(5), peer);
+            }
+            log.flush();
+        }
+        EXPECT_EQ(log.dropped(), 6);
+        EXPECT_EQ(log.written(), 28);
+    }
+    EXPECT_TRUE(std::filesystem::exists(path));
+    EXPECT_TRUE(std::filesystem::exists(path + ".1"));
+    EXPECT_TRUE(std::filesystem::exists(path + ".2"));
+    EXPECT_FALSE(std::filesystem::exists(path + ".3"));
+    EXPECT_LE(std::filesystem::file_size(path), 1000);
+
+    // And sampling only keeps every sampleEvery'th.
+    std::filesystem::remove(path);
+    options.sampleEvery = 3;
+    options.ringSize = 64;
+    {
+        AccessLog log(options);
+        for (int i = 0; i < 9; ++i)
+        {
+            log.log("GET", "/", 200, 10, std::chrono::microseconds(5), peer);
+        }
+        log.flush();
+        EXPECT_EQ(log.written(), 3);
+        EXPECT_EQ(log.dropped(), 0);
+    }
+    for (auto suffix : {"", ".1", ".2"})
+    {
+        std::filesystem::remove(path + suffix);
+    }
+}
+
+// Inflates a gzip (or, with "gzip" false, zlib) stream.
+static std::string inflateBody(const std::string &data, bool gzip)
+{
+    z_stream z = {};
+    inflateInit2(&z, gzip ? 15 + 16 : 15);
+    std::string out(1 << 20, '\0');
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    z.next_out = (Bytef *)out.data();
+    z.avail_out = out.size();
+    int result = inflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    inflateEnd(&z);
+    return result == Z_STREAM_END ? out : "";
+}
+
+TEST(WebserverTests, TestCompression)
+{
+    const unsigned int port = 18095;
+    std::string dir = "compression_test";
+    std::filesystem::create_directories(dir);
+    std::string page;
+    for (int i = 0; page.size() < 5000; ++i)
+    {
+        page += "<p>Paragraph number " + std::to_string(i) + " of a very repetitive page.</p>\n";
+    }
+    std::ofstream(dir + "/page.html", std::ios::binary) << page;
+    std::ofstream(dir + "/logo.svg", std::ios::binary) << std::string(2000, 's');
+    std::ofstream(dir + "/logo.svg.gz", std::ios::binary) << "precompressed";
+    std::ofstream(dir + "/photo.png", std::ios::binary) << std::string(2000, 'p');
+
+    WebServer server(port);
+    server.RegisterHandler("/", generateFileResponder(dir));
+    std::thread serving([&server]() { server.serve(6); });
+
+    auto fetch = [port](std::string path, std::string acceptEncoding)
+    {
+        int s = connectLoopback(port);
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n";
+        if (!acceptEncoding.empty())
+            request += "Accept-Encoding: " + acceptEncoding + "\r\n";
+        sendAll(s, request + "\r\n");
+        auto response = readAll(s);
+        close(s);
+        return response;
+    };
+    auto body = [](const std::string &response) { return response.substr(response.find("\r\n\r\n") + 4); };
+
+    auto response = fetch("/page.html", "deflate, gzip;q=1.0");
+    EXPECT_NE(response.find("Content-Encoding: gzip\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Vary: Accept-Encoding\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Content-Type: text/html\r\n"), std::string::npos);
+    EXPECT_LT(body(response).size(), page.size() / 4);
+    EXPECT_EQ(inflateBody(body(response), true), page);
+
+    response = fetch("/page.html", "gzip;q=0.5, deflate");
+    EXPECT_NE(response.find("Content-Encoding: deflate\r\n"), std::string::npos);
+    EXPECT_EQ(inflateBody(body(response), false), page);
+
+    // Nothing acceptable, so the file as it is, but still with the Vary.
+    response = fetch("/page.html", "br, gzip;q=0");
+    EXPECT_EQ(response.find("Content-Encoding:"), std::string::npos);
+    EXPECT_NE(response.find("Vary: Accept-Encoding\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), page);
+
+    response = fetch("/page.html", "");
+    EXPECT_EQ(response.find("Content-Encoding:"), std::string::npos);
+    EXPECT_EQ(body(response), page);
+
+    // A .gz next to the file is sent as it is.
+    response = fetch("/logo.svg", "*");
+    EXPECT_NE(response.find("Content-Encoding: gzip\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Content-Type: image/svg+xml\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), "precompressed");
+
+    // PNGs are compressed already.
+    response = fetch("/photo.png", "gzip");
+    EXPECT_EQ(response.find("Content-Encoding:"), std::string::npos);
+    EXPECT_EQ(response.find("Vary:"), std::string::npos);
+    EXPECT_EQ(body(response).size(), 2000);
+
+    serving.join();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(WebserverTests, TestConditionalRequests)
+{
+    const unsigned int port = 18096;
+    std::string dir = "conditional_test";
+    std::filesystem::create_directories(dir);
+    std::string page;
+    while (page.size() < 2000)
+    {
+        page += "<p>The same paragraph, over and over again.</p>\n";
+    }
+    std::ofstream(dir + "/page.html", std::ios::binary) << page;
+    std::ofstream(dir + "/app.CSS", std::ios::binary) << "body {}";
+    // A fixed mtime so the dates below are known.
+    struct timespec times[2] = {{1700000000, 0}, {1700000000, 0}};
+    utimensat(AT_FDCWD, (dir + "/page.html").c_str(), times, 0);
+
+    CachePolicy policy;
+    policy.maxAge[".css"] = 86400;
+    policy.otherwise = 60;
+    WebServer server(port);
+    server.RegisterHandler("/", generateFileResponder(dir, nullptr, policy));
+    std::thread serving([&server]() { server.serve(8); });
+
+    auto fetch = [port](std::string path, std::string extra)
+    {
+        int s = connectLoopback(port);
+        sendAll(s, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + extra + "\r\n");
+        auto response = readAll(s);
+        close(s);
+        return response;
+    };
+    auto header = [](const std::string &response, const std::string &name)
+    {
+        auto start = response.find("\r\n" + name + ": ");
+        if (start == std::string::npos)
+            return std::string();
+        start += name.size() + 4;
+        return response.substr(start, response.find("\r\n", start) - start);
+    };
+
+    auto response = fetch("/page.html", "");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 200 "), 0);
+    std::string etag = header(response, "ETag");
+    ASSERT_GT(etag.size(), 2);
+    EXPECT_EQ(etag.front(), '"');
+    EXPECT_EQ(header(response, "Last-Modified"), "Tue, 14 Nov 2023 22:13:20 GMT");
+    EXPECT_EQ(header(response, "Cache-Control"), "max-age=60");
+
+    // The same ETag, in a list and weak, gets a 304 with no body.
+    response = fetch("/page.html", "If-None-Match: \"other\", W/" + etag + "\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 304 "), 0);
+    EXPECT_EQ(header(response, "ETag"), etag);
+    EXPECT_EQ(header(response, "Cache-Control"), "max-age=60");
+    EXPECT_EQ(header(response, "Content-Length"), "");
+    EXPECT_EQ(response.substr(response.find("\r\n\r\n") + 4), "");
+
+    // If-None-Match wins over If-Modified-Since.
+    response = fetch("/page.html", "If-None-Match: \"other\"\r\nIf-Modified-Since: Wed, 15 Nov 2023 00:00:00 GMT\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 200 "), 0);
+
+    response = fetch("/page.html", "If-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 304 "), 0);
+    response = fetch("/page.html", "If-Modified-Since: Tue, 14 Nov 2023 22:13:19 GMT\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 200 "), 0);
+    response = fetch("/page.html", "If-Modified-Since: yesterday\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 200 "), 0);
+
+    // The compressed version has an ETag of its own.
+    response = fetch("/page.html", "Accept-Encoding: gzip\r\nIf-None-Match: " + etag + "\r\n");
+    EXPECT_EQ(response.compare(0, 13, "HTTP/1.1 200 "), 0);
+    EXPECT_NE(header(response, "ETag"), etag);
+
+    response = fetch("/app.CSS", "");
+    EXPECT_EQ(header(response, "Cache-Control"), "max-age=86400");
+
+    serving.join();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(WebserverTests, TestRanges)
+{
+    const unsigned int port = 18097;
+    std::string dir = "range_test";
+    std::filesystem::create_directories(dir);
+    std::string small, big;
+    for (int i = 0; i < 1000; ++i)
+    {
+        small += (char)('a' + i % 26);
+    }
+    for (int i = 0; i < 300000; ++i)
+    {
+        big += (char)('0' + i % 10);
+    }
+    std::ofstream(dir + "/small.png", std::ios::binary) << small;
+    std::ofstream(dir + "/big.png", std::ios::binary) << big;
+
+    // Anything over 4K is kept open rather than read in.
+    auto cache = std::make_shared<FileCache>(1 << 20, 4096);
+    WebServer server(port);
+    server.RegisterHandler("/", generateFileResponder(dir, cache));
+    std::thread serving([&server]() { server.serve(10); });
+
+    auto fetch = [port](std::string path, std::string extra)
+    {
+        int s = connectLoopback(port);
+        sendAll(s, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + extra + "\r\n");
+        auto response = readAll(s);
+        close(s);
+        return response;
+    };
+    auto body = [](const std::string &response) { return response.substr(response.find("\r\n\r\n") + 4); };
+    auto status = [](const std::string &response) { return response.substr(9, 3); };
+
+    auto response = fetch("/small.png", "");
+    EXPECT_EQ(status(response), "200");
+    EXPECT_NE(response.find("Accept-Ranges: bytes\r\n"), std::string::npos);
+
+    response = fetch("/small.png", "Range: bytes=10-19\r\n");
+    EXPECT_EQ(status(response), "206");
+    EXPECT_NE(response.find("Content-Range: bytes 10-19/1000\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Content-Length: 10\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), small.substr(10, 10));
+
+    // Out of the middle of a file sent with sendfile().
+    response = fetch("/big.png", "Range: bytes=123456-\r\n");
+    EXPECT_EQ(status(response), "206");
+    EXPECT_NE(response.find("Content-Range: bytes 123456-299999/300000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), big.substr(123456));
+
+    response = fetch("/big.png", "Range: bytes=-5\r\n");
+    EXPECT_EQ(body(response), big.substr(big.size() - 5));
+
+    response = fetch("/big.png", "Range: bytes=0-1, 299998-400000\r\n");
+    EXPECT_EQ(status(response), "206");
+    auto type = response.find("Content-Type: multipart/byteranges; boundary=");
+    ASSERT_NE(type, std::string::npos);
+    auto start = response.find("boundary=", type) + 9;
+    auto boundary = response.substr(start, response.find("\r\n", start) - start);
+    EXPECT_EQ(body(response), "\r\n--" + boundary + "\r\nContent-Type: image/png\r\nContent-Range: bytes 0-1/300000\r\n\r\n01" +
+                                  "\r\n--" + boundary + "\r\nContent-Type: image/png\r\nContent-Range: bytes 299998-299999/300000\r\n\r\n89" +
+                                  "\r\n--" + boundary + "--\r\n");
+
+    response = fetch("/small.png", "Range: bytes=1000-\r\n");
+    EXPECT_EQ(status(response), "416");
+    EXPECT_NE(response.find("Content-Range: bytes */1000\r\n"), std::string::npos);
+
+    // Nonsense is ignored, and so is a Range for something that changed.
+    response = fetch("/small.png", "Range: lines=1-2\r\n");
+    EXPECT_EQ(status(response), "200");
+    EXPECT_EQ(body(response), small);
+    response = fetch("/small.png", "Range: bytes=0-0\r\nIf-Range: \"stale\"\r\n");
+    EXPECT_EQ(status(response), "200");
+
+    response = fetch("/small.png", "");
+    auto etag = response.substr(response.find("ETag: ") + 6);
+    etag = etag.substr(0, etag.find("\r\n"));
+    response = fetch("/small.png", "Range: bytes=0-0\r\nIf-Range: " + etag + "\r\n");
+    EXPECT_EQ(status(response), "206");
+    EXPECT_EQ(body(response), "a");
+
+    serving.join();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(WebserverTests, TestBundle)
+{
+    std::string dir = "bundle_test";
+    std::filesystem::create_directories(dir + "/deep/er");
+    for (int i = 0; i < 500; ++i)
+    {
+        std::ofstream(dir + "/file" + std::to_string(i) + ".txt", std::ios::binary) << "contents " << i;
+    }
+    std::ofstream(dir + "/deep/er/index.html", std::ios::binary) << "deep";
+    std::ofstream(dir + "/empty.png", std::ios::binary);
+    ASSERT_TRUE(AssetBundle::pack(dir, "bundle_test.bundle"));
+
+    auto bundle = AssetBundle::open("bundle_test.bundle");
+    ASSERT_NE(bundle, nullptr);
+    EXPECT_EQ(bundle->size(), 502);
+    AssetBundle::Asset asset;
+    for (int i = 0; i < 500; ++i)
+    {
+        ASSERT_TRUE(bundle->find("/file" + std::to_string(i) + ".txt", asset));
+        EXPECT_EQ(asset.identity.body, "contents " + std::to_string(i));
+        EXPECT_EQ(asset.mimetype, "text/plain");
+    }
+    ASSERT_TRUE(bundle->find("/deep/er/index.html", asset));
+    EXPECT_EQ(asset.identity.body, "deep");
+    EXPECT_EQ(asset.identity.etag.front(), '"');
+    EXPECT_NE(asset.identity.headers.find("ETag: "), std::string_view::npos);
+    EXPECT_EQ(asset.identity.validators.substr(0, 6), "ETag: ");
+    ASSERT_TRUE(bundle->find("/empty.png", asset));
+    EXPECT_EQ(asset.identity.body, "");
+    EXPECT_FALSE(bundle->find("/file500.txt", asset));
+    EXPECT_FALSE(bundle->find("file1.txt", asset));
+    EXPECT_FALSE(bundle->find("", asset));
+
+    // Cut short, it is refused rather than read past the end of.
+    std::filesystem::resize_file("bundle_test.bundle", std::filesystem::file_size("bundle_test.bundle") - 1);
+    EXPECT_EQ(AssetBundle::open("bundle_test.bundle"), nullptr);
+    EXPECT_EQ(AssetBundle::open("no_such.bundle"), nullptr);
+
+    std::filesystem::remove_all(dir);
+    std::filesystem::remove("bundle_test.bundle");
+}
+
+TEST(WebserverTests, TestBundleResponder)
+{
+    const unsigned int port = 18098;
+    std::string dir = "bundle_responder_test";
+    std::filesystem::create_directories(dir + "/sub");
+    std::string page;
+    while (page.size() < 4000)
+    {
+        page += "<p>Packed and gzipped ahead of time.</p>\n";
+    }
+    std::ofstream(dir + "/sub/index.html", std::ios::binary) << page;
+    std::ofstream(dir + "/logo.svg", std::ios::binary) << std::string(1000, 's');
+    std::ofstream(dir + "/logo.svg.gz", std::ios::binary) << "precompressed";
+    ASSERT_TRUE(AssetBundle::pack(dir, "bundle_responder_test.bundle"));
+    // The bundle stands alone once it is packed.
+    std::filesystem::remove_all(dir);
+    auto bundle = AssetBundle::open("bundle_responder_test.bundle");
+    ASSERT_NE(bundle, nullptr);
+    EXPECT_EQ(bundle->size(), 2);
+
+    CachePolicy policy;
+    policy.maxAge[".svg"] = 3600;
+    WebServer server(port);
+    server.RegisterHandler("/", generateBundleResponder(bundle, policy));
+    std::thread serving([&server]() { server.serve(7); });
+
+    auto fetch = [port](std::string path, std::string extra)
+    {
+        int s = connectLoopback(port);
+        sendAll(s, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + extra + "\r\n");
+        auto response = readAll(s);
+        close(s);
+        return response;
+    };
+    auto body = [](const std::string &response) { return response.substr(response.find("\r\n\r\n") + 4); };
+    auto status = [](const std::string &response) { return response.substr(9, 3); };
+
+    auto response = fetch("/sub/", "");
+    EXPECT_EQ(status(response), "200");
+    EXPECT_NE(response.find("Content-Type: text/html\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Content-Length: " + std::to_string(page.size()) + "\r\n"), std::string::npos);
+    EXPECT_NE(response.find("Vary: Accept-Encoding\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), page);
+    auto etag = response.substr(response.find("ETag: ") + 6);
+    etag = etag.substr(0, etag.find("\r\n"));
+
+    response = fetch("/sub/index.html", "Accept-Encoding: gzip\r\n");
+    EXPECT_NE(response.find("Content-Encoding: gzip\r\n"), std::string::npos);
+    EXPECT_EQ(inflateBody(body(response), true), page);
+
+    response = fetch("/sub/index.html", "If-None-Match: " + etag + "\r\n");
+    EXPECT_EQ(status(response), "304");
+    EXPECT_EQ(body(response), "");
+
+    response = fetch("/sub/index.html", "Range: bytes=3-5\r\n");
+    EXPECT_EQ(status(response), "206");
+    EXPECT_NE(response.find("Content-Range: bytes 3-5/" + std::to_string(page.size()) + "\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), page.substr(3, 3));
+
+    response = fetch("/logo.svg", "Accept-Encoding: gzip\r\n");
+    EXPECT_EQ(body(response), "precompressed");
+    EXPECT_NE(response.find("Cache-Control: max-age=3600\r\n"), std::string::npos);
+
+    response = fetch("/logo.svg.gz", "");
+    EXPECT_EQ(status(response), "404");
+    response = fetch("/missing.html", "");
+    EXPECT_EQ(status(response), "404");
+
+    serving.join();
+    std::filesystem::remove("bundle_responder_test.bundle");
+}
+
+// Undoes Transfer-Encoding: chunked, returning "" if "body" isn't a
+// complete chunked body.
+static std::string unchunk(std::string body)
+{
+    std::string out;
+    size_t at = 0;
+    while (true)
+    {
+        auto end = body.find("\r\n", at);
+        if (end == std::string::npos)
+            return "";
+        size_t size = std::stoul(body.substr(at, end - at), nullptr, 16);
+        at = end + 2;
+        if (size == 0)
+            return body.compare(at, std::string::npos, "\r\n") == 0 ? out : "";
+        if (body.size() < at + size + 2 || body.compare(at + size, 2, "\r\n") != 0)
+            return "";
+        out += body.substr(at, size);
+        at += size + 2;
+    }
+}
+
+TEST(WebserverTests, TestStreaming)
+{
+    const unsigned int port = 18099;
+    std::string expected;
+    for (int i = 0; i < 5000; ++i)
+    {
+        expected += "line " + std::to_string(i) + "\n";
+    }
+    // A lot, in writes small enough to be gathered up.
+    const size_t slowTotal = 32 << 20;
+    std::atomic<size_t> slowWritten = 0;
+
+    WebServer server(port);
+    server.RegisterHandler("/lines", [](HTTPRequest &r, HTTPResponder &resp)
+                           {
+        (void)r;
+        resp.headers["Content-Type"] = "text/plain";
+        resp.beginStream();
+        for (int i = 0; i < 5000; ++i)
+        {
+            resp.write("line " + std::to_string(i) + "\n");
+        }
+        resp.end(); });
+    server.RegisterAsyncHandler("/slow", [&slowWritten, slowTotal](HTTPRequest &r, HTTPResponder &resp)
+                                {
+        (void)r;
+        resp.streamMaxBuffered = 64 << 10;
+        std::string piece(1024, 'x');
+        // Left to the destructor to end.
+        for (size_t i = 0; i < slowTotal / piece.size(); ++i)
+        {
+            if (!resp.write(piece))
+                break;
+            slowWritten += piece.size();
+        } });
+    std::thread serving([&server]() { server.serve(4); });
+
+    // Two on one connection, so the first had better end properly.
+    int s = connectLoopback(port);
+    sendAll(s, "GET /lines HTTP/1.1\r\nHost: localhost\r\n\r\n"
+               "GET /lines HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    auto response = readAll(s);
+    close(s);
+    auto second = response.find("HTTP/1.1 200", 1);
+    ASSERT_NE(second, std::string::npos);
+    for (auto one : {response.substr(0, second), response.substr(second)})
+    {
+        EXPECT_NE(one.find("Transfer-Encoding: chunked\r\n"), std::string::npos);
+        EXPECT_EQ(one.find("Content-Length:"), std::string::npos);
+        auto body = one.substr(one.find("\r\n\r\n") + 4);
+        // Gathered into far fewer chunks than there were writes.
+        EXPECT_LT(std::count(body.begin(), body.end(), '\r'), 100);
+        EXPECT_EQ(unchunk(body), expected);
+    }
+
+    // A client that isn't reading holds the handler up, rather than
+    // everything it writes piling up in memory.
+    s = connectLoopback(port);
+    sendAll(s, "GET /slow HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_LT(slowWritten.load(), slowTotal / 2);
+    response = readAll(s);
+    close(s);
+    EXPECT_EQ(slowWritten.load(), slowTotal);
+    auto body = unchunk(response.substr(response.find("\r\n\r\n") + 4));
+    EXPECT_EQ(body.size(), slowTotal);
+
+    // Serving stops with the last page, whatever is still to be sent, so
+    // that mustn't be the big one.
+    s = connectLoopback(port);
+    sendAll(s, "GET /lines HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    readAll(s);
+    close(s);
+    serving.join();
+}
+
+// Adds up what it is given, and responds with how much and the sum.
+struct CountingSink : BodySink
+{
+    std::atomic<size_t> &seen;
+    size_t bytes = 0;
+    uint64_t sum = 0;
+
+    CountingSink(std::atomic<size_t> &_seen) : seen(_seen) {}
+    void write(std::string_view piece) override
+    {
+        bytes += piece.size();
+        for (unsigned char c : piece)
+            sum += c;
+        seen += piece.size();
+    }
+    void finish(HTTPResponder &responder) override
+    {
+        std::string body = std::to_string(bytes) + " " + std::to_string(sum);
+        responder.sendResponse(body);
+    }
+};
+
+TEST(WebserverTests, TestUploads)
+{
+    const unsigned int port = 18100;
+    std::atomic<size_t> seen = 0;
+    WebServer server(port);
+    server.maxBodyBytes = 1024;
+    server.maxStreamedBodyBytes = 8 << 20;
+    server.RegisterBodyHandler("/upload", [&seen](HTTPRequest &r)
+                               {
+        (void)r;
+        return std::make_unique<CountingSink>(seen); });
+    server.RegisterHandler("/echo", [](HTTPRequest &r, HTTPResponder &resp)
+                           {
+        std::string body = r.get_payload();
+        resp.sendResponse(body); });
+    std::thread serving([&server]() { server.serve(6); });
+    auto body = [](const std::string &response) { return response.substr(response.find("\r\n\r\n") + 4); };
+
+    std::string data;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < (3 << 20); ++i)
+    {
+        data += (char)('a' + i % 26);
+        sum += 'a' + i % 26;
+    }
+    auto expected = std::to_string(data.size()) + " " + std::to_string(sum);
+
+    // The sink sees the start of a body long before the end has been sent.
+    int s = connectLoopback(port);
+    sendAll(s, "POST /upload HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\nContent-Length: " +
+                   std::to_string(data.size()) + "\r\n\r\n" + data.substr(0, 1 << 20));
+    for (int i = 0; i < 200 && seen == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_GT(seen.load(), 0u);
+    sendAll(s, data.substr(1 << 20));
+    auto response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.substr(0, 12), "HTTP/1.1 200");
+    EXPECT_EQ(body(response), expected);
+
+    // A chunked one, after being told to go ahead, and a buffered request
+    // behind it on the same connection.
+    s = connectLoopback(port);
+    sendAll(s, "POST /upload HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n"
+               "Expect: 100-continue\r\n\r\n");
+    std::string interim;
+    char buffer[256];
+    while (interim.find("\r\n\r\n") == std::string::npos)
+    {
+        auto count = recv(s, buffer, sizeof(buffer), 0);
+        if (count <= 0)
+            break;
+        interim.append(buffer, count);
+    }
+    EXPECT_EQ(interim, "HTTP/1.1 100 Continue\r\n\r\n");
+    std::string chunked;
+    char size[16];
+    for (size_t at = 0; at < data.size(); at += 50000)
+    {
+        auto piece = data.substr(at, 50000);
+        snprintf(size, sizeof(size), "%zx\r\n", piece.size());
+        chunked += size + piece + "\r\n";
+    }
+    sendAll(s, chunked + "0\r\n\r\nPOST /echo HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+                         "Content-Length: 5\r\n\r\nhello");
+    response = readAll(s);
+    close(s);
+    auto second = response.find("HTTP/1.1 200", 1);
+    ASSERT_NE(second, std::string::npos);
+    EXPECT_EQ(body(response.substr(0, second)), expected);
+    EXPECT_EQ(body(response.substr(second)), "hello");
+
+    // Too much to buffer for an ordinary handler, or to take at all for a
+    // body handler.
+    for (auto request : {"POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 2000\r\n\r\n",
+                         "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: 16777216\r\n\r\n"})
+    {
+        s = connectLoopback(port);
+        sendAll(s, request);
+        response = readAll(s);
+        close(s);
+        EXPECT_EQ(response.substr(0, 12), "HTTP/1.1 413") << request;
+        EXPECT_NE(response.find("Connection: close\r\n"), std::string::npos);
+    }
+
+    s = connectLoopback(port);
+    sendAll(s, "GET /echo HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    readAll(s);
+    close(s);
+    serving.join();
+    EXPECT_EQ(server.metrics.responses(413), 2u);
+}
+
+// The request view keeps a fixed number of headers, and a request with
+// more gets a 431 rather than just having its connection closed.
+TEST(WebserverTests, TestTooManyHeaders)
+{
+    const unsigned int port = 18106;
+    WebServer server(port);
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(2); });
+    auto request = [](size_t headers)
+    {
+        std::string text = "GET /dummy HTTP/1.1\r\nConnection: close\r\n";
+        for (size_t i = 1; i < headers; ++i)
+            text += "X-Header-" + std::to_string(i) + ": " + std::to_string(i) + "\r\n";
+        return text + "\r\n";
+    };
+
+    int s = connectLoopback(port);
+    sendAll(s, request(HTTPRequestView::maxHeaders));
+    auto response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.substr(0, 12), "HTTP/1.1 200");
+
+    s = connectLoopback(port);
+    sendAll(s, request(HTTPRequestView::maxHeaders + 1));
+    response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.substr(0, 12), "HTTP/1.1 431");
+    EXPECT_NE(response.find("Connection: close\r\n"), std::string::npos);
+
+    serving.join();
+    EXPECT_EQ(server.metrics.responses(431), 1u);
+}
+
+TEST(WebserverTests, TestTimerWheel)
+{
+    using namespace std::chrono_literals;
+    // Only 80ms round, so the 200ms timer goes round more than once.
+    TimerWheel<int> wheel(10ms, 8);
+    auto start = std::chrono::steady_clock::now();
+    wheel.schedule(start + 25ms, 1);
+    wheel.schedule(start + 200ms, 2);
+    wheel.schedule(start - 5ms, 0);
+    EXPECT_EQ(wheel.size(), 3u);
+    std::vector<int> fired;
+    auto collect = [&fired](int value) { fired.push_back(value); };
+
+    wheel.expire(start, collect);
+    EXPECT_TRUE(fired.empty());
+    wheel.expire(start + 15ms, collect);
+    EXPECT_EQ(fired, std::vector<int>({0}));
+    wheel.expire(start + 35ms, collect);
+    EXPECT_EQ(fired, std::vector<int>({0, 1}));
+    wheel.expire(start + 150ms, collect);
+    EXPECT_EQ(fired.size(), 2u);
+    EXPECT_LE(wheel.nextTick(), start + 170ms);
+    wheel.expire(start + 1s, collect);
+    EXPECT_EQ(fired, std::vector<int>({0, 1, 2}));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(WebserverTests, TestAdmission)
+{
+    Admission::Options options;
+    options.maxConnections = 3;
+    options.maxConnectionsPerPeer = 2;
+    options.requestsPerSecond = 20;
+    options.burst = 3;
+    options.tableSize = 16;
+    Admission admission(options);
+    const uint32_t a = inet_addr("10.0.0.1"), b = inet_addr("10.0.0.2"), c = inet_addr("10.0.0.3");
+
+    EXPECT_EQ(admission.connect(a), Admission::ADMIT);
+    EXPECT_EQ(admission.connect(a), Admission::ADMIT);
+    EXPECT_EQ(admission.connect(a), Admission::PEER_FULL);
+    EXPECT_EQ(admission.connect(b), Admission::ADMIT);
+    EXPECT_EQ(admission.connect(c), Admission::FULL);
+    EXPECT_EQ(admission.connections(), 3u);
+    admission.disconnect(a);
+    EXPECT_EQ(admission.connect(c), Admission::ADMIT);
+
+    // A burst of three, and then one every 50ms.
+    for (int i = 0; i < 3; ++i)
+        EXPECT_TRUE(admission.request(b));
+    EXPECT_FALSE(admission.request(b));
+    EXPECT_TRUE(admission.request(c));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_TRUE(admission.request(b));
+    EXPECT_FALSE(admission.request(b));
+
+    // Far more addresses than slots come and go.  Slots are handed on once
+    // their addresses are done with them, and the counts stay right
+    // however the threads interleave.
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&admission, t]()
+                             {
+            for (uint32_t i = 0; i < 20000; ++i)
+            {
+                uint32_t address = htonl(0x0b000000 + (i % 64));
+                if (admission.connect(address) == Admission::ADMIT)
+                    admission.disconnect(address);
+            } });
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(admission.connections(), 3u);
+    admission.disconnect(a);
+    admission.disconnect(b);
+    admission.disconnect(c);
+    EXPECT_EQ(admission.connections(), 0u);
+    EXPECT_EQ(admission.connect(a), Admission::ADMIT);
+    EXPECT_EQ(admission.connect(a), Admission::ADMIT);
+    EXPECT_EQ(admission.connect(a), Admission::PEER_FULL);
+}
+
+TEST(WebserverTests, TestAdmissionControl)
+{
+    const unsigned int port = 18101;
+    WebServer server(port);
+    server.headerTimeoutMs = 300;
+    server.admissionOptions.maxConnectionsPerPeer = 2;
+    server.admissionOptions.requestsPerSecond = 1;
+    server.admissionOptions.burst = 4;
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(6); });
+
+    // A client that trickles its headers in is cut off all the same.
+    auto started = std::chrono::steady_clock::now();
+    int s = connectLoopback(port);
+    std::string trickle = "GET /dummy HTTP/1.1\r\nHost: localhost\r\nX-Slow: " + std::string(100, 'x');
+    bool cutOff = false;
+    char buffer[16];
+    for (size_t i = 0; i < trickle.size() && !cutOff; ++i)
+    {
+        sendAll(s, trickle.substr(i, 1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        cutOff = recv(s, buffer, sizeof(buffer), MSG_DONTWAIT) == 0;
+    }
+    close(s);
+    EXPECT_TRUE(cutOff);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(1500));
+
+    // Two connections from one address at once, but not three.
+    int first = connectLoopback(port);
+    int second = connectLoopback(port);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    s = connectLoopback(port);
+    auto response = readAll(s);
+    close(s);
+    EXPECT_EQ(response.substr(0, 12), "HTTP/1.1 429");
+    close(first);
+    close(second);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // And a burst of four requests, but not five.
+    s = connectLoopback(port);
+    std::string requests;
+    for (int i = 0; i < 5; ++i)
+        requests += "GET /dummy HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    sendAll(s, requests);
+    response = readAll(s);
+    close(s);
+    size_t ok = 0;
+    for (size_t at = response.find("HTTP/1.1 200"); at != std::string::npos; at = response.find("HTTP/1.1 200", at + 1))
+        ++ok;
+    EXPECT_EQ(ok, 4u);
+    auto refused = response.find("HTTP/1.1 429");
+    ASSERT_NE(refused, std::string::npos);
+    EXPECT_NE(response.find("Retry-After: 1\r\n", refused), std::string::npos);
+
+    serving.join();
+    EXPECT_EQ(server.metrics.total(Metrics::SHED), 2u);
+    EXPECT_EQ(server.metrics.total(Metrics::TIMEOUTS), 1u);
+    EXPECT_EQ(server.metrics.responses(429), 2u);
+}
+
+// A client that keeps sending but never takes its response is timed out
+// like any other idle one, however busy it looks.  The response is big
+// enough that the socket buffers can't take it all.
+TEST(WebserverTests, TestUnreadClientTimesOut)
+{
+    const unsigned int port = 18104;
+    WebServer server(port);
+    server.idleTimeoutMs = 200;
+    server.RegisterHandler("/big", [](HTTPRequest &, HTTPResponder &resp)
+                           {
+        std::string payload(32 << 20, 'x');
+        resp.sendResponse(payload); });
+    std::thread serving([&server]() { server.serve(); });
+
+    int s = -1;
+    for (int attempt = 0; attempt < 100 && s == -1; ++attempt)
+        s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    auto started = std::chrono::steady_clock::now();
+    bool cutOff = false;
+    while (!cutOff && std::chrono::steady_clock::now() - started < std::chrono::seconds(3))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        cutOff = send(s, "x", 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && errno != EAGAIN;
+    }
+    close(s);
+    EXPECT_TRUE(cutOff);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(2));
+    server.stop();
+    serving.join();
+}
+
+// A client that pipelines requests for big responses and never reads any
+// of them.  Once the output is backed up the server stops reading, so
+// what it buffers stays small and the rest waits in the kernel (and then
+// the client), and it still serves everybody else.  "buffered" is how
+// much it may have read all the same.
+static void floodWithoutReading(WebServer::Backend backend, unsigned int port, size_t buffered)
+{
+    WebServer server(port);
+    server.backend = backend;
+    server.RegisterHandler("/big", [](HTTPRequest &, HTTPResponder &resp)
+                           {
+        std::string payload(4 << 20, 'x');
+        resp.sendResponse(payload); });
+    server.RegisterHandler("/dummy", dummyHandler);
+    std::thread serving([&server]() { server.serve(); });
+
+    int flood = -1;
+    for (int attempt = 0; attempt < 100 && flood == -1; ++attempt)
+        flood = connectLoopback(port);
+    ASSERT_NE(flood, -1);
+    std::string requests;
+    while (requests.size() < 64 * 1024)
+        requests += "GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    size_t sent = 0;
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    int stalled = 0;
+    while (std::chrono::steady_clock::now() < until && stalled < 20)
+    {
+        auto count = send(flood, requests.data(), requests.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (count > 0)
+        {
+            sent += count;
+            stalled = 0;
+            continue;
+        }
+        stalled++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // The client's send gets stuck, not the server's memory.
+    EXPECT_EQ(stalled, 20);
+    EXPECT_GT(sent, 1u << 20);
+    EXPECT_LT(server.metrics.total(Metrics::BYTES_IN), buffered);
+
+    int s = connectLoopback(port);
+    ASSERT_NE(s, -1);
+    sendAll(s, "GET /dummy HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    EXPECT_NE(readAll(s).find(dummypayload), std::string::npos);
+    close(s);
+    close(flood);
+    server.stop();
+    serving.join();
+}
+
+TEST(WebserverTests, TestUnreadPipeline)
+{
+    floodWithoutReading(WebServer::EPOLL, 18102, 256 * 1024);
+    // A multishot recv can fill every buffer in the ring before we get
+    // round to cancelling it.
+    if (IoUring::supported())
+        floodWithoutReading(WebServer::IO_URING, 18103, 2 << 20);
+}